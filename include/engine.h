@@ -50,6 +50,20 @@ void traverse_Index_list( Index_list * );
 
 /****************** Seg_Results *************************/
 
+/* The state carried from one source to the next in a scan back
+   through the sources of a single target, for one qualifier and 
+   segment list: the segments that start at or after the last 
+   source have been folded into total, and next is the index of 
+   the first segment that has not */
+
+typedef struct {
+  boolean valid;
+  int last_src;
+  int next;
+  boolean has;
+  double total;
+} Seg_Accumulator;
+
 typedef struct {
   Array *raw_scores;
   Array *has_score;
@@ -57,10 +71,17 @@ typedef struct {
   boolean has_exact_at_tgt;
   boolean exact_extends_beyond_tgt;
   boolean exact_extends_beyond_src;
+
+  /* incremental scoring; see start_scan_Seg_Results */
+  Compiled_Relation *inc_rel;
+  int inc_tgt_pos;
+  Seg_Accumulator *inc_state;   /* 4 per qualifier, one per list */
+  int inc_alloc;
 } Seg_Results;
 
 void free_Seg_Results( Seg_Results * );
 Seg_Results *new_Seg_Results( int );
+void start_scan_Seg_Results( Seg_Results *, Compiled_Relation *, int );
 
 
 
@@ -70,6 +91,12 @@ double calculate_segment_score(Gaze_Sequence *,
 			       Feature *,
 			       Gaze_Structure *,
 			       Seg_Results * );
+
+double calculate_segment_score_for_relation(Gaze_Sequence *, 
+					    Compiled_Relation *,
+					    int,
+					    int,
+					    Seg_Results * );
 	
 Array *calculate_post_accuracies( Array *, int, double);			
 
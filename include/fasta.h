@@ -0,0 +1,49 @@
+/**********************************************************************
+ ** File: fasta.h
+ * Author: Kevin Howe
+ * Copyright (C) Genome Research Limited, 2002-
+ *-------------------------------------------------------------------
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *-------------------------------------------------------------------
+ **********************************************************************/
+#ifndef _GAZE_FASTA
+#define _GAZE_FASTA
+
+#include "util.h"
+
+/* An index of a FASTA file, in the format of samtools faidx (kept in 
+   the file FASTA_INDEX_SUFFIX next to it). For each sequence it gives
+   the length, the byte offset of the first base, and the number of 
+   bases and bytes in each line, from which the offset of any base 
+   follows. An index is made (and saved) when there is none, or when
+   it is older than the FASTA file */
+
+#define FASTA_INDEX_SUFFIX ".fai"
+
+typedef struct {
+  int length;
+  long offset;
+  int line_bases;
+  int line_width;
+} FASTA_Index_Seq;
+
+typedef struct {
+  char *file_name;
+  boolean usable;       /* FALSE if the file cannot be indexed */
+  Dict *names;
+  Array *seqs;          /* of FASTA_Index_Seq, parallel to names */
+} FASTA_Index;
+
+void use_FASTA_Index( boolean );
+void free_FASTA_Index_cache( void );
+int read_FASTA_region( char *, char *, int, int, char **, int * );
+
+#endif
@@ -18,8 +18,13 @@
 #define _G_ENGINE
 
 #include "engine.h"
+#include "logsum.h"
 #include "output.h"
 
+/* The scans treat a source as dominated, for the purpose of pruning, 
+   when its score falls this far (in log space) below the best */
+
+#define DP_DOMINANCE_MARGIN 25.0
 
 typedef struct {
   double pth_score;
@@ -31,6 +36,26 @@ typedef struct {
   int ***fringes;    /* indices of last "significant" feature, organised first by			
 		        target type, then by source type, then by frame */
   Seg_Results *seg_res;
+
+  unsigned int rand_state;  /* private state for rand_r, so that concurrent
+			       dp calculations do not share an RNG */
+
+  double *cand_scores;   /* scratch space for the scans: the scores and */
+  int *cand_indices;     /* indices of the candidates for the current feature */
+  int num_cands;
+  int cand_alloc;
+
+  int beam_width;        /* most sources summed per frame in a scan of a pair; 0 for all */
+  double *beam_scores;   /* per-frame min-heaps of the beam_width best */
+  int *beam_indices;     /* scores in the current scan, with their features */
+  int beam_len[3];
+  double margin;         /* for the dominance pruning; see above */
+
+  boolean mea;           /* max-only scans score paths by their expected */
+  double mea_total;      /* accuracy, given the total forward score (see mea_calc) */
+
+  long num_allocs;       /* allocations made by the scans, and the number */
+  long num_scans;        /* of scans, for the -verbose statistics */
   
 } Gaze_DP_struct;    
 
@@ -49,6 +74,22 @@ void backwards_calc(Gaze_Sequence *,
 		    Gaze_Structure *,
 		    boolean);
 
+void mea_calc(Gaze_Sequence *,
+	      Gaze_Structure *);
+
+void forwards_calc_partitioned(Gaze_Sequence *,
+			       Gaze_Structure *,
+			       boolean, 
+			       Gaze_Output *,
+			       int,
+			       boolean);
+
+void backwards_calc_partitioned(Gaze_Sequence *,
+				Gaze_Structure *,
+				boolean,
+				int,
+				boolean);
+
 void scan_through_sources_dp(Gaze_Sequence *,
 			     Gaze_Structure *,
 			     int,
@@ -69,6 +110,8 @@ void scan_through_sources_for_max_only( Gaze_Sequence *,
 					boolean);
 
 void trace_back_general(Gaze_Sequence * );
+void trace_back_nbest(Gaze_Sequence *, int );
+Array **sample_trace_backs(Gaze_Sequence *, int, unsigned int, int );
 
 
 #endif
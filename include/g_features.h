@@ -45,8 +45,8 @@ StartEnd *new_StartEnd(int, int);
 typedef struct {
   StartEnd real_pos;
   StartEnd adj_pos;
-  short int feat_idx;
-  short int dna;
+  int feat_idx;
+  int dna;
   boolean is_selected;
   boolean is_antiselected;
   boolean is_correct;
@@ -69,6 +69,64 @@ Feature *new_Feature(void);
 void write_Feature(FILE *, Feature *, Array *, Array *);
 
 
+/*************************************************************/
+/********************** Feature_Table ************************/
+/*************************************************************/
+
+/* A column-wise copy of the (sorted) feature list of a sequence, 
+   for the dp, whose scans run through the columns. Each column is 
+   indexed by the position of the feature in the list. The Feature
+   structs remain the master copy between dp passes */
+
+typedef struct {
+  int len;
+
+  int *real_s;
+  int *real_e;
+  int *adj_s;
+  int *adj_e;
+  int *feat_idx;
+  int *dna;
+  boolean *is_selected;
+  double *score;
+
+  /* columns changed by the dp */
+  boolean *invalid;
+  int *trace_pointer;
+  double *path_score;
+  double *forward_score;
+  double *backward_score;
+
+  /* the best few partial paths to each feature, best first, when 
+     they are wanted (see alloc_nbest_Feature_Table); each path is 
+     given by the feature before it and the rank of the path to that 
+     feature that it extends */
+  int nbest;                 /* 0 when not in use */
+  int *nbest_count;          /* per feature */
+  double *nbest_score;       /* nbest per feature */
+  int *nbest_trace;
+  int *nbest_rank;
+
+  /* the candidate predecessors of each feature, with their forward
+     scores, when they are kept for drawing sampled paths after the 
+     forward pass; those of feature i are at samp_start[i] up to 
+     samp_start[i+1] (see append_samples_Feature_Table) */
+  int *samp_start;           /* NULL when not in use */
+  int *samp_src;
+  double *samp_score;
+  int samp_alloc;
+} Feature_Table;
+
+void alloc_nbest_Feature_Table(Feature_Table *, int);
+void alloc_samples_Feature_Table(Feature_Table *);
+void append_samples_Feature_Table(Feature_Table *, int, double *, int *, int);
+Feature_Table *clone_Feature_Table(Feature_Table *);
+void free_Feature_Table(Feature_Table *);
+Feature_Table *new_Feature_Table(Array *);
+void load_Feature_Table(Feature_Table *, Array *);
+void store_Feature_Table(Feature_Table *, Array *);
+
+
 /*************************************************************/
 /************************ Segment ****************************/
 /*************************************************************/
@@ -129,6 +187,28 @@ typedef struct {
 void free_GFF_to_Gaze_entities(GFF_to_Gaze_entities *);
 GFF_to_Gaze_entities *new_GFF_to_Gaze_entities(void);
 
+/* The rules above, compiled for lookup by (source, feature). Each
+   bucket holds, in order, the indices of the rules that name exactly
+   that pair, where a NULL field is the wildcard; a line is matched by
+   looking up the four buckets that could apply to it, and checking
+   the strand and frame of the rules found there */
+
+typedef struct {
+  char *gff_source;
+  char *gff_feature;
+  Array *rules;        /* of int; NULL for an empty bucket */
+} GFF_Dispatch_Bucket;
+
+typedef struct {
+  Array *gff2fts;      /* of GFF_to_Gaze_entities *; not owned */
+  GFF_Dispatch_Bucket *table;
+  int size;            /* a power of 2 */
+} GFF_Dispatch;
+
+void free_GFF_Dispatch( GFF_Dispatch * );
+GFF_Dispatch *new_GFF_Dispatch( Array * );
+int match_GFF_Dispatch( GFF_Dispatch *, GFF_line *, int * );
+
 /***************** GFF parsing ***************************/
 
 /**************** Sort comparison routines ************/
@@ -35,9 +35,48 @@ typedef struct {
 void free_GFF_line( GFF_line * );
 GFF_line *new_GFF_line( void );
 int read_GFF_line(FILE *, GFF_line *);
+int read_GFF_line_for_seq(FILE *, GFF_line *, const char *);
 
 void write_GFF_line( FILE *, char *, char *, char *, int, int, double, char *, char *, char *);
 void write_GFF_header( FILE *, char *name, int start, int end );
 void write_GFF_comment( FILE *, char *, ... );
 
+
+/* A sidecar index of a GFF file (kept in the file GFF_INDEX_SUFFIX
+   next to it), giving for each seqname the byte ranges of its lines 
+   in blocks of at most GFF_INDEX_BLOCK_LINES, with the range of 
+   positions covered by each block. The lines for a region can then
+   be taken straight from the (mapped) file. The index is rebuilt
+   when the size or modification time of the GFF file changes */
+
+#define GFF_INDEX_SUFFIX ".gidx"
+#define GFF_INDEX_BLOCK_LINES 1024
+
+typedef struct {
+  long offset;
+  long len;
+  int min_start;
+  int max_end;
+} GFF_Index_Block;
+
+typedef struct {
+  char *seqname;
+  Array *blocks;      /* of GFF_Index_Block, in file order */
+} GFF_Index_Seq;
+
+typedef struct {
+  char *file_name;
+  long size;
+  long mtime;
+  GFF_Index_Seq **table;  /* open addressing, on the seqname */
+  int table_size;         /* a power of two */
+  int num_seqs;
+  char *map;              /* the file contents; NULL if empty */
+} GFF_Index;
+
+void use_GFF_Index( boolean );
+void free_GFF_Index_cache( void );
+FILE *open_GFF_lines( char *, char *, int, int, char **, boolean * );
+void close_GFF_lines( FILE *, char * );
+
 #endif
@@ -18,6 +18,7 @@
 #define _GAZE_INFO
 
 #include <stdio.h>
+#include <limits.h>
 #include "util.h"
 
 /*******************************************************
@@ -113,6 +114,12 @@ typedef struct {
   boolean use_projected;   /* default: use standard segs */
   boolean score_sum;       /* default: score max */
   boolean partial;         /* default: all overlapping segs */
+
+  /* set by fill_in_Gaze_Structure: if every use of the segment 
+     sums the projected segments, partial ones included, it can be 
+     scored from cumulative sums. These say which lists are needed */
+  boolean prefix_framed;
+  boolean prefix_unframed;
 } Segment_Info;                       
 
 Segment_Info *empty_Segment_Info(void);
@@ -145,25 +152,35 @@ Segment_Qualifier *new_Segment_Qualifier( void );
 		Length Functions
 *********************************************************/
 
+/* Length functions are only tabulated for distances below this; 
+   beyond it they are worked out from the points that define them */
+
+#define LEN_FUN_DENSE_LEN 2048
+
 typedef struct {
   double multiplier;
-  Array *value_map;
+  Array *value_map;       /* values for the first few distances */
   Array *raw_x_vals;
   Array *raw_y_vals;
+  Array *slopes;          /* of the line from each point to the next */
+  int last_x;
+  double last_val;        /* at last_x and last_x - 1 (scaled), for */
+  double before_last_val; /* extending the function past its end    */
+  double scale;
   boolean becomes_monotonic;
   int monotonic_point;
 } Length_Function;                       
 
 
-#define apply_Length_Function(l,n) ((n>=l->value_map->len) ? \
-    (index_Array(l->value_map,double,l->value_map->len-1)*(2+n-(l->value_map->len))) \
-      - (index_Array(l->value_map,double,l->value_map->len-2)*(n-(l->value_map->len-1))) : \
-    index_Array(l->value_map,double,n)) 
+#define apply_Length_Function(l,n) (((n) < (l)->value_map->len) ? \
+    index_Array((l)->value_map,double,(n)) : \
+    value_Length_Function((l),(n))) 
 
 void calc_Length_Function(Length_Function *);
 void free_Length_Function(Length_Function *);
 Length_Function *new_Length_Function( double );
 void scale_Length_Function(Length_Function *, double );
+double value_Length_Function(Length_Function *, int );
 
 /**********************************************************
                 Feature_Relation							   
@@ -190,5 +207,51 @@ void free_Feature_Relation(Feature_Relation *ft_src);
 Feature_Relation *new_Feature_Relation(void);
 
 
+/**********************************************************
+                Compiled_Relation
+ A flattened copy of the parts of a Feature_Relation that 
+ the dp consults for every source-target pair. The optional 
+ constraints are held inline, with sentinels for "absent",
+ and the flags say which of the qualifier lists are in use
+**********************************************************/
+
+#define NO_MIN_DIST  INT_MIN
+#define NO_MAX_DIST  INT_MAX
+#define NO_PHASE     -1
+
+#define REL_HAS_SEGS        1
+#define REL_HAS_EXACT_SEGS  2
+#define REL_HAS_KILLERS     4
+#define REL_HAS_DNA_KILLERS 8
+
+/* Sets of DNA motifs, as bits in arrays of words */
+
+#define DNA_SET_WORDS(n)   (((n) + 31) / 32)
+#define in_DNA_Set(set,m)  (((set)[(m) >> 5] >> ((m) & 31)) & 1)
+
+typedef struct {
+  Feature_Relation *rel;        /* NULL if the pair is not legal */
+  int min_dist;
+  int max_dist;
+  int phase;
+  Length_Function *len_fun;     /* NULL if there is none */
+  int flags;
+  int num_seg_types;            /* the distinct segment types used, */
+  int *seg_types;               /* in ascending order               */
+
+  /* for the DNA killers (NULL if there are none): the source motifs
+     killed by some target, and for each target motif those that 
+     it kills, and likewise the other way round */
+  int dna_set_words;
+  unsigned int *danger_src_dna;
+  unsigned int *danger_tgt_dna;
+  unsigned int *killer_src_dna; /* dna_set_words per target motif */
+  unsigned int *killer_tgt_dna; /* dna_set_words per source motif */
+} Compiled_Relation;
+
+void compile_Feature_Relation(Compiled_Relation *, Feature_Relation *, Array *, int);
+void free_Compiled_Relation_contents(Compiled_Relation *);
+
+
 
 #endif
@@ -0,0 +1,55 @@
+/**********************************************************************
+ * File: logsum.h
+ * Author: Kevin Howe
+ * Copyright (C) Genome Research Limited, 2002-
+ *-------------------------------------------------------------------
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *-------------------------------------------------------------------
+ **********************************************************************/
+#ifndef _LOGSUM
+#define _LOGSUM
+
+#include <math.h>
+#include "util.h"
+
+/* The largest absolute error in the result of log_sum_exp when the
+   fast exp is in use. The polynomial used is accurate to within a few
+   units in the last place for each term, so the actual error is much
+   smaller than this; the bound leaves room for the different order of
+   summation in the vectorised kernels */
+
+#define FAST_EXP_LOG_SUM_ERROR 1.0e-12
+
+/* Accumulator for summing log-space scores one at a time, when they
+   do not need to be kept. The sum is held relative to the largest
+   score seen so far, and rescaled when a larger one arrives. With the
+   fast exp, the scores are gathered into batches of this size, so
+   that each batch can be summed by the vectorised kernel */
+
+#define LOG_SUM_EXP_BATCH 16
+
+typedef struct {
+  double max;
+  double sum;
+  double batch[LOG_SUM_EXP_BATCH];
+  int batch_len;
+} Log_Sum_Exp;
+
+void init_log_sum_exp( boolean );
+char *log_sum_exp_kernel_name( void );
+double log_sum_exp( double *, int, double );
+double check_log_sum_exp( void );
+
+void clear_Log_Sum_Exp( Log_Sum_Exp * );
+void add_Log_Sum_Exp( Log_Sum_Exp *, double );
+double value_Log_Sum_Exp( Log_Sum_Exp * );
+
+#endif
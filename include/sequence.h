@@ -19,6 +19,7 @@
 
 #include "g_features.h"
 #include "structure.h"
+#include "fasta.h"
 
 /********************************************************************/
 /**************** Gaze_Sequence *************************************/
@@ -30,6 +31,7 @@ typedef struct Gaze_Sequence{
   StartEnd seq_region;
 
   Array *features;
+  Feature_Table *feat_table;   /* column-wise copy of features, for the dp */
   Array *segment_lists;
   Array *path;
 
@@ -45,6 +47,15 @@ typedef struct Gaze_Sequence{
   Array *gff_file_names;
   Array *selected_file_names;
 
+  int beam_width;      /* limits on the dp scans (see Gaze_DP_struct), */
+  double beam_margin;  /* 0 for the defaults                            */
+  int nbest;           /* number of best paths wanted; 0 for just the one */
+  int num_samples;     /* number of paths to sample after the forward pass */
+  unsigned int sample_seed;
+
+  long dp_allocs;    /* allocations made by the dp scans, and the number */
+  long dp_scans;     /* of scans, for the -verbose statistics */
+
 } Gaze_Sequence;
 
 
@@ -61,7 +72,7 @@ void convert_dna_Gaze_Sequence ( Gaze_Sequence *,
 
 void convert_gff_Gaze_Sequence( Gaze_Sequence *,
 				Array *,
-				Array * ); 
+				GFF_Dispatch * ); 
 
 
 boolean get_correct_feats_Gaze_Sequence( Gaze_Sequence *,
@@ -95,27 +106,101 @@ void read_dna_Gaze_Sequence_list( Gaze_Sequence_list *, Array * );
 
 void convert_gff_Gaze_Sequence_list( Gaze_Sequence_list *,
 				     Array *,
-				     Array * ); 
+				     GFF_Dispatch * ); 
 
 boolean get_correct_feats_Gaze_Sequence_list( Gaze_Sequence_list *,
 					      Array *, 
 					      Dict *,
 					      boolean);
 
+/********************************************************************/
+/********************** GFF_Router **********************************/
+/********************************************************************/
+
+/* The lines of the GFF files that concern the sequences of a list,
+   read in a single pass and filed by seqname (through a hash), so 
+   that each sequence can then pick up its own lines without the 
+   files being scanned again. Several regions of the same sequence 
+   share a bucket, which is freed once all of them have been 
+   converted. The lines are held in memory until the total held 
+   exceeds the budget, when all buckets are spilled to a shared 
+   temporary file */
+
+#define GFF_ROUTER_DEFAULT_BUDGET (256L * 1024L * 1024L)
+
+typedef struct {
+  long offset;
+  long len;
+} GFF_Chunk;
+
+typedef struct {
+  char *seqname;
+  char *buf;          /* the lines not yet spilled */
+  long len;
+  long alloc;
+  Array *chunks;      /* of GFF_Chunk; the spilled lines, in order */
+  int num_users;      /* sequences still to pick up the lines */
+} GFF_Bucket;
+
+typedef struct {
+  GFF_Bucket **table; /* open addressing, on the seqname */
+  int table_size;     /* a power of two */
+  FILE *spill;        /* NULL until first needed */
+  long spill_len;
+  long in_memory;
+  long budget;
+} GFF_Router;
+
+void free_GFF_Router( GFF_Router * );
+GFF_Router *new_GFF_Router( Gaze_Sequence_list *, long );
+void read_GFF_Router( GFF_Router *, Array * );
+void convert_routed_gff_Gaze_Sequence( Gaze_Sequence *, 
+				       GFF_Router *, 
+				       GFF_Dispatch * );
+
 /********************************************************************/
 /********************** Segment_list ********************************/
 /********************************************************************/
 
+/* A tree over a (sorted) list of segments, for finding the best
+   max-mode segment score in a region without visiting every 
+   segment that overlaps it. Each node holds, for the segments 
+   below it, the largest end point and an upper bound on the score 
+   that any of them can contribute (the whole-segment score if 
+   positive, the per-base score otherwise). Only built for lists 
+   long enough to benefit */
+
+#define SEG_MAX_INDEX_MIN_LEN 64
+
+typedef struct {
+  int size;               /* number of leaves; a power of two */
+  int *max_end;           /* per node, with the root at 1 */
+  double *max_bound;      
+} Segment_Max_Index;
+
 typedef struct {
   Array *orig;    /* The orginal segment lists */
   Array *proj;    /* The projected segment lists */
 
+  /* range-max indices of the above, [0] for orig and [1] for proj,
+     one for each list; NULL where the list is too short */
+  Segment_Max_Index *max_idx[2][4];
+
+  int reg_start;
   int reg_len;
-  double *per_base[3];
+  /* cumulative scores of the projected segments, one for each list
+     (three frames, then all frames), by segment: cum_score[list][i]
+     is the summed score of the first i segments of the list; NULL
+     where not built (see cumulate_Segment_list) */
+  double *cum_score[4];
 } Segment_list;
 
 
+void free_Segment_Max_Index( Segment_Max_Index * );
+Segment_Max_Index *new_Segment_Max_Index( Array * );
+
 void append_to_Segment_list( Segment_list *, Segment *);
+long cumulate_Segment_list( Segment_list *, int, int, boolean, boolean );
 void free_Segment_list( Segment_list * );
 void index_Segment_list (Segment_list * );
 Segment_list *new_Segment_list( int, int );
@@ -51,8 +51,18 @@ typedef struct {
   Array *dna_to_feats;    /* of DNA_to_Features */
   Array *gff_to_feats;    /* of GFF_to_Features */
 
+  /* built by fill_in_Gaze_Structure: the relations, compiled for
+     the dp, in a dense table indexed by (target, source) */
+  Compiled_Relation *relations;
+
+  /* also built by fill_in_Gaze_Structure: gff_to_feats, compiled
+     for lookup by (source, feature) */
+  GFF_Dispatch *gff_dispatch;
+
 } Gaze_Structure;
 
+#define relation_Gaze_Structure(gs,t,s) (&((gs)->relations[(t) * (gs)->feat_dict->len + (s)]))
+
 
 
 /* Allocation and deallocation */
@@ -72,6 +72,7 @@ int read_Line( FILE *, Line * );
 
 
 char *strdup_util (const char *str);
+unsigned int hash_string_util( const char *, char );
 
 
 /**********************************************************************/
@@ -117,7 +118,9 @@ Array *remove_index_Array (Array *, int);
 
 typedef Array Dict;
 
-short int dict_lookup( Dict *, const char *);
+int dict_lookup( Dict *, const char *);
+int dict_intern( Dict *, const char *);
+void index_Dict( Dict * );
 
 
 /*********************************************************************/
@@ -102,25 +102,200 @@ double calculate_segment_score(Gaze_Sequence *g_seq,
 			       Feature *tgt, 
 			       Gaze_Structure *gs,
 			       Seg_Results *s_res) {
+
+  Compiled_Relation *c_rel = relation_Gaze_Structure( gs, 
+						      tgt->feat_idx, 
+						      src->feat_idx );
+
+  return calculate_segment_score_for_relation( g_seq, 
+					       c_rel,
+					       src->adj_pos.s,
+					       tgt->adj_pos.e,
+					       s_res );
+}
+
+
+/*********************************************************************
+ FUNCTION: last_segment_starting_by
+ DESCRIPTION:
+   Finds the last segment in the given (start-sorted) list that
+   starts at or before the given position
+ RETURNS: Its index, or -1 if there is none
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static int last_segment_starting_by( Array *segs, int pos ) {
+  /* find min j s.t. segs[j].pos.s > pos */
+  /* strategy: binary search */
+
+  int left = 0;
+  int right = segs->len;
+
+  while (left < right) {
+    int mid = (left + right) / 2;
+
+    if (index_Array( segs, Segment *, mid)->pos.s <= pos)
+      left = mid + 1;
+    else 
+      right = mid;
+  }
+
+  return left - 1;
+}
+
+
+/*********************************************************************
+ FUNCTION: sum_projected_segments
+ DESCRIPTION:
+   Sums the scores of the given projected segments over the bases
+   start..end, from their cumulative scores (see 
+   cumulate_Segment_list)
+ RETURNS: The sum
+ ARGS: 
+ NOTES:
+   Projected segments do not overlap, so their ends are in the same
+   order as their starts; the segments touching the region are then
+   a run, found by two binary searches, and only the two at the ends
+   of the run can stick out of it. Scoring those two directly keeps
+   short regions free of cancellation error
+ *********************************************************************/
+static double sum_projected_segments( Array *segs, 
+				      double *cum,
+				      int start, 
+				      int end ) {
+  Segment *seg;
+  double sum;
+  int left = 0;
+  int last = last_segment_starting_by( segs, end );
+  int right = last + 1;
+
+  /* find the first segment that ends at or after the start */
+  while (left < right) {
+    int mid = (left + right) / 2;
+
+    if (index_Array( segs, Segment *, mid)->pos.e < start)
+      left = mid + 1;
+    else 
+      right = mid;
+  }
+
+  if (left > last)
+    return 0.0;
+
+  /* the end segments are scored for their overlap directly, and the
+     run between them from the cumulative scores */
+  seg = index_Array( segs, Segment *, last );
+  sum = seg->score * (MIN( seg->pos.e, end ) - MAX( seg->pos.s, start ) + 1);
+
+  if (last > left) {
+    sum += cum[last] - cum[left + 1];
+
+    seg = index_Array( segs, Segment *, left );
+    sum += seg->score * (seg->pos.e - MAX( seg->pos.s, start ) + 1);
+  }
+
+  return sum;
+}
+
+
+/*********************************************************************
+ FUNCTION: search_Segment_Max_Index
+ DESCRIPTION:
+   Finds the best max-mode score of the segments below the given
+   node of the index that start no later than the segment at index
+   last, and overlap src_pos..tgt_pos. Subtrees are skipped if none
+   of their segments reach the source, or if they cannot beat the
+   best score found so far
+ RETURNS:
+ ARGS: 
+ NOTES:
+   The score of each segment is worked out exactly as in
+   calculate_segment_score_for_relation, so the result is the same
+   as that of the walk through the segments there
+ *********************************************************************/
+static void search_Segment_Max_Index( Segment_Max_Index *mi,
+				      Array *segs,
+				      int node,
+				      int lo,
+				      int hi,
+				      int last,
+				      int src_pos,
+				      int tgt_pos,
+				      boolean partial,
+				      boolean *found,
+				      double *best ) {
+  
+  if (lo > last || mi->max_end[node] < src_pos)
+    return;
+  if (*found && mi->max_bound[node] <= *best)
+    return;
+
+  if (lo == hi) {
+    Segment *seg = index_Array( segs, Segment *, lo );
+
+    if (partial || (seg->pos.s >= src_pos && seg->pos.e <= tgt_pos)) {
+      int low = (seg->pos.s < src_pos)?src_pos:seg->pos.s;
+      int high = (seg->pos.e > tgt_pos)?tgt_pos:seg->pos.e;
+      double score = seg->score * (high - low + 1);
+
+      if (! *found || score > *best) {
+	*best = score;
+	*found = TRUE;
+      }
+    }
+  }
+  else {
+    int mid = (lo + hi) / 2;
+
+    /* the more promising half first, to tighten the bound early */
+    if (mi->max_bound[2*node+1] > mi->max_bound[2*node]) {
+      search_Segment_Max_Index( mi, segs, 2*node+1, mid+1, hi, last, src_pos, tgt_pos, partial, found, best );
+      search_Segment_Max_Index( mi, segs, 2*node, lo, mid, last, src_pos, tgt_pos, partial, found, best );
+    }
+    else {
+      search_Segment_Max_Index( mi, segs, 2*node, lo, mid, last, src_pos, tgt_pos, partial, found, best );
+      search_Segment_Max_Index( mi, segs, 2*node+1, mid+1, hi, last, src_pos, tgt_pos, partial, found, best );
+    }
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: calculate_segment_score_for_relation
+ DESCRIPTION:
+   As calculate_segment_score, but for a source and target given by 
+   their relation and (adjusted) positions, for the dp, which 
+   has these to hand
+ RETURNS:
+ ARGS: 
+ NOTES:
+   If start_scan_Seg_Results has been called for this relation and
+   target, and the sources are then given right to left, the 
+   segments that start within the region are carried over from
+   the previous source rather than found again, so that only 
+   those straddling the source are looked at each time
+ *********************************************************************/
+double calculate_segment_score_for_relation(Gaze_Sequence *g_seq, 
+					    Compiled_Relation *c_rel,
+					    int src_pos,
+					    int tgt_pos,
+					    Seg_Results *s_res) {
+  Feature_Relation *tgt_rel = c_rel->rel;
   Array *seg_quals;
+  boolean incremental;
   int i,j;
   double score;
 
-  Feature_Info *tgt_info = index_Array( gs->feat_info, 
-					Feature_Info *,
-					tgt->feat_idx );
-  Feature_Relation *tgt_rel = index_Array( tgt_info->sources, Feature_Relation *, src->feat_idx);
-
-  int src_pos = src->adj_pos.s; 
-  int tgt_pos = tgt->adj_pos.e; 
-
-  for(i=0; i < s_res->has_score->len; i++) {
-    index_Array( s_res->has_score, boolean, i ) = FALSE;
-    index_Array( s_res->raw_scores, double, i ) = 0.0;
+  /* only the types this relation uses can be set below */
+  for(i=0; i < c_rel->num_seg_types; i++) {
+    index_Array( s_res->has_score, boolean, c_rel->seg_types[i] ) = FALSE;
+    index_Array( s_res->raw_scores, double, c_rel->seg_types[i] ) = 0.0;
   }
   s_res->has_exact_at_src = s_res->exact_extends_beyond_tgt = FALSE;
   s_res->has_exact_at_tgt = s_res->exact_extends_beyond_src = FALSE;
 
+  incremental = s_res->inc_rel == c_rel && s_res->inc_tgt_pos == tgt_pos;
+
   if ( (seg_quals = tgt_rel->seg_quals) != NULL) {
     for (i=0; i < seg_quals->len; i++) {
       Segment_Qualifier *qual = index_Array( seg_quals, Segment_Qualifier *, i);
@@ -138,44 +313,132 @@ double calculate_segment_score(Gaze_Sequence *g_seq,
 	else 
 	  index = 3;
 
-	/********************************************************************/
-	/*
-	  the following lines utilise per_segment cumulative scoring. Note 
-	  the + 5; this was because I was using base scores that were pobabilities
-	  given the previous 5 bases; To ise these scores for the first 5 bases of
-	  a candidate exon would be wrong, because the the previous 5 bases run 
-	  into non-coding DNA. The proper way to do this would be to have a 5mer
-	  probability for the start of each exon.
-	*/
-	/*
-	index_Array( s_res->raw_scores, double, qual->seg_idx ) = 
-	  sl->per_base[index][tgt_pos - g_seq->seq_region.s] 
-	  - sl->per_base[index][src_pos - g_seq->seq_region.s - 1 + 5]; 
-
-	index_Array( s_res->has_score, boolean, qual->seg_idx ) = TRUE;
-	continue;
-	*/
-	/***********************************************************************/
+	/* The cumulative scores are only built for segment types whose
+	   every qualifier sums projected segments, including partial ones
+	   (see fill_in_Gaze_Structure), so the sum over the region is 
+	   a difference of them, less the overhangs of the segments at 
+	   either end. The region is clipped to the sequence, 
+	   where all segments lie. Empty (or inverted) regions are left
+	   to the search below */
+
+	if (sl->cum_score[index] != NULL) {
+	  int low = src_pos;
+	  int high = tgt_pos;
+
+	  if (low < sl->reg_start) 
+	    low = sl->reg_start;
+	  if (high > sl->reg_start + sl->reg_len - 1)
+	    high = sl->reg_start + sl->reg_len - 1;
+
+	  if (high >= low) {
+	    index_Array( s_res->raw_scores, double, qual->seg_idx ) += 
+	      sum_projected_segments( index_Array( sl->proj, Array *, index ), 
+				      sl->cum_score[index], low, high );
+	    index_Array( s_res->has_score, boolean, qual->seg_idx ) = TRUE;
+	    continue;
+	  }
+	}
 
 	list = (qual->use_projected) ? sl->proj : sl->orig;
 	segs = index_Array( list, Array *, index );
 
-	{
-	  /* find min j s.t. segs[j].pos.s > end_pos */
-	  /* strategy: binary search */
+	/* Carrying the segments over from the previous source. They
+	   are folded in the same order as by the walk below (right to 
+	   left), so the result is the same. Exact qualifiers, and types 
+	   already scored by another qualifier, are left to the walk */
+
+	if (incremental && ! qual->is_exact_src && ! qual->is_exact_tgt &&
+	    ! index_Array( s_res->has_score, boolean, qual->seg_idx )) {
+	  Seg_Accumulator *acc = &(s_res->inc_state[i * 4 + index]);
+	  boolean has;
+	  double total;
+	  
+	  if (! acc->valid || src_pos > acc->last_src) {
+	    acc->valid = TRUE;
+	    acc->next = last_segment_starting_by( segs, tgt_pos );
+	    acc->has = FALSE;
+	    acc->total = 0.0;
+	  }
+	  acc->last_src = src_pos;
+
+	  /* the segments newly inside the region */
+	  for (; acc->next >= 0; acc->next--) {
+	    Segment *seg = index_Array( segs, Segment *, acc->next );
+
+	    if (seg->pos.s < src_pos)
+	      break;
+	    if (qual->partial || seg->pos.e <= tgt_pos) {
+	      int high = (seg->pos.e > tgt_pos)?tgt_pos:seg->pos.e;
+
+	      score = seg->score * (high - seg->pos.s + 1);
+	      if (! acc->has) {
+		acc->total = score;
+		acc->has = TRUE;
+	      }
+	      else if (qual->score_sum)
+		acc->total += score;
+	      else if (score > acc->total)
+		acc->total = score;
+	    }
+	  }
+
+	  has = acc->has;
+	  total = acc->total;
+
+	  /* and those straddling the source, which depend on it */
+	  if (qual->partial) {
+	    for (j = acc->next; j >= 0; j--) {
+	      Segment *seg = index_Array( segs, Segment *, j ); 
+
+	      if ( seg->max_end_up < src_pos )
+		break;
+	      else if ( seg->pos.e < src_pos )
+		continue;
+	      else {
+		int high = (seg->pos.e > tgt_pos)?tgt_pos:seg->pos.e;
+
+		score = seg->score * (high - src_pos + 1);
+		if (! has) {
+		  total = score;
+		  has = TRUE;
+		}
+		else if (qual->score_sum)
+		  total += score;
+		else if (score > total)
+		  total = score;
+	      }
+	    }
+	  }
+
+	  if (has) {
+	    index_Array( s_res->raw_scores, double, qual->seg_idx ) = total;
+	    index_Array( s_res->has_score, boolean, qual->seg_idx ) = TRUE;
+	  }
+	  continue;
+	}
+
+	j = last_segment_starting_by( segs, tgt_pos );
+
+	/* long lists scored by max can use the range-max index; exact 
+	   qualifiers need to see every segment, so always walk */
 
-	  int left = 0;
-	  int right = segs->len;
+	if (! qual->score_sum && ! qual->is_exact_src && ! qual->is_exact_tgt &&
+	    index < 4 && sl->max_idx[qual->use_projected ? 1 : 0][index] != NULL) {
+	  Segment_Max_Index *mi = sl->max_idx[qual->use_projected ? 1 : 0][index];
+	  boolean found = FALSE;
+	  double best = 0.0;
 
-	  while (left < right) {
-	    int mid = (left + right) / 2;
+	  search_Segment_Max_Index( mi, segs, 1, 0, mi->size - 1, j, 
+				    src_pos, tgt_pos, qual->partial, &found, &best );
 
-	    if (index_Array( segs, Segment *, mid)->pos.s <= tgt_pos)
-	      left = mid + 1;
-	    else 
-	      right = mid;
+	  if (found) {
+	    if (! index_Array( s_res->has_score, boolean, qual->seg_idx) ||
+		best > index_Array( s_res->raw_scores, double, qual->seg_idx )) {
+	      index_Array( s_res->raw_scores, double, qual->seg_idx) = best;
+	      index_Array( s_res->has_score, boolean, qual->seg_idx) = TRUE;
+	    }
 	  }
-	  j = left - 1;
+	  continue;
 	}
 
 	for (; j >= 0; j--) {
@@ -235,9 +498,9 @@ double calculate_segment_score(Gaze_Sequence *g_seq,
   }
 
   score = 0.0;
-  for(i=0; i < s_res->has_score->len; i++)
-    if (index_Array( s_res->has_score, boolean, i))
-	score += index_Array( s_res->raw_scores, double, i );
+  for(i=0; i < c_rel->num_seg_types; i++)
+    if (index_Array( s_res->has_score, boolean, c_rel->seg_types[i]))
+	score += index_Array( s_res->raw_scores, double, c_rel->seg_types[i] );
      
   return score;
 }
@@ -456,6 +719,8 @@ void free_Seg_Results( Seg_Results *s_res ) {
   if (s_res != NULL) { 
     free_Array( s_res->raw_scores, TRUE );
     free_Array( s_res->has_score, TRUE );
+    if (s_res->inc_state != NULL)
+      free_util( s_res->inc_state );
     free_util( s_res );
   }
 }
@@ -478,6 +743,44 @@ Seg_Results *new_Seg_Results( int seg_dict_size ) {
   set_size_Array( s_res->has_score, seg_dict_size );
   s_res->has_exact_at_src = s_res->exact_extends_beyond_tgt = FALSE;
   s_res->has_exact_at_tgt = s_res->exact_extends_beyond_src = FALSE;
+  s_res->inc_rel = NULL;
+  s_res->inc_tgt_pos = 0;
+  s_res->inc_state = NULL;
+  s_res->inc_alloc = 0;
 
   return s_res;
 }
+
+
+/*********************************************************************
+ FUNCTION: start_scan_Seg_Results
+ DESCRIPTION:
+   Prepares for a scan back through the sources of the given 
+   relation for a single target, scoring the segments 
+   incrementally (see calculate_segment_score_for_relation)
+ RETURNS:
+ ARGS: 
+ NOTES:
+   Sources may still be given out of order; the state for a 
+   qualifier is started again whenever the source moves right
+ *********************************************************************/
+void start_scan_Seg_Results( Seg_Results *s_res, 
+			     Compiled_Relation *c_rel, 
+			     int tgt_pos ) {
+  int i, needed;
+
+  needed = (c_rel->rel != NULL && c_rel->rel->seg_quals != NULL) ? 
+    c_rel->rel->seg_quals->len * 4 : 0;
+
+  if (needed > s_res->inc_alloc) {
+    if (s_res->inc_state != NULL)
+      free_util( s_res->inc_state );
+    s_res->inc_state = (Seg_Accumulator *) malloc_util( needed * sizeof(Seg_Accumulator) );
+    s_res->inc_alloc = needed;
+  }
+  for (i=0; i < needed; i++)
+    s_res->inc_state[i].valid = FALSE;
+
+  s_res->inc_rel = c_rel;
+  s_res->inc_tgt_pos = tgt_pos;
+}
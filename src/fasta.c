@@ -0,0 +1,479 @@
+/**********************************************************************
+ ** File: fasta.c
+ * Author: Kevin Howe
+ * Copyright (C) Genome Research Limited, 2002-
+ *-------------------------------------------------------------------
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *-------------------------------------------------------------------
+ * Author : Kevin Howe
+ * E-mail : klh@sanger.ac.uk
+ * Description :
+ **********************************************************************/
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "fasta.h"
+
+/* The indices of the FASTA files opened so far, shared by all threads */
+
+static struct {
+  pthread_mutex_t lock;
+  boolean enabled;
+  Array *indices;       /* of FASTA_Index * */
+} fastaIndexCache = { PTHREAD_MUTEX_INITIALIZER, FALSE, NULL };
+
+
+/*********************************************************************
+ FUNCTION: free_FASTA_Index
+ DESCRIPTION:
+ RETURNS:
+ ARGS:
+ NOTES:
+ *********************************************************************/
+static void free_FASTA_Index( FASTA_Index *idx ) {
+  int i;
+
+  if (idx != NULL) {
+    for (i=0; i < idx->names->len; i++)
+      free_util( index_Array( idx->names, char *, i ) );
+    free_Array( idx->names, TRUE );
+    free_Array( idx->seqs, TRUE );
+    free_util( idx->file_name );
+    free_util( idx );
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: new_FASTA_Index
+ DESCRIPTION:
+ RETURNS:
+ ARGS:
+ NOTES:
+ *********************************************************************/
+static FASTA_Index *new_FASTA_Index( char *file_name ) {
+  FASTA_Index *idx = (FASTA_Index *) malloc_util( sizeof(FASTA_Index) );
+
+  idx->file_name = strdup_util( file_name );
+  idx->usable = FALSE;
+  idx->names = new_Array( sizeof(char *), TRUE );
+  idx->seqs = new_Array( sizeof(FASTA_Index_Seq), TRUE );
+
+  return idx;
+}
+
+
+/*********************************************************************
+ FUNCTION: add_FASTA_Index_Seq
+ DESCRIPTION:
+   Adds an entry for the given name (which runs for the given
+   number of characters)
+ RETURNS: the new entry, or NULL if the name is already present
+ ARGS:
+ NOTES:
+ *********************************************************************/
+static FASTA_Index_Seq *add_FASTA_Index_Seq( FASTA_Index *idx,
+					     const char *name,
+					     int len ) {
+  char *copy = (char *) malloc_util( len + 1 );
+  FASTA_Index_Seq fs;
+
+  memcpy( copy, name, len );
+  copy[len] = '\0';
+
+  if (dict_lookup( idx->names, copy ) >= 0) {
+    free_util( copy );
+    return NULL;
+  }
+
+  fs.length = 0;
+  fs.offset = 0;
+  fs.line_bases = 0;
+  fs.line_width = 0;
+  append_val_Array( idx->names, copy );
+  append_val_Array( idx->seqs, fs );
+  index_Dict( idx->names );
+
+  return &(index_Array( idx->seqs, FASTA_Index_Seq, idx->seqs->len - 1 ));
+}
+
+
+/*********************************************************************
+ FUNCTION: byte_FASTA_Index_Seq
+ DESCRIPTION:
+ RETURNS: the offset in the file of the given base (from 0) of the
+   given sequence
+ ARGS:
+ NOTES:
+ *********************************************************************/
+static long byte_FASTA_Index_Seq( FASTA_Index_Seq *fs, int base ) {
+  return fs->offset
+    + (long) (base / fs->line_bases) * fs->line_width
+    + base % fs->line_bases;
+}
+
+
+/*********************************************************************
+ FUNCTION: build_FASTA_Index
+ DESCRIPTION:
+   Fills in the given (empty) index from the given file contents
+ RETURNS: TRUE if the file can be indexed, which needs the lines of
+   each sequence to be of equal length (but for the last), and the
+   names to be distinct
+ ARGS:
+ NOTES:
+   The sequence names are taken as by read_dna_Gaze_Sequence. Blank
+   lines, which it skips, are allowed only after the last bases of
+   a sequence
+ *********************************************************************/
+static boolean build_FASTA_Index( FASTA_Index *idx, const char *map, long size ) {
+  const char *p = map, *end = map + size;
+  FASTA_Index_Seq *cur = NULL;
+  boolean ended = FALSE;
+
+  while (p < end) {
+    const char *nl = (const char *) memchr( p, '\n', end - p );
+    const char *next = (nl != NULL) ? nl + 1 : end;
+    long bases = ((nl != NULL) ? nl : end) - p;
+    long width = next - p;
+    long i;
+
+    if (bases > 0 && p[bases - 1] == '\r')
+      bases--;
+
+    if (bases > 0 && *p == '>') {
+      const char *name = p + 1;
+      int len;
+
+      while (name < p + bases && isspace( (int) *name ))
+	name++;
+      for (len = 0; name + len < p + bases && ! isspace( (int) name[len] ); len++);
+
+      if (len == 0 || (cur = add_FASTA_Index_Seq( idx, name, len )) == NULL)
+	return FALSE;
+      cur->offset = next - map;
+      ended = FALSE;
+    }
+    else if (cur != NULL) {
+      if (bases == 0) {
+	if (cur->length == 0)
+	  cur->offset = next - map;
+	else
+	  ended = TRUE;
+      }
+      else {
+	for (i=0; i < bases; i++)
+	  if (isspace( (int) p[i] ))
+	    return FALSE;
+
+	if (ended || bases > INT_MAX - cur->length)
+	  return FALSE;
+	if (cur->line_bases == 0) {
+	  cur->line_bases = bases;
+	  cur->line_width = width;
+	}
+	else if (bases > cur->line_bases)
+	  return FALSE;
+
+	/* anything other than a full line must be the last */
+	if (bases < cur->line_bases || width != cur->line_width)
+	  ended = TRUE;
+
+	cur->length += bases;
+      }
+    }
+
+    p = next;
+  }
+
+  return TRUE;
+}
+
+
+/*********************************************************************
+ FUNCTION: read_FASTA_Index
+ DESCRIPTION:
+   Reads the given index file into the given (empty) index
+ RETURNS: TRUE if the index could be read, and is consistent with
+   the given size of the FASTA file
+ ARGS:
+ NOTES:
+ *********************************************************************/
+static boolean read_FASTA_Index( FASTA_Index *idx, char *idx_name, long size ) {
+  Line *ln = new_Line();
+  boolean ok = TRUE;
+  FILE *fh;
+
+  if ((fh = fopen( idx_name, "r" )) == NULL) {
+    free_Line( ln );
+    return FALSE;
+  }
+
+  while (ok && read_Line( fh, ln ) != 0) {
+    char *fields[5], *p = ln->buf;
+    FASTA_Index_Seq *fs;
+    int f;
+
+    for (f=0; f < 5 && p != NULL; f++) {
+      fields[f] = p;
+      if ((p = strchr( p, '\t' )) != NULL)
+	*p++ = '\0';
+    }
+
+    if (f < 5 || (fs = add_FASTA_Index_Seq( idx, fields[0], strlen( fields[0] ))) == NULL) {
+      ok = FALSE;
+      continue;
+    }
+    fs->length = atoi( fields[1] );
+    fs->offset = atol( fields[2] );
+    fs->line_bases = atoi( fields[3] );
+    fs->line_width = atoi( fields[4] );
+
+    if (fs->length < 0 || fs->offset < 0 || fs->offset > size)
+      ok = FALSE;
+    else if (fs->length > 0 &&
+	     (fs->line_bases <= 0 || fs->line_width < fs->line_bases ||
+	      byte_FASTA_Index_Seq( fs, fs->length - 1 ) >= size))
+      ok = FALSE;
+  }
+
+  fclose( fh );
+  free_Line( ln );
+
+  return ok && idx->seqs->len > 0;
+}
+
+
+/*********************************************************************
+ FUNCTION: write_FASTA_Index
+ DESCRIPTION:
+   Writes the given index to the given file
+ RETURNS:
+ ARGS:
+ NOTES:
+   As for the GFF indices, the index is written to a temporary name
+   and then moved into place, and failure is silent
+ *********************************************************************/
+static void write_FASTA_Index( FASTA_Index *idx, char *idx_name ) {
+  char *tmp_name = (char *) malloc_util( strlen( idx_name ) + 32 );
+  boolean ok = TRUE;
+  FILE *fh;
+  int i;
+
+  sprintf( tmp_name, "%s.%ld", idx_name, (long) getpid() );
+
+  if ((fh = fopen( tmp_name, "w" )) != NULL) {
+    for (i=0; ok && i < idx->seqs->len; i++) {
+      FASTA_Index_Seq *fs = &(index_Array( idx->seqs, FASTA_Index_Seq, i ));
+
+      ok = fprintf( fh, "%s\t%d\t%ld\t%d\t%d\n",
+		    index_Array( idx->names, char *, i ),
+		    fs->length,
+		    fs->offset,
+		    fs->line_bases,
+		    fs->line_width ) > 0;
+    }
+
+    if (fclose( fh ) != 0)
+      ok = FALSE;
+    if (! ok || rename( tmp_name, idx_name ) != 0)
+      remove( tmp_name );
+  }
+
+  free_util( tmp_name );
+}
+
+
+/*********************************************************************
+ FUNCTION: get_FASTA_Index
+ DESCRIPTION:
+   Finds the index for the given file, reading it from its index
+   file, or building (and saving) it if that is missing, older than
+   the FASTA file, or does not fit it
+ RETURNS: the index, or NULL if the file cannot be opened
+ ARGS:
+ NOTES:
+   Must be called with the cache locked
+ *********************************************************************/
+static FASTA_Index *get_FASTA_Index( char *file_name ) {
+  FASTA_Index *idx;
+  struct stat st, idx_st;
+  char *idx_name;
+  int i, fd;
+
+  if (fastaIndexCache.indices == NULL)
+    fastaIndexCache.indices = new_Array( sizeof(FASTA_Index *), TRUE );
+
+  for (i=0; i < fastaIndexCache.indices->len; i++) {
+    idx = index_Array( fastaIndexCache.indices, FASTA_Index *, i );
+    if (strcmp( idx->file_name, file_name ) == 0)
+      return idx;
+  }
+
+  if ((fd = open( file_name, O_RDONLY )) < 0)
+    return NULL;
+
+  idx = new_FASTA_Index( file_name );
+
+  if (fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0) {
+    idx_name = (char *) malloc_util( strlen( file_name ) + strlen( FASTA_INDEX_SUFFIX ) + 1 );
+    sprintf( idx_name, "%s%s", file_name, FASTA_INDEX_SUFFIX );
+
+    if (stat( idx_name, &idx_st ) == 0 &&
+	(idx_st.st_mtim.tv_sec > st.st_mtim.tv_sec ||
+	 (idx_st.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+	  idx_st.st_mtim.tv_nsec >= st.st_mtim.tv_nsec)))
+      idx->usable = read_FASTA_Index( idx, idx_name, (long) st.st_size );
+
+    if (! idx->usable) {
+      char *map;
+
+      /* start again from an empty table */
+      free_FASTA_Index( idx );
+      idx = new_FASTA_Index( file_name );
+
+      if ((map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 )) != MAP_FAILED) {
+	if ((idx->usable = build_FASTA_Index( idx, map, (long) st.st_size )))
+	  write_FASTA_Index( idx, idx_name );
+	munmap( map, st.st_size );
+      }
+    }
+    free_util( idx_name );
+  }
+  close( fd );
+
+  append_val_Array( fastaIndexCache.indices, idx );
+
+  return idx;
+}
+
+
+/*********************************************************************
+ FUNCTION: use_FASTA_Index
+ DESCRIPTION:
+   Turns the use of the indices by read_FASTA_region on or off
+ RETURNS:
+ ARGS:
+ NOTES:
+ *********************************************************************/
+void use_FASTA_Index( boolean enabled ) {
+  fastaIndexCache.enabled = enabled;
+}
+
+
+/*********************************************************************
+ FUNCTION: free_FASTA_Index_cache
+ DESCRIPTION:
+ RETURNS:
+ ARGS:
+ NOTES:
+ *********************************************************************/
+void free_FASTA_Index_cache( void ) {
+  int i;
+
+  pthread_mutex_lock( &fastaIndexCache.lock );
+  if (fastaIndexCache.indices != NULL) {
+    for (i=0; i < fastaIndexCache.indices->len; i++)
+      free_FASTA_Index( index_Array( fastaIndexCache.indices, FASTA_Index *, i ) );
+    free_Array( fastaIndexCache.indices, TRUE );
+    fastaIndexCache.indices = NULL;
+  }
+  pthread_mutex_unlock( &fastaIndexCache.lock );
+}
+
+
+/*********************************************************************
+ FUNCTION: read_FASTA_region
+ DESCRIPTION:
+   Reads the bases first to last (counting from 0) of the given
+   sequence from the given FASTA file, through its index, in lower
+   case. The region is clipped to the sequence
+ RETURNS: 1 if the bases were read; 0 if the index shows that the
+   sequence is not in the file; -1 if the file could not be read
+   through an index (in which case it must be read in full)
+ ARGS:
+   dna: set to the bases read, as a string
+   seq_len: set to the length of the whole sequence
+ NOTES:
+ *********************************************************************/
+int read_FASTA_region( char *file_name,
+		       char *seqname,
+		       int first,
+		       int last,
+		       char **dna,
+		       int *seq_len ) {
+  FASTA_Index *idx = NULL;
+  FASTA_Index_Seq *fs;
+  int i, num_bases;
+
+  if (! fastaIndexCache.enabled)
+    return -1;
+
+  pthread_mutex_lock( &fastaIndexCache.lock );
+  idx = get_FASTA_Index( file_name );
+  pthread_mutex_unlock( &fastaIndexCache.lock );
+
+  if (idx == NULL || ! idx->usable)
+    return -1;
+  if ((i = dict_lookup( idx->names, seqname )) < 0)
+    return 0;
+
+  fs = &(index_Array( idx->seqs, FASTA_Index_Seq, i ));
+  *seq_len = fs->length;
+
+  if (first < 0)
+    first = 0;
+  if (last > fs->length - 1)
+    last = fs->length - 1;
+  num_bases = (last >= first) ? last - first + 1 : 0;
+
+  *dna = (char *) malloc_util( num_bases + 1 );
+
+  if (num_bases > 0) {
+    long start = byte_FASTA_Index_Seq( fs, first );
+    long len = byte_FASTA_Index_Seq( fs, last ) - start + 1;
+    char *buf = (char *) malloc_util( len );
+    boolean ok = FALSE;
+    FILE *fh;
+    long b;
+    int k = 0;
+
+    if ((fh = fopen( file_name, "r" )) != NULL) {
+      ok = fseek( fh, start, SEEK_SET ) == 0 && fread( buf, 1, len, fh ) == (size_t) len;
+      fclose( fh );
+    }
+
+    for (b=0; ok && b < len; b++) {
+      if (! isspace( (int) buf[b] )) {
+	if (k == num_bases)
+	  ok = FALSE;
+	else
+	  (*dna)[k++] = tolower( (int) buf[b] );
+      }
+    }
+    free_util( buf );
+
+    if (! ok || k != num_bases) {
+      /* the index does not fit the file after all */
+      free_util( *dna );
+      *dna = NULL;
+      return -1;
+    }
+  }
+  (*dna)[num_bases] = '\0';
+
+  return 1;
+}
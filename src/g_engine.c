@@ -17,6 +17,7 @@
  * E-mail : klh@sanger.ac.uk
  * Description : 
  **********************************************************************/
+#include <pthread.h>
 #include "g_engine.h"
 #include "time.h"
 
@@ -59,6 +60,16 @@ void free_Gaze_DP_struct( Gaze_DP_struct *g_res, int feat_types ) {
     if (g_res->seg_res != NULL)
       free_Seg_Results( g_res->seg_res );
 
+    /* The scratch space for the scans */
+    if (g_res->cand_scores != NULL) {
+      free_util( g_res->cand_scores );
+      free_util( g_res->cand_indices );
+    }
+    if (g_res->beam_scores != NULL) {
+      free_util( g_res->beam_scores );
+      free_util( g_res->beam_indices );
+    }
+
     free_util( g_res );
   }  
 }
@@ -81,6 +92,7 @@ Gaze_DP_struct *new_Gaze_DP_struct( int feat_dict_size,
 
   g_res->pth_score = g_res->score = 0.0;
   g_res->last_selected = -1;
+  g_res->rand_state = 0;
  
   /* The lists of features that will be kept during the dp */
   g_res->feats = (Array ***) malloc_util( feat_dict_size * sizeof( Array ** ));
@@ -103,11 +115,188 @@ Gaze_DP_struct *new_Gaze_DP_struct( int feat_dict_size,
 
   g_res->seg_res = new_Seg_Results( seg_dict_size );
 
+  /* The scratch space for the scans is allocated on first use */
+  g_res->cand_scores = NULL;
+  g_res->cand_indices = NULL;
+  g_res->num_cands = g_res->cand_alloc = 0;
+
+  g_res->beam_width = 0;
+  g_res->beam_scores = NULL;
+  g_res->beam_indices = NULL;
+  g_res->beam_len[0] = g_res->beam_len[1] = g_res->beam_len[2] = 0;
+  g_res->margin = DP_DOMINANCE_MARGIN;
+
+  g_res->mea = FALSE;
+  g_res->mea_total = 0.0;
+
+  g_res->num_allocs = g_res->num_scans = 0;
+
   return g_res;
 }
 
 
 
+/*********************************************************************
+ FUNCTION: set_dp_limits
+ DESCRIPTION:
+   Copies the limits that the user has placed on the scans for the 
+   given sequence into the given dp struct
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static void set_dp_limits( Gaze_DP_struct *g_res,
+			   Gaze_Sequence *g_seq ) {
+
+  if (g_res->beam_scores != NULL) {
+    free_util( g_res->beam_scores );
+    free_util( g_res->beam_indices );
+    g_res->beam_scores = NULL;
+    g_res->beam_indices = NULL;
+  }
+
+  if ((g_res->beam_width = g_seq->beam_width) > 0) {
+    g_res->beam_scores = (double *) malloc_util( 3 * g_res->beam_width * sizeof(double) );
+    g_res->beam_indices = (int *) malloc_util( 3 * g_res->beam_width * sizeof(int) );
+  }
+  g_res->beam_len[0] = g_res->beam_len[1] = g_res->beam_len[2] = 0;
+
+  if (g_seq->beam_margin > 0.0)
+    g_res->margin = g_seq->beam_margin;
+}
+
+
+
+/*********************************************************************
+ FUNCTION: add_dp_candidate
+ DESCRIPTION:
+   Records the score and index of a candidate source for the 
+   current target, in the scratch space of the dp struct. This is 
+   only necessary when sampling; otherwise the scores are summed
+   as they are found
+ RETURNS:
+ ARGS: 
+ NOTES:
+   The scratch space is only ever grown (by doubling), never freed,
+   so after the first few targets no more allocation is necessary
+ *********************************************************************/
+static void add_dp_candidate( Gaze_DP_struct *g_res,
+			      double score,
+			      int index ) {
+
+  if (g_res->num_cands == g_res->cand_alloc) {
+    if (g_res->cand_alloc == 0) {
+      g_res->cand_alloc = 64;
+      g_res->cand_scores = (double *) malloc_util( g_res->cand_alloc * sizeof(double) );
+      g_res->cand_indices = (int *) malloc_util( g_res->cand_alloc * sizeof(int) );
+    }
+    else {
+      g_res->cand_alloc *= 2;
+      g_res->cand_scores = (double *) realloc_util( g_res->cand_scores, 
+						    g_res->cand_alloc * sizeof(double) );
+      g_res->cand_indices = (int *) realloc_util( g_res->cand_indices, 
+						  g_res->cand_alloc * sizeof(int) );
+    }
+    g_res->num_allocs += 2;
+  }
+
+  g_res->cand_scores[g_res->num_cands] = score;
+  g_res->cand_indices[g_res->num_cands++] = index;
+}
+
+
+
+/*********************************************************************
+ FUNCTION: add_dp_beam
+ DESCRIPTION:
+   Offers the score of a source (or target, in the backward scan) 
+   to the beam of the given frame, which keeps the beam_width best 
+   scores seen in the current scan of a feature pair
+ RETURNS: TRUE if the beam is full and the score falls more than 
+   the margin below the worst score kept, in which case the scan of
+   this frame can stop: the sources further away, with their larger
+   length penalties, are taken to be no better
+ ARGS: 
+ NOTES:
+   Each beam is a min-heap, so the worst of the kept scores is the
+   one at the root, and is the one replaced by a better score
+ *********************************************************************/
+static boolean add_dp_beam( Gaze_DP_struct *g_res,
+			    int frame,
+			    double score,
+			    int index ) {
+
+  double *heap = g_res->beam_scores + frame * g_res->beam_width;
+  int *heap_idx = g_res->beam_indices + frame * g_res->beam_width;
+  int pos, child, len = g_res->beam_len[frame];
+
+  if (len < g_res->beam_width) {
+    /* sift the new score up from the bottom */
+    for (pos = len; pos > 0 && heap[(pos - 1) / 2] > score; pos = (pos - 1) / 2) {
+      heap[pos] = heap[(pos - 1) / 2];
+      heap_idx[pos] = heap_idx[(pos - 1) / 2];
+    }
+    g_res->beam_len[frame]++;
+  }
+  else if (score > heap[0]) {
+    /* replace the worst, and sift the new score down from the root */
+    for (pos = 0; (child = 2 * pos + 1) < len; pos = child) {
+      if (child + 1 < len && heap[child + 1] < heap[child])
+	child++;
+      if (heap[child] >= score)
+	break;
+      heap[pos] = heap[child];
+      heap_idx[pos] = heap_idx[child];
+    }
+  }
+  else
+    return (score < heap[0] - g_res->margin);
+
+  heap[pos] = score;
+  heap_idx[pos] = index;
+
+  return FALSE;
+}
+
+
+
+/*********************************************************************
+ FUNCTION: drain_dp_beam
+ DESCRIPTION:
+   Adds the scores kept by the beams of all frames to the given sum,
+   or (if keep_cands) records them as candidates, and empties the
+   beams for the next scan
+ RETURNS:
+ ARGS: 
+ NOTES:
+   max_score tracks the best of the recorded candidates, which is
+   needed to sum them later
+ *********************************************************************/
+static void drain_dp_beam( Gaze_DP_struct *g_res,
+			   boolean keep_cands,
+			   Log_Sum_Exp *sum,
+			   double *max_score ) {
+  int frame, i;
+
+  for (frame=0; frame < 3; frame++) {
+    double *heap = g_res->beam_scores + frame * g_res->beam_width;
+    int *heap_idx = g_res->beam_indices + frame * g_res->beam_width;
+
+    for (i=0; i < g_res->beam_len[frame]; i++) {
+      if (keep_cands) {
+	add_dp_candidate( g_res, heap[i], heap_idx[i] );
+	if (heap[i] > *max_score)
+	  *max_score = heap[i];
+      }
+      else
+	add_Log_Sum_Exp( sum, heap[i] );
+    }
+    g_res->beam_len[frame] = 0;
+  }
+}
+
+
+
 /*********************************************************************
  FUNCTION: calculate_path_score
  DESCRIPTION:
@@ -179,18 +368,37 @@ void forwards_calc( Gaze_Sequence *g_seq,
   
   int ft_idx, prev_idx;
   Array *temp;
-  Feature *prev_feat;
+  Feature_Table *ftab = g_seq->feat_table;
+  boolean max_only = ! (g_out->sample_gene || g_out->regions || g_out->probability ||
+			g_seq->num_samples > 0);
   
   Gaze_DP_struct *g_res = new_Gaze_DP_struct( gs->feat_dict->len, 
 					      gs->seg_dict->len,
 					      0 );
+  set_dp_limits( g_res, g_seq );
   
 #ifdef TRACE
   fprintf(stderr, "\nForward calculation:\n\n");
 #endif
+
+  load_Feature_Table( ftab, g_seq->features );
   
   if ( g_out->sample_gene)
-    srand( time(NULL) );
+    g_res->rand_state = g_seq->sample_seed != 0 ? g_seq->sample_seed : (unsigned int) time(NULL);
+
+  if (max_only && g_seq->nbest > 1 && g_seq->path == NULL) {
+    /* the pruning drops sources that cannot be on the best path to
+       any later target, but they may well be on the second best */
+    use_pruning = FALSE;
+    alloc_nbest_Feature_Table( ftab, g_seq->nbest );
+    ftab->nbest_count[0] = 1;
+    ftab->nbest_score[0] = ftab->path_score[0];
+    ftab->nbest_trace[0] = -1;
+    ftab->nbest_rank[0] = 0;
+  }
+
+  if (g_seq->num_samples > 0 && g_seq->path == NULL)
+    alloc_samples_Feature_Table( ftab );
 
   for (ft_idx = 1; ft_idx < g_seq->features->len; ft_idx++) {
 
@@ -199,11 +407,10 @@ void forwards_calc( Gaze_Sequence *g_seq,
 
     if (g_seq->path == NULL || g_out->probability) {
       prev_idx = ft_idx - 1;
-      prev_feat = index_Array( g_seq->features, Feature *, prev_idx );
-      temp = g_res->feats[prev_feat->feat_idx][MOD3(prev_feat->adj_pos.s)];
+      temp = g_res->feats[ftab->feat_idx[prev_idx]][MOD3(ftab->adj_s[prev_idx])];
       append_val_Array( temp, prev_idx );
 
-      if (g_out->sample_gene || g_out->regions || g_out->probability)
+      if (! max_only)
 	scan_through_sources_dp( g_seq,
 				 gs, 
 				 ft_idx,  
@@ -218,11 +425,82 @@ void forwards_calc( Gaze_Sequence *g_seq,
 					   use_pruning);
     }
 
-    index_Array( g_seq->features, Feature *, ft_idx )->forward_score = g_res->score;
-    index_Array( g_seq->features, Feature *, ft_idx )->path_score = g_res->pth_score;
-    index_Array( g_seq->features, Feature *, ft_idx )->trace_pointer = g_res->pth_trace;
+    ftab->forward_score[ft_idx] = g_res->score;
+    ftab->path_score[ft_idx] = g_res->pth_score;
+    ftab->trace_pointer[ft_idx] = g_res->pth_trace;
+
+    if (ftab->samp_start != NULL)
+      append_samples_Feature_Table( ftab, ft_idx, 
+				    g_res->cand_scores, 
+				    g_res->cand_indices,
+				    ftab->invalid[ft_idx] ? 0 : g_res->num_cands );
   }
 
+  store_Feature_Table( ftab, g_seq->features );
+
+  g_seq->dp_allocs += g_res->num_allocs;
+  g_seq->dp_scans += g_res->num_scans;
+  free_Gaze_DP_struct( g_res, gs->feat_dict->len );
+}
+
+
+
+/*********************************************************************
+ FUNCTION: mea_calc
+ DESCRIPTION:
+   Finds the path of maximum expected accuracy, i.e. the legal path
+   that maximises the summed posterior probabilities of its features
+   and regions, leaving it in the trace pointers for trace_back_general
+ RETURNS:
+ ARGS: 
+ NOTES:
+   Needs the forward and backward scores of the features, so must
+   follow the full forward and backward calculations. The path 
+   scores of the features are left as expected accuracies.
+   The dominance pruning is based on the additivity of the log
+   scores, so cannot be used here
+ *********************************************************************/
+void mea_calc( Gaze_Sequence *g_seq,
+	       Gaze_Structure *gs ) {
+  
+  int ft_idx, prev_idx;
+  Array *temp;
+  Feature_Table *ftab = g_seq->feat_table;
+  
+  Gaze_DP_struct *g_res = new_Gaze_DP_struct( gs->feat_dict->len, 
+					      gs->seg_dict->len,
+					      0 );
+  set_dp_limits( g_res, g_seq );
+  
+#ifdef TRACE
+  fprintf(stderr, "\nExpected accuracy calculation:\n\n");
+#endif
+
+  load_Feature_Table( ftab, g_seq->features );
+
+  g_res->mea = TRUE;
+  g_res->mea_total = ftab->backward_score[0];
+  ftab->path_score[0] = 0.0;
+
+  for (ft_idx = 1; ft_idx < g_seq->features->len; ft_idx++) {
+    prev_idx = ft_idx - 1;
+    temp = g_res->feats[ftab->feat_idx[prev_idx]][MOD3(ftab->adj_s[prev_idx])];
+    append_val_Array( temp, prev_idx );
+
+    scan_through_sources_for_max_only( g_seq,
+				       gs, 
+				       ft_idx,  
+				       g_res,
+				       FALSE );
+
+    ftab->path_score[ft_idx] = g_res->pth_score;
+    ftab->trace_pointer[ft_idx] = g_res->pth_trace;
+  }
+
+  store_Feature_Table( ftab, g_seq->features );
+
+  g_seq->dp_allocs += g_res->num_allocs;
+  g_seq->dp_scans += g_res->num_scans;
   free_Gaze_DP_struct( g_res, gs->feat_dict->len );
 }
 
@@ -240,25 +518,27 @@ void backwards_calc( Gaze_Sequence *g_seq,
 		     boolean use_pruning) {
 
   int ft_idx, prev_idx;
-  Feature *prev_feat;
   Array *temp;
+  Feature_Table *ftab = g_seq->feat_table;
 
   Gaze_DP_struct *g_res = new_Gaze_DP_struct( gs->feat_dict->len, 
 					      gs->seg_dict->len,
 					      g_seq->features->len - 1 );
+  set_dp_limits( g_res, g_seq );
 
   g_res->last_selected = g_seq->features->len + 1;
 
 #ifdef TRACE
   fprintf(stderr, "\nBackward calculation:\n\n");
 #endif
+
+  load_Feature_Table( ftab, g_seq->features );
   
   for (ft_idx = g_seq->features->len-2; ft_idx >= 0; ft_idx--) {
     /* push the index if the last feature onto the list of
        sorted indices */
     prev_idx = ft_idx + 1;
-    prev_feat = index_Array( g_seq->features, Feature *, prev_idx );
-    temp = g_res->feats[prev_feat->feat_idx][MOD3(prev_feat->adj_pos.e)];
+    temp = g_res->feats[ftab->feat_idx[prev_idx]][MOD3(ftab->adj_e[prev_idx])];
     append_val_Array( temp, prev_idx );
 
     scan_through_targets_dp( g_seq,
@@ -267,15 +547,608 @@ void backwards_calc( Gaze_Sequence *g_seq,
 			     g_res,
 			     use_pruning);
 
-    index_Array( g_seq->features, Feature *, ft_idx )->backward_score = g_res->score;
+    ftab->backward_score[ft_idx] = g_res->score;
 
   }
 
+  store_Feature_Table( ftab, g_seq->features );
+
+  g_seq->dp_allocs += g_res->num_allocs;
+  g_seq->dp_scans += g_res->num_scans;
   free_Gaze_DP_struct( g_res,  gs->feat_dict->len );
 }
 
 
 
+/*********************************************************************/
+/***** Anchor-partitioned dp *****************************************/
+/*********************************************************************/
+
+/* A feature that is Selected must lie on every path, and the scans 
+   never look past the last such feature. The dp therefore separates 
+   exactly at selected features ("anchors"): the scores of the 
+   features between two anchors depend on what lies beyond the left 
+   anchor only through the anchor's own score, which is a constant 
+   additive offset (in log space) for all of them. 
+
+   The partitioned calculation exploits this by cutting the sequence 
+   at a subset of the anchors, running the dp for each block in 
+   parallel with the anchor scores set to zero, and then stitching 
+   the blocks together from left to right (right to left for the 
+   backward pass) by adding the global score of each block's first 
+   anchor to the local scores in the block. 
+
+   This is only exact if the cut anchors remain valid; if the dp 
+   invalidates one of them, the result is thrown away and the 
+   unpartitioned calculation is done instead. */
+
+typedef struct {
+  int first;            /* index of the anchor that starts the block */
+  int last;             /* index of the anchor that ends the block */
+  Gaze_DP_struct *g_res;
+
+  double score;         /* local results for the end anchor */
+  double pth_score;
+  int pth_trace;
+} Gaze_DP_block;
+
+typedef struct {
+  Gaze_Sequence *g_seq;
+  Gaze_Structure *gs;
+  boolean use_pruning;
+  Gaze_Output *g_out;     /* NULL for the backward pass */
+
+  Gaze_DP_block *blocks;
+  int num_blocks;
+  int next_block;
+  pthread_mutex_t lock;
+} Gaze_DP_block_pool;
+
+
+/*********************************************************************
+ FUNCTION: choose_dp_blocks
+ DESCRIPTION:
+   Chooses the anchors at which to cut the sequence for a partitioned
+   calculation, aiming for a few blocks per thread
+ RETURNS: the number of blocks (the block array is allocated here)
+ ARGS: 
+ NOTES:
+   Anchors that are already invalid are not used as cut points. 
+ *********************************************************************/
+static int choose_dp_blocks( Gaze_Sequence *g_seq,
+			     int num_threads,
+			     Gaze_DP_block **blocks ) {
+  int ft_idx, prev_cut, num_blocks = 0;
+  int len = g_seq->features->len;
+  int min_block_size = len / (4 * num_threads);
+  Feature_Table *ftab = g_seq->feat_table;
+
+  *blocks = (Gaze_DP_block *) malloc_util( len * sizeof( Gaze_DP_block ) );
+
+  for (prev_cut = 0, ft_idx = 1; ft_idx < len; ft_idx++) {
+    if (ft_idx == len - 1 ||
+	(ftab->is_selected[ft_idx] && ! ftab->invalid[ft_idx] && ft_idx - prev_cut >= min_block_size)) {
+      (*blocks)[num_blocks].first = prev_cut;
+      (*blocks)[num_blocks].last = ft_idx;
+      (*blocks)[num_blocks].g_res = NULL;
+      num_blocks++;
+      prev_cut = ft_idx;
+    }
+  }
+
+  return num_blocks;
+}
+
+
+/*********************************************************************
+ FUNCTION: forwards_calc_block
+ DESCRIPTION:
+   Forward calculation for the features strictly between the two
+   anchors of the given block
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static void forwards_calc_block( Gaze_DP_block_pool *pool,
+				 Gaze_DP_block *blk ) {
+  Gaze_Sequence *g_seq = pool->g_seq;
+  Gaze_Structure *gs = pool->gs;
+  Gaze_Output *g_out = pool->g_out;
+  Feature_Table *ftab = g_seq->feat_table;
+  int ft_idx, prev_idx;
+  Array *temp;
+
+  blk->g_res = new_Gaze_DP_struct( gs->feat_dict->len, 
+				   gs->seg_dict->len,
+				   0 );
+  set_dp_limits( blk->g_res, g_seq );
+  blk->g_res->last_selected = blk->first;
+
+  for (ft_idx = blk->first + 1; ft_idx < blk->last; ft_idx++) {
+    prev_idx = ft_idx - 1;
+    temp = blk->g_res->feats[ftab->feat_idx[prev_idx]][MOD3(ftab->adj_s[prev_idx])];
+    append_val_Array( temp, prev_idx );
+    
+    if (g_out->probability)
+      scan_through_sources_dp( g_seq, gs, ft_idx, blk->g_res, pool->use_pruning, g_out);
+    else
+      scan_through_sources_for_max_only( g_seq, gs, ft_idx, blk->g_res, pool->use_pruning);
+
+    ftab->forward_score[ft_idx] = blk->g_res->score;
+    ftab->path_score[ft_idx] = blk->g_res->pth_score;
+    ftab->trace_pointer[ft_idx] = blk->g_res->pth_trace;
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: backwards_calc_block
+ DESCRIPTION:
+   Backward calculation for the features strictly between the two
+   anchors of the given block
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static void backwards_calc_block( Gaze_DP_block_pool *pool,
+				  Gaze_DP_block *blk ) {
+  Gaze_Sequence *g_seq = pool->g_seq;
+  Gaze_Structure *gs = pool->gs;
+  Feature_Table *ftab = g_seq->feat_table;
+  int ft_idx, prev_idx;
+  Array *temp;
+
+  blk->g_res = new_Gaze_DP_struct( gs->feat_dict->len, 
+				   gs->seg_dict->len,
+				   g_seq->features->len - 1 );
+  set_dp_limits( blk->g_res, g_seq );
+  blk->g_res->last_selected = blk->last;
+
+  for (ft_idx = blk->last - 1; ft_idx > blk->first; ft_idx--) {
+    prev_idx = ft_idx + 1;
+    temp = blk->g_res->feats[ftab->feat_idx[prev_idx]][MOD3(ftab->adj_e[prev_idx])];
+    append_val_Array( temp, prev_idx );
+
+    scan_through_targets_dp( g_seq, gs, ft_idx, blk->g_res, pool->use_pruning);
+
+    ftab->backward_score[ft_idx] = blk->g_res->score;
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: dp_block_worker
+ DESCRIPTION:
+   Thread entry point; takes blocks from the pool until there are none left
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static void *dp_block_worker( void *arg ) {
+  Gaze_DP_block_pool *pool = (Gaze_DP_block_pool *) arg;
+  int blk_idx;
+
+  for(;;) {
+    pthread_mutex_lock( &(pool->lock) );
+    blk_idx = pool->next_block++;
+    pthread_mutex_unlock( &(pool->lock) );
+
+    if (blk_idx >= pool->num_blocks)
+      break;
+
+    if (pool->g_out != NULL)
+      forwards_calc_block( pool, &(pool->blocks[blk_idx]) );
+    else
+      backwards_calc_block( pool, &(pool->blocks[blk_idx]) );
+  }
+
+  return NULL;
+}
+
+
+/*********************************************************************
+ FUNCTION: run_dp_block_pool
+ DESCRIPTION:
+   Runs the first phase of the partitioned calculation (everything 
+   apart from the anchors) for all blocks, on the given number of 
+   threads. The calling thread acts as one of the workers
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static void run_dp_block_pool( Gaze_DP_block_pool *pool,
+			       int num_threads ) {
+  pthread_t *threads;
+  int i;
+
+  if (num_threads > pool->num_blocks)
+    num_threads = pool->num_blocks;
+
+  pool->next_block = 0;
+  pthread_mutex_init( &(pool->lock), NULL );
+
+  threads = (pthread_t *) malloc_util( num_threads * sizeof( pthread_t ) );
+  for (i=1; i < num_threads; i++)
+    if (pthread_create( &(threads[i]), NULL, &dp_block_worker, pool ))
+      fatal_util( "Could not create thread for the partitioned dp" );
+
+  dp_block_worker( pool );
+
+  for (i=1; i < num_threads; i++)
+    pthread_join( threads[i], NULL );
+
+  free_util( threads );
+  pthread_mutex_destroy( &(pool->lock) );
+}
+
+
+/*********************************************************************
+ FUNCTION: report_partition_check
+ DESCRIPTION:
+   Compares the given (partitioned) scores with those now held by 
+   the features (which are assumed to be the result of the 
+   unpartitioned calculation), and reports the differences
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static void report_partition_check( Gaze_Sequence *g_seq,
+				    char *pass,
+				    int num_blocks,
+				    double *part_scores,
+				    double *part_pth_scores,
+				    int *part_traces ) {
+  int i, trace_mismatches = 0;
+  double diff, max_diff = 0.0;
+
+  for (i=0; i < g_seq->features->len; i++) {
+    Feature *ft = index_Array( g_seq->features, Feature *, i );
+    double serial_scores[2];
+    double part[2];
+    int k;
+
+    if (part_pth_scores != NULL) {
+      serial_scores[0] = ft->forward_score;
+      serial_scores[1] = ft->path_score;
+      part[0] = part_scores[i];
+      part[1] = part_pth_scores[i];
+      if (part_traces[i] != ft->trace_pointer)
+	trace_mismatches++;
+    }
+    else {
+      serial_scores[0] = serial_scores[1] = ft->backward_score;
+      part[0] = part[1] = part_scores[i];
+    }
+
+    for (k=0; k < 2; k++) {
+      if (serial_scores[k] == part[k])
+	continue;
+      diff = fabs( serial_scores[k] - part[k] );
+      if (diff > max_diff)
+	max_diff = diff;
+    }
+  }
+
+  fprintf( stderr, "Partition check for %s (%s): %d blocks, max score difference %g, %d trace mismatches\n",
+	   g_seq->seq_name, pass, num_blocks, max_diff, trace_mismatches );
+}
+
+
+/*********************************************************************
+ FUNCTION: forwards_calc_partitioned
+ DESCRIPTION:
+   As forwards_calc, but runs the blocks between selected features
+   in parallel on the given number of threads (see above)
+ RETURNS:
+ ARGS: 
+ NOTES:
+   Falls back on forwards_calc when the output depends on the order
+   in which the features are processed (regions, sampling), or when
+   there is nothing to partition. If check is TRUE, the unpartitioned
+   calculation is done too, its results are kept, and a comparison
+   is written to stderr
+ *********************************************************************/
+void forwards_calc_partitioned( Gaze_Sequence *g_seq,
+				Gaze_Structure *gs,
+				boolean use_pruning,
+				Gaze_Output *g_out,
+				int num_threads,
+				boolean check ) {
+  Gaze_DP_block_pool pool;
+  Feature_Table *ftab = g_seq->feat_table;
+  boolean all_anchors_valid;
+  double *part_scores, *part_pth_scores;
+  int *part_traces;
+  int i, b, len = g_seq->features->len;
+  
+  if ((num_threads <= 1 && ! check) ||
+      g_out->regions || g_out->sample_gene || g_seq->nbest > 1 || g_seq->num_samples > 0 ||
+      (g_seq->path != NULL && ! g_out->probability)) {
+    forwards_calc( g_seq, gs, use_pruning, g_out );
+    return;
+  }
+
+  pool.g_seq = g_seq;
+  pool.gs = gs;
+  pool.use_pruning = use_pruning;
+  pool.g_out = g_out;
+
+  load_Feature_Table( ftab, g_seq->features );
+  pool.num_blocks = choose_dp_blocks( g_seq, num_threads, &(pool.blocks) );
+
+  for (b=1; b < pool.num_blocks; b++)
+    ftab->forward_score[pool.blocks[b].first] = ftab->path_score[pool.blocks[b].first] = 0.0;
+
+  run_dp_block_pool( &pool, num_threads );
+
+  /* the scans of the anchors themselves need the blocks to their left
+     to be finished; they are cheap, so they are done here in turn */
+
+  all_anchors_valid = TRUE;
+  for (b=0; b < pool.num_blocks; b++) {
+    Gaze_DP_block *blk = &(pool.blocks[b]);
+    int prev_idx = blk->last - 1;
+    
+    append_val_Array( blk->g_res->feats[ftab->feat_idx[prev_idx]][MOD3(ftab->adj_s[prev_idx])], 
+		      prev_idx );
+
+    if (g_out->probability)
+      scan_through_sources_dp( g_seq, gs, blk->last, blk->g_res, use_pruning, g_out);
+    else
+      scan_through_sources_for_max_only( g_seq, gs, blk->last, blk->g_res, use_pruning);
+
+    blk->score = blk->g_res->score;
+    blk->pth_score = blk->g_res->pth_score;
+    blk->pth_trace = blk->g_res->pth_trace;
+
+    if (b < pool.num_blocks - 1 && ftab->invalid[blk->last])
+      all_anchors_valid = FALSE;
+
+    g_seq->dp_allocs += blk->g_res->num_allocs;
+    g_seq->dp_scans += blk->g_res->num_scans;
+    free_Gaze_DP_struct( blk->g_res, gs->feat_dict->len );
+    blk->g_res = NULL;
+  }
+
+  if (all_anchors_valid) {
+    /* stitch, from left to right. The local max-only forward scores
+       are all zero anyway, so only the dp scores need the offset */
+    for (b=0; b < pool.num_blocks; b++) {
+      Gaze_DP_block *blk = &(pool.blocks[b]);
+      double fwd_offset = (b > 0 && g_out->probability) ? ftab->forward_score[blk->first] : 0.0;
+      double pth_offset = b > 0 ? ftab->path_score[blk->first] : 0.0;
+
+      for (i=blk->first + 1; i < blk->last; i++) {
+	if (! ftab->invalid[i]) {
+	  ftab->forward_score[i] += fwd_offset;
+	  ftab->path_score[i] += pth_offset;
+	}
+      }
+
+      ftab->forward_score[blk->last] = blk->score;
+      ftab->path_score[blk->last] = blk->pth_score;
+      ftab->trace_pointer[blk->last] = blk->pth_trace;
+      if (! ftab->invalid[blk->last]) {
+	ftab->forward_score[blk->last] += fwd_offset;
+	ftab->path_score[blk->last] += pth_offset;
+      }
+    }
+
+    if (! check)
+      store_Feature_Table( ftab, g_seq->features );
+  }
+
+  if (! all_anchors_valid || check) {
+    if (check && all_anchors_valid) {
+      part_scores = (double *) malloc_util( len * sizeof(double) );
+      part_pth_scores = (double *) malloc_util( len * sizeof(double) );
+      part_traces = (int *) malloc_util( len * sizeof(int) );
+      memcpy( part_scores, ftab->forward_score, len * sizeof(double) );
+      memcpy( part_pth_scores, ftab->path_score, len * sizeof(double) );
+      memcpy( part_traces, ftab->trace_pointer, len * sizeof(int) );
+    }
+    else 
+      part_scores = part_pth_scores = NULL, part_traces = NULL;
+
+    /* the features themselves are untouched so far, so the 
+       unpartitioned calculation starts from scratch */
+    forwards_calc( g_seq, gs, use_pruning, g_out );
+
+    if (check) {
+      if (part_scores != NULL) {
+	report_partition_check( g_seq, "forward", pool.num_blocks, 
+				part_scores, part_pth_scores, part_traces );
+	free_util( part_scores );
+	free_util( part_pth_scores );
+	free_util( part_traces );
+      }
+      else
+	fprintf( stderr, "Partition check for %s (forward): an anchor was invalidated, not partitioned\n",
+		 g_seq->seq_name );
+    }
+  }
+
+  free_util( pool.blocks );
+}
+
+
+/*********************************************************************
+ FUNCTION: backwards_calc_partitioned
+ DESCRIPTION:
+   As backwards_calc, but runs the blocks between selected features
+   in parallel on the given number of threads (see above)
+ RETURNS:
+ ARGS: 
+ NOTES:
+   See forwards_calc_partitioned for the meaning of check
+ *********************************************************************/
+void backwards_calc_partitioned( Gaze_Sequence *g_seq,
+				 Gaze_Structure *gs,
+				 boolean use_pruning,
+				 int num_threads,
+				 boolean check ) {
+  Gaze_DP_block_pool pool;
+  Feature_Table *ftab = g_seq->feat_table;
+  boolean all_anchors_valid;
+  double *part_scores;
+  int i, b, len = g_seq->features->len;
+  
+  if (num_threads <= 1 && ! check) {
+    backwards_calc( g_seq, gs, use_pruning );
+    return;
+  }
+
+  pool.g_seq = g_seq;
+  pool.gs = gs;
+  pool.use_pruning = use_pruning;
+  pool.g_out = NULL;
+
+  load_Feature_Table( ftab, g_seq->features );
+  pool.num_blocks = choose_dp_blocks( g_seq, num_threads, &(pool.blocks) );
+
+  for (b=0; b < pool.num_blocks - 1; b++)
+    ftab->backward_score[pool.blocks[b].last] = 0.0;
+
+  run_dp_block_pool( &pool, num_threads );
+
+  all_anchors_valid = TRUE;
+  for (b=pool.num_blocks - 1; b >= 0; b--) {
+    Gaze_DP_block *blk = &(pool.blocks[b]);
+    int prev_idx = blk->first + 1;
+    
+    append_val_Array( blk->g_res->feats[ftab->feat_idx[prev_idx]][MOD3(ftab->adj_e[prev_idx])], 
+		      prev_idx );
+
+    scan_through_targets_dp( g_seq, gs, blk->first, blk->g_res, use_pruning);
+    blk->score = blk->g_res->score;
+
+    if (b > 0 && ftab->invalid[blk->first])
+      all_anchors_valid = FALSE;
+
+    g_seq->dp_allocs += blk->g_res->num_allocs;
+    g_seq->dp_scans += blk->g_res->num_scans;
+    free_Gaze_DP_struct( blk->g_res, gs->feat_dict->len );
+    blk->g_res = NULL;
+  }
+
+  if (all_anchors_valid) {
+    /* stitch, from right to left */
+    for (b=pool.num_blocks - 1; b >= 0; b--) {
+      Gaze_DP_block *blk = &(pool.blocks[b]);
+      double offset = b < pool.num_blocks - 1 ? ftab->backward_score[blk->last] : 0.0;
+
+      for (i=blk->first + 1; i < blk->last; i++) {
+	if (! ftab->invalid[i])
+	  ftab->backward_score[i] += offset;
+      }
+
+      ftab->backward_score[blk->first] = blk->score;
+      if (! ftab->invalid[blk->first])
+	ftab->backward_score[blk->first] += offset;
+    }
+
+    if (! check)
+      store_Feature_Table( ftab, g_seq->features );
+  }
+
+  if (! all_anchors_valid || check) {
+    if (check && all_anchors_valid) {
+      part_scores = (double *) malloc_util( len * sizeof(double) );
+      memcpy( part_scores, ftab->backward_score, len * sizeof(double) );
+    }
+    else 
+      part_scores = NULL;
+
+    backwards_calc( g_seq, gs, use_pruning );
+
+    if (check) {
+      if (part_scores != NULL) {
+	report_partition_check( g_seq, "backward", pool.num_blocks, 
+				part_scores, NULL, NULL );
+	free_util( part_scores );
+      }
+      else
+	fprintf( stderr, "Partition check for %s (backward): an anchor was invalidated, not partitioned\n",
+		 g_seq->seq_name );
+    }
+  }
+
+  free_util( pool.blocks );
+}
+
+
+
+/*********************************************************************
+ FUNCTION: find_killer_boundary
+ DESCRIPTION:
+   Finds the furthest feature in the given list of candidates 
+   (of one type and frame) that the scan may reach, given the 
+   killers in apt_list. The lists are those kept by the dp, in the
+   order that the features were seen, so the nearest to the current 
+   feature are last. For the forward pass (scanning back through 
+   sources), the killer is the nearest that ends at or before pos; 
+   the candidates overlapping its start are allowed, but nothing
+   further. The backward pass is the mirror image.
+ RETURNS: 
+   The boundary feature index, or -1 if no killer applies 
+ ARGS: 
+ NOTES:
+   The candidate lists are monotonic in feature index, so the 
+   candidates up to the killer are found by binary search rather 
+   than by walking back from the current feature
+ *********************************************************************/
+static int find_killer_boundary( Feature_Table *ftab,
+				 Array *apt_list,
+				 Array *cands,
+				 int pos,
+				 boolean forward ) {
+  int this_kill_idx = apt_list->len - 1;
+  int killer_idx, boundary_index, left, right, local_idx;
+
+  /* first search back for the first occurrence that does not overlap 
+     with the current feature */
+
+  for (; this_kill_idx >= 0; this_kill_idx--) {
+    killer_idx = index_Array( apt_list, int, this_kill_idx );
+    if (forward ? ftab->real_e[killer_idx] <= pos : ftab->real_s[killer_idx] >= pos)
+      break;
+  }
+  if (this_kill_idx < 0)
+    return -1;
+
+  /* now find the candidates on the near side of the killer... */
+
+  left = 0;
+  right = cands->len;
+  while (left < right) {
+    int mid = (left + right) / 2;
+    int mid_idx = index_Array( cands, int, mid );
+
+    if (forward ? mid_idx <= killer_idx : mid_idx >= killer_idx)
+      left = mid + 1;
+    else
+      right = mid;
+  }
+
+  /* ...and allow those beyond it that overlap it */
+
+  boundary_index = killer_idx;
+  for (local_idx = left - 1; local_idx >= 0; local_idx--) {
+    int loc_f_idx = index_Array( cands, int, local_idx );
+
+    if (forward ? 
+	ftab->adj_s[loc_f_idx] <= ftab->real_s[killer_idx] :
+	ftab->adj_e[loc_f_idx] >= ftab->real_e[killer_idx])
+      break;
+    else 
+      boundary_index = loc_f_idx;
+  }
+
+  return boundary_index;
+}
+
+
+
 /*********************************************************************
  FUNCTION: scan_through_sources_dp
  DESCRIPTION:
@@ -297,39 +1170,41 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
   Killer_Feature_Qualifier *kq;
 
   boolean touched_score, touched_score_local;
-  Array *all_scores = NULL;
-  Array *all_indices = NULL;  /* Initialised to get around gcc warnings */
-  Feature_Info *tgt_info;
+  Compiled_Relation *c_rel;
   Feature_Relation *reg_info;
-  Feature *src, *tgt;
+  Feature_Table *ftab = g_seq->feat_table;
 
   boolean gone_far_enough = FALSE;
+  boolean beam_cut;
   double max_forpluslen = 0.0;
   double max_score = NEG_INFINITY;
   double max_forward = NEG_INFINITY;
-  int *killer_source_dna = NULL;
-  int *danger_source_dna = NULL;
+  Log_Sum_Exp forward_sum;
+  /* the candidates only need to be kept for sampling; otherwise
+     they can be summed as we go */
+  boolean keep_cands = g_out->sample_gene || ftab->samp_start != NULL;
+  unsigned int *killer_source_dna = NULL;
+  unsigned int *danger_source_dna = NULL;
 
   g_res->pth_score = 0.0;
   g_res->pth_trace = 0,0;
   g_res->score = 0.0;
 
-  tgt = index_Array( g_seq->features, Feature *, tgt_idx );
-  tgt_info = index_Array( gs->feat_info, Feature_Info *, tgt->feat_idx );
-  right_pos = tgt->adj_pos.e;
+  right_pos = ftab->adj_e[tgt_idx];
 
 #ifdef TRACE 
   fprintf( stderr, "Target %d %s %d %d %.3f", tgt_idx,
-	   index_Array(gs->feat_dict, char *, tgt->feat_idx ), 
-	   tgt->real_pos.s, tgt->real_pos.e, tgt->score );
+	   index_Array(gs->feat_dict, char *, ftab->feat_idx[tgt_idx] ), 
+	   ftab->real_s[tgt_idx], ftab->real_e[tgt_idx], ftab->score[tgt_idx] );
   if (TRACE > 1)
     fprintf( stderr, "\n" );
 #endif
 
-    all_scores = new_Array( sizeof(double), TRUE );
-    all_indices = new_Array( sizeof(int), TRUE );
+  g_res->num_cands = 0;
+  g_res->num_scans++;
+  clear_Log_Sum_Exp( &forward_sum );
 
-  if (! tgt->invalid) {
+  if (! ftab->invalid[tgt_idx]) {
     touched_score = FALSE;
 
     /* set up the boundaries for the scan. We do not want to go past:
@@ -342,8 +1217,10 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
     
     /* Look through the sources themselves */
     
-    for ( src_type = 0; src_type < tgt_info->sources->len; src_type++) {
-      if ((reg_info = index_Array(tgt_info->sources, Feature_Relation *, src_type)) != NULL) {
+    for ( src_type = 0; src_type < gs->feat_dict->len; src_type++) {
+      c_rel = relation_Gaze_Structure( gs, ftab->feat_idx[tgt_idx], src_type );
+
+      if ((reg_info = c_rel->rel) != NULL) {
 	Array **feats = g_res->feats[src_type];
 	
 	for(frame = 0; frame < 3; frame++) {
@@ -353,7 +1230,7 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
 	  /* first, identify the killers local to this feature pair, and make
 	     sure that our search back through the sources does not go past a killer */
 	  
-	  if (reg_info->kill_feat_quals != NULL) {
+	  if (c_rel->flags & REL_HAS_KILLERS) {
 	    
 	    for(kill_idx=0; kill_idx < reg_info->kill_feat_quals->len; kill_idx++) {
 	      if ( (kq = index_Array( reg_info->kill_feat_quals,
@@ -392,44 +1269,10 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
 		  }
 		  
 		  if (apt_list->len > 0) {
-		    /* first search back for the first occurrence that does not overlap with target */
-		    int this_kill_idx = apt_list->len - 1;
-		    int boundary_index = index_Array( apt_list, int, this_kill_idx );
-		    Feature *killer_feat = index_Array(g_seq->features, Feature *, boundary_index );
-
-		    while ( killer_feat != NULL && killer_feat->real_pos.e > tgt->adj_pos.e) {
-		      if (--this_kill_idx >= 0) {
-			boundary_index = index_Array( apt_list, int, this_kill_idx );
-			killer_feat = index_Array( g_seq->features, Feature *, boundary_index );
-		      }
-		      else
-			killer_feat = NULL;
-		    }
-		    /* now search back for sources beyond the killer of this type that overlap the killer */
-
-		    if (killer_feat != NULL) {
-		      int local_idx;
-		      
-		      for(local_idx = feats[frame]->len - 1; local_idx >=0; local_idx-- ) {
-			Feature *candidate;
-			int loc_f_idx = index_Array( feats[frame], int, local_idx );
-
-			if (loc_f_idx > boundary_index) 
-			  continue;
-
-			candidate = index_Array( g_seq->features, 
-						 Feature *,
-						 loc_f_idx );
-				
-			if (candidate->adj_pos.s <= killer_feat->real_pos.s)
-			  break;
-			else 
-			  boundary_index = loc_f_idx;
-		      }
+		    int boundary_index = find_killer_boundary( ftab, apt_list, feats[frame], ftab->adj_e[tgt_idx], TRUE );
 
-		      if (boundary_index > last_idx_for_frame[frame]) 
-			last_idx_for_frame[frame] = boundary_index;
-		    }
+		    if (boundary_index > last_idx_for_frame[frame]) 
+		      last_idx_for_frame[frame] = boundary_index;
 		  }
 		}
 	      }
@@ -438,30 +1281,18 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
 	  
 	  /* finally, make sure that we do not proceed past the fringe for
 	     this feature pair */
-	  if (g_res->fringes[(int)tgt->feat_idx][src_type][MOD3(tgt->real_pos.s)] > last_idx_for_frame[frame])
-	    last_idx_for_frame[frame] = g_res->fringes[(int)tgt->feat_idx][src_type][MOD3(tgt->real_pos.s)];
+	  if (g_res->fringes[(int)ftab->feat_idx[tgt_idx]][src_type][MOD3(ftab->real_s[tgt_idx])] > last_idx_for_frame[frame])
+	    last_idx_for_frame[frame] = g_res->fringes[(int)ftab->feat_idx[tgt_idx]][src_type][MOD3(ftab->real_s[tgt_idx])];
 	}
 	
 	/* Before actually scanning through the features themselves, we need to check
 	   if there are potential dna killers. If so, set flags for the source
 	   dna entries that will cause problems */
 	
-	if (reg_info->kill_dna_quals != NULL) {
-	  danger_source_dna = (int *) malloc0_util( gs->motif_dict->len * sizeof(int) );
-	  
-	  for(k=0; k < reg_info->kill_dna_quals->len; k++) {
-	    Killer_DNA_Qualifier *kdq = index_Array( reg_info->kill_dna_quals, 
-						       Killer_DNA_Qualifier *,
-						       k );
-	    
-	    danger_source_dna[(int)kdq->src_dna] = 1; 
-	    
-	    if (tgt->dna >= 0 && tgt->dna == kdq->tgt_dna) {
-	      if (killer_source_dna == NULL) 
-		killer_source_dna = (int *) malloc0_util( gs->motif_dict->len * sizeof(int) );
-	      killer_source_dna[(int)kdq->src_dna] = 1;
-	    }
-	  }
+	if (c_rel->flags & REL_HAS_DNA_KILLERS) {
+	  danger_source_dna = c_rel->danger_src_dna;
+	  if (ftab->dna[tgt_idx] >= 0)
+	    killer_source_dna = c_rel->killer_src_dna + ftab->dna[tgt_idx] * c_rel->dna_set_words;
 	}
 	
 	/* at this point, we have the list of features that need to be processed (feats),
@@ -478,7 +1309,7 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
 	for(k=0; k < 3; k++) 
 	  index_count[k] = feats[k]->len - 1; 
 	
-	frame = reg_info->phase != NULL ? MOD3(right_pos - *(reg_info->phase) + 1) : 0;
+	frame = c_rel->phase != NO_PHASE ? MOD3(right_pos - c_rel->phase + 1) : 0;
 
 	max_forpluslen = NEG_INFINITY;
 	touched_score_local = FALSE;
@@ -488,10 +1319,21 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
 	   furture instances of the target */
 	local_fringe = tgt_idx;
 	gone_far_enough = FALSE;
+	beam_cut = FALSE;
+
+	/* the segment scores are only calculated if this pair uses 
+	   segments, so the exact segment information must be cleared
+	   for the pruning tests below */
+	if (! (c_rel->flags & REL_HAS_SEGS))
+	  g_res->seg_res->has_exact_at_src = g_res->seg_res->has_exact_at_tgt = FALSE;
+	else
+	  /* the sources come right to left, so the segments can be
+	     carried from one to the next */
+	  start_scan_Seg_Results( g_res->seg_res, c_rel, right_pos );
 
 	while( ! gone_far_enough ) {
 
-	  if (reg_info->phase == NULL) {
+	  if (c_rel->phase == NO_PHASE) {
 	    /* For frameless feature pairs, we need to examine all frames, but 
 	       for the pruning to work effectively, the featured need to be examined 
 	       in order. Therefore, we have to re-create the original list
@@ -536,18 +1378,17 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
 	    continue;
 	  }
 
-	  src = index_Array( g_seq->features, Feature *, src_idx );
 	  
 #ifdef TRACE
 	  if (TRACE > 1)
 	    fprintf( stderr, "     Source %d %s %d %d ", src_idx,
 		     index_Array(gs->feat_dict, char *, src_type ),
-		     src->real_pos.s, src->real_pos.e );
+		     ftab->real_s[src_idx], ftab->real_e[src_idx] );
 #endif
 	  
-	  if (! src->invalid) {
+	  if (! ftab->invalid[src_idx]) {
 	    
-	    left_pos = src->adj_pos.s;
+	    left_pos = ftab->adj_s[src_idx];
 	    distance = right_pos - left_pos + 1;
 	    
 #ifdef TRACE
@@ -555,42 +1396,56 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
 	      fprintf( stderr, "dist=%d  ", distance );
 #endif	    
 
-	    if ((reg_info->max_dist == NULL) || (*(reg_info->max_dist)) >= distance) {
+	    if (c_rel->max_dist >= distance) {
 	      
-	      if ((reg_info->min_dist == NULL) || (*(reg_info->min_dist)) <= distance) {
+	      if (c_rel->min_dist <= distance) {
 		/* Finally, if this source does not result in a DNA kill, we can calc the score */
-		if (killer_source_dna == NULL || src->dna < 0 || ! killer_source_dna[(int)src->dna]) {
+		if (killer_source_dna == NULL || ftab->dna[src_idx] < 0 || ! in_DNA_Set( killer_source_dna, ftab->dna[src_idx] )) {
 		  double trans_score, len_pen, seg_score, forward_temp, viterbi_temp;
-		  Length_Function *lf = NULL;
+		  Length_Function *lf;
 		  trans_score = len_pen = forward_temp = viterbi_temp = 0.0;
 
-		  seg_score = calculate_segment_score( g_seq, src, tgt, gs, g_res->seg_res );
+		  if (c_rel->flags & REL_HAS_SEGS)
+		    seg_score = calculate_segment_score_for_relation( g_seq, c_rel, left_pos, right_pos, g_res->seg_res );
+		  else
+		    seg_score = 0.0;
 		  trans_score += seg_score;
 		  
-		  if (reg_info->len_fun != NULL) {
-		    lf = index_Array(gs->length_funcs, Length_Function *, *(reg_info->len_fun));
+		  if ((lf = c_rel->len_fun) != NULL)
 		    len_pen = apply_Length_Function( lf, distance );
-		  }
 		  trans_score -= len_pen;
 		  
-		  viterbi_temp = src->path_score +
+		  viterbi_temp = ftab->path_score[src_idx] +
 		    + trans_score
-		    + tgt->score;
+		    + ftab->score[tgt_idx];
 		  
 		  if (! touched_score || (viterbi_temp > max_score) ) {
 		    max_score = viterbi_temp;
 		    max_index = src_idx;
 		  }
 		  
-		  forward_temp = src->forward_score 
+		  forward_temp = ftab->forward_score[src_idx] 
 		    + trans_score
-		    + tgt->score;
+		    + ftab->score[tgt_idx];
 		    
-		  append_val_Array( all_scores, forward_temp);
-		  append_val_Array( all_indices, src_idx);
+		  /* with a beam, only the best few sources in each frame
+		     are summed, once the scan of this source type is done,
+		     and the frame is left once the sources fall well short 
+		     of them */
+		  if (g_res->beam_width > 0) {
+		    if (add_dp_beam( g_res, frame, forward_temp, src_idx )) {
+		      index_count[frame] = -1;
+		      beam_cut = TRUE;
+		    }
+		  }
+		  else if (keep_cands) {
+		    add_dp_candidate( g_res, forward_temp, src_idx );
 		  
-		  if (! touched_score || (forward_temp > max_forward))
-		    max_forward = forward_temp;
+		    if (! touched_score || (forward_temp > max_forward))
+		      max_forward = forward_temp;
+		  }
+		  else
+		    add_Log_Sum_Exp( &forward_sum, forward_temp );
 		  
 		  if (use_pruning) {
 		    /* There are two assumptions for my pruning method:
@@ -611,8 +1466,8 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
 		    if (! touched_score_local ) {
 		      
 		      if (danger_source_dna == NULL 
-			  || src->dna < 0  
-			  || ! danger_source_dna[(int)src->dna]) {
+			  || ftab->dna[src_idx] < 0  
+			  || ! in_DNA_Set( danger_source_dna, ftab->dna[src_idx] )) {
 			
 			/* strictly speaking, it is only sound to register this source
 			   as "dominant" if we are into the monotonic part of the length
@@ -644,19 +1499,19 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
 		      /* compare this one to max_forward, to see if it is dominated */
 		      if (forward_temp + len_pen > max_forpluslen 
 			  && (danger_source_dna == NULL 
-			      || src->dna < 0  
-			      || ! danger_source_dna[(int)src->dna])
+			      || ftab->dna[src_idx] < 0  
+			      || ! in_DNA_Set( danger_source_dna, ftab->dna[src_idx] ))
 			  && ! g_res->seg_res->has_exact_at_src)
 			max_forpluslen = forward_temp + len_pen;
 		      
-		      if ( max_forpluslen - (forward_temp + len_pen) < 25.0 
+		      if ( max_forpluslen - (forward_temp + len_pen) < g_res->margin 
 			   || (g_res->seg_res->has_exact_at_src 
 			       && g_res->seg_res->exact_extends_beyond_tgt))
 			local_fringe = src_idx;
 		    }
 		  }
 		
-		  touched_score = TRUE;		  
+		  touched_score = TRUE;
 #ifdef TRACE
 		  if (TRACE > 1) 
 		    fprintf( stderr, "scre: v=%.3f, f=%.8f (seg:%.5f len:%.3f)\n",
@@ -668,10 +1523,10 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
 		      double reg_score = trans_score;
 		      
 		      if (g_out->probability) 
-			reg_score = exp( src->forward_score + 
-					 trans_score + tgt->score +				   
-					 tgt->backward_score - 
-					 g_seq->beg_ft->backward_score );
+			reg_score = exp( ftab->forward_score[src_idx] + 
+					 trans_score + ftab->score[tgt_idx] +				   
+					 ftab->backward_score[tgt_idx] - 
+					 ftab->backward_score[0] );
 		      
 		      if (! g_out->use_threshold || reg_score >= g_out->threshold)
 			fprintf(g_out->fh, "%s\tGAZE\t%s\t%d\t%d\t%.5f\t%s\t%s\t\n",
@@ -723,70 +1578,63 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
 	      fprintf( stderr, "INVALID\n" );
 #endif
 	} /* while !gone_far_enough */
+
+	if (g_res->beam_width > 0)
+	  drain_dp_beam( g_res, keep_cands, &forward_sum, &max_forward );
       
-	if (use_pruning) {
+	/* a frame left early by the beam says nothing about the sources
+	   beyond it, so the fringe must not move past them */
+	if (use_pruning && ! beam_cut) {
 	  /* We conservatively only prune in the frame of the target if this
 	     feature pair has a phase constraint, or if there are potential
 	     killers (which also might have a phase constraint). Otherwise, 
 	     prune in all frames */
-	  if (reg_info->phase != NULL || reg_info->kill_feat_quals != NULL) {
-	    g_res->fringes[(int)tgt->feat_idx][src_type][MOD3(tgt->real_pos.s)] = local_fringe;
+	  if (c_rel->phase != NO_PHASE || (c_rel->flags & REL_HAS_KILLERS)) {
+	    g_res->fringes[(int)ftab->feat_idx[tgt_idx]][src_type][MOD3(ftab->real_s[tgt_idx])] = local_fringe;
 	  }
 	  else {
 	    for(k=0; k < 3; k++)
-	      g_res->fringes[(int)tgt->feat_idx][src_type][k] = local_fringe;
+	      g_res->fringes[(int)ftab->feat_idx[tgt_idx]][src_type][k] = local_fringe;
 	  }
 	}
 	
-	if (danger_source_dna != NULL) {
-	  free_util( danger_source_dna );
-	  danger_source_dna = NULL;
-	}
-	if (killer_source_dna != NULL) {
-	  free_util( killer_source_dna );
-	  killer_source_dna = NULL;
-	}
+	danger_source_dna = NULL;
+	killer_source_dna = NULL;
       }  
     }
 
     /* update the position of the last forced feature. */
     
-    if (tgt->is_selected)
+    if (ftab->is_selected[tgt_idx])
       g_res->last_selected = tgt_idx;
     
     if (touched_score) {      
       /* the trick of subtracting the max before exponentiating avoids
 	 overflow errors. Just need to add it back when logging back down */
-      for (src_idx=0; src_idx < all_scores->len; src_idx++) {
-	g_res->score += exp( index_Array(all_scores, double, src_idx) 
-			     - max_forward );  
-	  
-      }
-      g_res->score = log( g_res->score ) + max_forward;	
+      if (keep_cands)
+	g_res->score = log_sum_exp( g_res->cand_scores, g_res->num_cands, max_forward );
+      else
+	g_res->score = value_Log_Sum_Exp( &forward_sum );
             
       if (g_out->sample_gene) {
-	double random_number = (double) rand() / (double) RAND_MAX;
+	double random_number = (double) rand_r( &(g_res->rand_state) ) / (double) RAND_MAX;
 	double sum = 0.0;
 
-	for(src_idx=0; src_idx < all_indices->len; src_idx++) {
-	  double ft_prob = exp( index_Array( all_scores, double, src_idx ) -
+	for(src_idx=0; src_idx < g_res->num_cands; src_idx++) {
+	  double ft_prob = exp( g_res->cand_scores[src_idx] -
 				g_res->score ); 
 	  sum += ft_prob;
 	  
 	  if (sum >= random_number) {
-	    Feature *tmp;
-	    
-	    g_res->pth_trace = index_Array( all_indices, int, src_idx);
-
-	    tmp = index_Array( g_seq->features, Feature *, g_res->pth_trace ); 
+	    g_res->pth_trace = g_res->cand_indices[src_idx];
 
 	    /* note that we are just returning the transition + local score 
 	       here for the source-target pair. This can be accumulated
 	       by the caller to get the score of the sample path. Alternatively,
 	       the score of the path can be computed with calculate_path_score */
 	    
-	    g_res->pth_score = index_Array( all_scores, double, src_idx) -
-	      tmp->forward_score;
+	    g_res->pth_score = g_res->cand_scores[src_idx] -
+	      ftab->forward_score[g_res->pth_trace];
 	    
 	    break;
 	  }
@@ -805,7 +1653,7 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
 #endif
     }
     else {
-      tgt->invalid = TRUE;
+      ftab->invalid[tgt_idx] = TRUE;
 
 #ifdef TRACE
       fprintf( stderr, "  *** Invalidating\n");
@@ -822,11 +1670,8 @@ void scan_through_sources_dp( Gaze_Sequence *g_seq,
      calculation of Fend - however we need to do it for the sake
      of individual feature posterior probabilities */
   
-  if (tgt->invalid)
+  if (ftab->invalid[tgt_idx])
     g_res->score = NEG_INFINITY;
-
-  free_Array( all_indices, TRUE );
-  free_Array( all_scores, TRUE );
 }
 
 
@@ -851,21 +1696,20 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
   Killer_Feature_Qualifier *kq;
 
   boolean touched_score, touched_score_local;
-  Array *all_scores;
-  Feature_Info *tgt_info;
+  Compiled_Relation *c_rel;
   Feature_Relation *reg_info;
-  Feature *src, *tgt;
+  Feature_Table *ftab = g_seq->feat_table;
 
   boolean gone_far_enough = FALSE;
-  double max_backward = 0.0;
+  boolean beam_cut;
+  Log_Sum_Exp backward_sum;
   double max_backpluslen = 0.0;
-  int *killer_target_dna = NULL;
-  int *danger_target_dna = NULL;
+  unsigned int *killer_target_dna = NULL;
+  unsigned int *danger_target_dna = NULL;
 
   g_res->score = 0.0;
 
-  src = index_Array( g_seq->features, Feature *, src_idx );
-  left_pos = src->adj_pos.s;
+  left_pos = ftab->adj_s[src_idx];
 
   /* if the user specified unusual offsets, it may be that this feature is
      "off the end of the sequence" when viewed as a target. */
@@ -877,16 +1721,17 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
   */
 #ifdef TRACE
   fprintf( stderr, "Source %d %s %d %d %.3f", src_idx,
-	   index_Array(gs->feat_dict, char *, src->feat_idx ), 
-	   src->real_pos.s, src->real_pos.e, src->score ); 
+	   index_Array(gs->feat_dict, char *, ftab->feat_idx[src_idx] ), 
+	   ftab->real_s[src_idx], ftab->real_e[src_idx], ftab->score[src_idx] ); 
   
   if (TRACE > 1)
     fprintf( stderr, "\n" );
 #endif
   
-  all_scores = new_Array( sizeof(double), TRUE);
+  clear_Log_Sum_Exp( &backward_sum );
+  g_res->num_scans++;
 
-  if (! src->invalid ) { 
+  if (! ftab->invalid[src_idx] ) { 
     touched_score = FALSE;
 
     /* set up the boundaries for the scan. We do not want to go past 
@@ -900,13 +1745,9 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
     /* Look through the targets themselves */
     
     for ( tgt_type = 0; tgt_type < gs->feat_dict->len; tgt_type++) {
-      tgt_info = index_Array( gs->feat_info, Feature_Info *, tgt_type );
-
-      /* this guards against looking for sources of BEGIN, of which there are none */
-      if (tgt_info->sources == NULL)
-	continue;
+      c_rel = relation_Gaze_Structure( gs, tgt_type, ftab->feat_idx[src_idx] );
 
-      if ((reg_info = index_Array(tgt_info->sources, Feature_Relation *, src->feat_idx)) != NULL) {
+      if ((reg_info = c_rel->rel) != NULL) {
 	Array **feats = g_res->feats[tgt_type];
 
 	for(frame = 0; frame < 3; frame ++) {
@@ -917,7 +1758,7 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
 	     sure that our search forward through the targets does not go past 
 	     a killer */
 
-	  if (reg_info->kill_feat_quals != NULL) {
+	  if (c_rel->flags & REL_HAS_KILLERS) {
 
 	    for(kill_idx=0; kill_idx < reg_info->kill_feat_quals->len; kill_idx++) {
 
@@ -957,46 +1798,10 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
 		  }
 		  
 		  if (apt_list->len > 0) {
+		    int boundary_index = find_killer_boundary( ftab, apt_list, feats[frame], ftab->adj_s[src_idx], FALSE );
 
-		    /* first search forward for the first occurrence that does not overlap with the src */
-		    int this_kill_idx = apt_list->len - 1;
-		    int boundary_index = index_Array( apt_list, int, this_kill_idx );
-		    Feature *killer_feat = index_Array(g_seq->features, Feature *, boundary_index );
-
-		    while ( killer_feat != NULL && killer_feat->real_pos.s < src->adj_pos.s ) {
-		      if (--this_kill_idx >= 0) {
-			boundary_index = index_Array( apt_list, int, this_kill_idx );
-			killer_feat = index_Array(g_seq->features, Feature *, boundary_index );
-		      }
-		      else
-			killer_feat = NULL;
-		    }
-		    /* now search forward for targets beyond the killer of this type that overlap the killer */
-		    
-		    if (killer_feat != NULL) {
-		      int local_idx;
-
-		      for(local_idx = feats[frame]->len - 1; local_idx >=0; local_idx-- ) {
-			Feature *candidate;
-			int loc_f_idx = index_Array( feats[frame], int, local_idx );
-
-			if (loc_f_idx < boundary_index) 
-			  continue;
-
-			candidate = index_Array( g_seq->features, 
-						 Feature *,
-						 loc_f_idx );
-
-			if (candidate->adj_pos.e >= killer_feat->real_pos.e)
-			  break;
-			else 
-			  boundary_index = loc_f_idx;
-		      }
-		      
-		      if (boundary_index < last_idx_for_frame[frame]) 
-			last_idx_for_frame[frame] = boundary_index;
-
-		    }
+		    if (boundary_index >= 0 && boundary_index < last_idx_for_frame[frame]) 
+		      last_idx_for_frame[frame] = boundary_index;
 		  }
 		}
 	      }
@@ -1005,8 +1810,8 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
 	  
 	  /* finally, make sure that we do not proceed past the fringe for
 	     this feature pair */
-	  if (g_res->fringes[(int)src->feat_idx][tgt_type][MOD3(src->real_pos.s)] < last_idx_for_frame[frame])
-	    last_idx_for_frame[frame] = g_res->fringes[(int)src->feat_idx][tgt_type][MOD3(src->real_pos.s)];
+	  if (g_res->fringes[(int)ftab->feat_idx[src_idx]][tgt_type][MOD3(ftab->real_s[src_idx])] < last_idx_for_frame[frame])
+	    last_idx_for_frame[frame] = g_res->fringes[(int)ftab->feat_idx[src_idx]][tgt_type][MOD3(ftab->real_s[src_idx])];
 	}
 
 
@@ -1014,22 +1819,10 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
 	   if there are potential dna killers. If so, set flags for the source
 	   dna entries that will cause problems */
 	
-	if (reg_info->kill_dna_quals != NULL) {
-	  danger_target_dna = (int *) malloc0_util( gs->motif_dict->len * sizeof(int) );
-	  
-	  for(k=0; k < reg_info->kill_dna_quals->len; k++) {
-	    Killer_DNA_Qualifier *kdq = index_Array( reg_info->kill_dna_quals, 
-						       Killer_DNA_Qualifier *,
-						       k );
-	    
-	    danger_target_dna[(int)kdq->tgt_dna] = 1;
-	    
-	    if (src->dna >= 0 && src->dna == kdq->src_dna) {
-	      if (killer_target_dna == NULL)
-		killer_target_dna = (int *) malloc0_util( gs->motif_dict->len * sizeof(int) );
-	      killer_target_dna[(int)kdq->tgt_dna] = 1;
-	    }
-	  }
+	if (c_rel->flags & REL_HAS_DNA_KILLERS) {
+	  danger_target_dna = c_rel->danger_tgt_dna;
+	  if (ftab->dna[src_idx] >= 0)
+	    killer_target_dna = c_rel->killer_tgt_dna + ftab->dna[src_idx] * c_rel->dna_set_words;
 	}
 	
 	/* at this point, we have the list of features that need to be processed (feats),
@@ -1046,7 +1839,7 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
 	for(k=0; k < 3; k++) 
 	  index_count[k] = feats[k]->len - 1; 
 	
-	frame = reg_info->phase != NULL ? MOD3(left_pos + *(reg_info->phase) - 1) : 0;
+	frame = c_rel->phase != NO_PHASE ? MOD3(left_pos + c_rel->phase - 1) : 0;
 
 	max_backpluslen = NEG_INFINITY;
 	touched_score_local = FALSE;
@@ -1056,10 +1849,17 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
 	   furture instances of the target */
 	local_fringe = src_idx;
 	gone_far_enough = FALSE;
+	beam_cut = FALSE;
+
+	/* the segment scores are only calculated if this pair uses 
+	   segments, so the exact segment information must be cleared
+	   for the pruning tests below */
+	if (! (c_rel->flags & REL_HAS_SEGS))
+	  g_res->seg_res->has_exact_at_src = g_res->seg_res->has_exact_at_tgt = FALSE;
 
 	while(! gone_far_enough) {
 	  
-	  if (reg_info->phase == NULL) {
+	  if (c_rel->phase == NO_PHASE) {
 	    /* For frameless feature pairs, we need to examine all frames, but 
 	       for the pruning to work effectively, the featured need to be examined 
 	       in order. Therefore, we have to re-create the original list
@@ -1104,57 +1904,65 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
 	    continue;
 	  }
 
-	  tgt = index_Array( g_seq->features, Feature *, tgt_idx );
 	    
 #ifdef TRACE
 	  if (TRACE > 1)
 	    fprintf( stderr, "  Target %d %s %d %d  ", tgt_idx,
-		     index_Array(gs->feat_dict, char *, tgt->feat_idx ), 
-		     tgt->real_pos.s, tgt->real_pos.e );
+		     index_Array(gs->feat_dict, char *, ftab->feat_idx[tgt_idx] ), 
+		     ftab->real_s[tgt_idx], ftab->real_e[tgt_idx] );
 #endif	  
-	  if (! tgt->invalid) {
+	  if (! ftab->invalid[tgt_idx]) {
 	      
-	    right_pos = tgt->adj_pos.e;
+	    right_pos = ftab->adj_e[tgt_idx];
 	    distance = right_pos - left_pos + 1;
 	    
 #ifdef TRACE
 	    if (TRACE > 1)
 	      fprintf( stderr, "dist=%d  ", distance );
 #endif	    
-	    if ((reg_info->max_dist == NULL) || (*(reg_info->max_dist)) >= distance) {
+	    if (c_rel->max_dist >= distance) {
 	      
-	      if ((reg_info->min_dist == NULL) || (*(reg_info->min_dist)) <= distance) {
+	      if (c_rel->min_dist <= distance) {
 
 		/* Finally, if this source does not result in a DNA kill, we can calc the score */
-		if (killer_target_dna == NULL || tgt->dna < 0 || ! killer_target_dna[(int)tgt->dna]) {
+		if (killer_target_dna == NULL || ftab->dna[tgt_idx] < 0 || ! in_DNA_Set( killer_target_dna, ftab->dna[tgt_idx] )) {
 		  double trans_score, len_pen, seg_score, backward_temp;
-		  Length_Function *lf = NULL;
+		  Length_Function *lf;
 		  trans_score = len_pen = 0.0;
 		  
-		  seg_score = calculate_segment_score( g_seq, src, tgt, gs, g_res->seg_res );
+		  if (c_rel->flags & REL_HAS_SEGS)
+		    seg_score = calculate_segment_score_for_relation( g_seq, c_rel, left_pos, right_pos, g_res->seg_res );
+		  else
+		    seg_score = 0.0;
 		  trans_score += seg_score;
 		  
-		  if (reg_info->len_fun != NULL) {
-		      lf = index_Array(gs->length_funcs, Length_Function *, *(reg_info->len_fun));
-		      len_pen = apply_Length_Function( lf, distance );
-		  }
+		  if ((lf = c_rel->len_fun) != NULL)
+		    len_pen = apply_Length_Function( lf, distance );
 		  trans_score -= len_pen;
 		  
-		  backward_temp = tgt->backward_score
+		  backward_temp = ftab->backward_score[tgt_idx]
 		    + trans_score
-		    + tgt->score;
-		  
-		  if (! touched_score || backward_temp > max_backward)
-		    max_backward = backward_temp;
+		    + ftab->score[tgt_idx];
 		  
-		  append_val_Array( all_scores, backward_temp);
+		  /* with a beam, only the best few targets in each frame
+		     are summed, once the scan of this target type is done,
+		     and the frame is left once the targets fall well short 
+		     of them */
+		  if (g_res->beam_width > 0) {
+		    if (add_dp_beam( g_res, frame, backward_temp, tgt_idx )) {
+		      index_count[frame] = -1;
+		      beam_cut = TRUE;
+		    }
+		  }
+		  else
+		    add_Log_Sum_Exp( &backward_sum, backward_temp );
 
 		  if (use_pruning) {
 		    if (! touched_score_local ) {
 
 		      if (danger_target_dna == NULL 
-			  || tgt->dna < 0  
-			  || ! danger_target_dna[(int)src->dna]) {
+			  || ftab->dna[tgt_idx] < 0  
+			  || ! in_DNA_Set( danger_target_dna, ftab->dna[tgt_idx] )) {
 
 			if (lf == NULL || (lf->becomes_monotonic && lf->monotonic_point <= distance)) {
 			  if (! g_res->seg_res->has_exact_at_tgt) {
@@ -1172,12 +1980,12 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
 		      /* compare this one to max_forward, to see if it is dominated */
 		      if (backward_temp + len_pen > max_backpluslen
 			  && (danger_target_dna == NULL 
-			      || tgt->dna < 0  
-			      || ! danger_target_dna[(int)tgt->dna])
+			      || ftab->dna[tgt_idx] < 0  
+			      || ! in_DNA_Set( danger_target_dna, ftab->dna[tgt_idx] ))
 			  && !g_res->seg_res->has_exact_at_tgt) 
 			max_backpluslen = backward_temp + len_pen;
 		      
-		      if ( max_backpluslen - (backward_temp + len_pen) < 25.0
+		      if ( max_backpluslen - (backward_temp + len_pen) < g_res->margin
 			   || (g_res->seg_res->has_exact_at_tgt 
 			       && g_res->seg_res->exact_extends_beyond_src) )
 			local_fringe = tgt_idx;
@@ -1232,42 +2040,37 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
 #endif
 	} /* while ! gone_far_enough */
 
-	if (use_pruning) {
+	if (g_res->beam_width > 0)
+	  drain_dp_beam( g_res, FALSE, &backward_sum, NULL );
+
+	/* a frame left early by the beam says nothing about the targets
+	   beyond it, so the fringe must not move past them */
+	if (use_pruning && ! beam_cut) {
 	  /* We conservatively only prune in the frame of the target if this
 	     feature pair has a phase constraint, or if there are potential
 	     killers (which also might have a phase constraint). Otherwise, 
 	     prune in all frames */
-	  if (reg_info->phase != NULL || reg_info->kill_feat_quals != NULL) {
-	    g_res->fringes[(int)src->feat_idx][tgt_type][MOD3(src->real_pos.s)] = local_fringe;
+	  if (c_rel->phase != NO_PHASE || (c_rel->flags & REL_HAS_KILLERS)) {
+	    g_res->fringes[(int)ftab->feat_idx[src_idx]][tgt_type][MOD3(ftab->real_s[src_idx])] = local_fringe;
 	  }
 	  else {
 	    for(k=0; k < 3; k++)
-	      g_res->fringes[(int)src->feat_idx][tgt_type][k] = local_fringe;
+	      g_res->fringes[(int)ftab->feat_idx[src_idx]][tgt_type][k] = local_fringe;
 	  }
 	}
 
-	if (danger_target_dna != NULL) {
-	  free_util( danger_target_dna );
-	  danger_target_dna = NULL;
-	}
-	if (killer_target_dna != NULL) {
-	  free_util( killer_target_dna );
-	  killer_target_dna = NULL;
-	}
+	danger_target_dna = NULL;
+	killer_target_dna = NULL;
       }      
     }
 
     /* update the position of the last forced feature. */
     
-    if (src->is_selected)
+    if (ftab->is_selected[src_idx])
       g_res->last_selected = src_idx;
     
     if (touched_score) {
-      for (tgt_idx=0; tgt_idx < all_scores->len; tgt_idx++) {
-	g_res->score += exp( index_Array(all_scores, double, tgt_idx) 
-				- max_backward );  
-      }
-      g_res->score = log( g_res->score ) + max_backward;
+      g_res->score = value_Log_Sum_Exp( &backward_sum );
       
 #ifdef TRACE
       fprintf(stderr, "  RESULT: b=%.8f\n", 
@@ -1275,7 +2078,7 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
 #endif      
     }
     else {
-      src->invalid = TRUE;
+      ftab->invalid[src_idx] = TRUE;
 
 #ifdef TRACE
       fprintf( stderr, "  *** Invalidating\n");
@@ -1292,15 +2095,59 @@ void scan_through_targets_dp( Gaze_Sequence *g_seq,
      calculation of Bbegin - however we need to do it for the sake
      of individual feature posterior probabilities */
   
-  if (src->invalid)
+  if (ftab->invalid[src_idx])
     g_res->score = NEG_INFINITY;
-
-  free_Array( all_scores, TRUE );
-   
 }      
 
 
 
+/*********************************************************************
+ FUNCTION: add_nbest_candidates
+ DESCRIPTION:
+   Offers the paths through the given source to the n-best list of
+   the given target
+ RETURNS:
+ ARGS: 
+ NOTES:
+   The score of each candidate is formed exactly as in the max-only
+   scan, and ties go to the candidate offered first, so that the 
+   best path to each feature is the one found by the usual traceback
+ *********************************************************************/
+static void add_nbest_candidates( Feature_Table *ftab,
+				  int src_idx,
+				  int tgt_idx,
+				  double trans_score ) {
+  int nbest = ftab->nbest;
+  int *count = &(ftab->nbest_count[tgt_idx]);
+  double *score = ftab->nbest_score + tgt_idx * nbest;
+  int *trace = ftab->nbest_trace + tgt_idx * nbest;
+  int *rank = ftab->nbest_rank + tgt_idx * nbest;
+  int r, p, q;
+
+  for (r=0; r < ftab->nbest_count[src_idx]; r++) {
+    double cand = (ftab->nbest_score[src_idx * nbest + r] + trans_score) + ftab->score[tgt_idx];
+
+    /* the source paths come best first, so none of the rest will do */
+    if (*count == nbest && cand <= score[nbest - 1])
+      break;
+
+    for (p = *count < nbest ? *count : nbest - 1; p > 0 && score[p-1] < cand; p--);
+    
+    for (q = (*count < nbest ? *count : nbest - 1); q > p; q--) {
+      score[q] = score[q-1];
+      trace[q] = trace[q-1];
+      rank[q] = rank[q-1];
+    }
+    score[p] = cand;
+    trace[p] = src_idx;
+    rank[p] = r;
+    if (*count < nbest)
+      (*count)++;
+  }
+}
+
+
+
 /*********************************************************************
  FUNCTION: scan_through_source_for_max_only
  DESCRIPTION:
@@ -1321,33 +2168,36 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
   Killer_Feature_Qualifier *kq;
 
   boolean touched_score, touched_score_local;
-  Feature_Info *tgt_info;
+  Compiled_Relation *c_rel;
   Feature_Relation *reg_info;
-  Feature *src, *tgt;
+  Feature_Table *ftab = g_seq->feat_table;
 
   boolean gone_far_enough = FALSE;
+  boolean beam_cut;
   double max_vit_plus_len = 0.0;
   double max_score = NEG_INFINITY;
-  int *killer_source_dna = NULL;
-  int *danger_source_dna = NULL;
+  unsigned int *killer_source_dna = NULL;
+  unsigned int *danger_source_dna = NULL;
 
   g_res->pth_score = 0.0;
   g_res->pth_trace = 0,0;
   g_res->score = 0.0;
+  g_res->num_scans++;
+
+  if (ftab->nbest > 0)
+    ftab->nbest_count[tgt_idx] = 0;
 
-  tgt = index_Array( g_seq->features, Feature *, tgt_idx );
-  tgt_info = index_Array( gs->feat_info, Feature_Info *, tgt->feat_idx );
-  right_pos = tgt->adj_pos.e;
+  right_pos = ftab->adj_e[tgt_idx];
 
 #ifdef TRACE 
   fprintf( stderr, "Target %d %s %d %d %.3f", tgt_idx,
-	   index_Array(gs->feat_dict, char *, tgt->feat_idx ), 
-	   tgt->real_pos.s, tgt->real_pos.e, tgt->score );
+	   index_Array(gs->feat_dict, char *, ftab->feat_idx[tgt_idx] ), 
+	   ftab->real_s[tgt_idx], ftab->real_e[tgt_idx], ftab->score[tgt_idx] );
   if (TRACE > 1)
     fprintf( stderr, "\n" );
 #endif
 
-  if (! tgt->invalid) {
+  if (! ftab->invalid[tgt_idx]) {
     touched_score = FALSE;
 
     /* set up the boundaries for the scan. We do not want to go past:
@@ -1360,8 +2210,10 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
     
     /* Look through the sources themselves */
     
-    for ( src_type = 0; src_type < tgt_info->sources->len; src_type++) {
-      if ((reg_info = index_Array(tgt_info->sources, Feature_Relation *, src_type)) != NULL) {
+    for ( src_type = 0; src_type < gs->feat_dict->len; src_type++) {
+      c_rel = relation_Gaze_Structure( gs, ftab->feat_idx[tgt_idx], src_type );
+
+      if ((reg_info = c_rel->rel) != NULL) {
 	Array **feats = g_res->feats[src_type];
 	
 	for(frame = 0; frame < 3; frame++) {
@@ -1370,7 +2222,7 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
 	  /* first, identify the killers local to this feature pair, and make
 	     sure that our search back through the sources does not go past a killer */
 	  	  
-	  if (reg_info->kill_feat_quals != NULL) {
+	  if (c_rel->flags & REL_HAS_KILLERS) {
 	    
 	    for(kill_idx=0; kill_idx < reg_info->kill_feat_quals->len; kill_idx++) {
 	      if ( (kq = index_Array( reg_info->kill_feat_quals,
@@ -1409,47 +2261,10 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
 		  }
 
 		  if (apt_list->len > 0) {
-		    /* first search back for the first occurrence that does not overlap with target */
-		    int this_kill_idx = apt_list->len - 1;
-		    int boundary_index = index_Array( apt_list, int, this_kill_idx );
-
-		    Feature *killer_feat = index_Array(g_seq->features, Feature *, boundary_index );
-
-		    while ( killer_feat != NULL && killer_feat->real_pos.e > tgt->adj_pos.e) {
-		      if (--this_kill_idx >= 0) {
-			boundary_index = index_Array( apt_list, int, this_kill_idx );
-			killer_feat = index_Array(g_seq->features, Feature *, boundary_index );
-		      }
-		      else
-			killer_feat = NULL;
-		    }
-		    /* now search back for sources beyond the killer of this type that overlap the killer */
-
-		    if (killer_feat != NULL) {
-		      int local_idx;
-		      
-		      for(local_idx = feats[frame]->len - 1; local_idx >=0; local_idx-- ) {
-			Feature *candidate;
-			int loc_f_idx = index_Array( feats[frame], int, local_idx );
-
-			if (loc_f_idx > boundary_index) 
-			  continue;
-			
-			candidate = index_Array( g_seq->features, 
-						 Feature *,
-						 loc_f_idx );
-			
-			if (candidate->adj_pos.s <= killer_feat->real_pos.s)
-			  break;
-			else 
-			  boundary_index = loc_f_idx;
-		      }
-		      
-		      if (boundary_index > last_idx_for_frame[frame]) {
-			last_idx_for_frame[frame] = boundary_index;
-		      }
+		    int boundary_index = find_killer_boundary( ftab, apt_list, feats[frame], ftab->adj_e[tgt_idx], TRUE );
 
-		    }
+		    if (boundary_index > last_idx_for_frame[frame]) 
+		      last_idx_for_frame[frame] = boundary_index;
 		  }
 		}
 	      }
@@ -1458,30 +2273,18 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
 
 	  /* finally, make sure that we do not proceed past the fringe for
 	     this feature pair */
-	  if (g_res->fringes[(int)tgt->feat_idx][src_type][MOD3(tgt->real_pos.s)] > last_idx_for_frame[frame])
-	    last_idx_for_frame[frame] = g_res->fringes[(int)tgt->feat_idx][src_type][MOD3(tgt->real_pos.s)];
+	  if (g_res->fringes[(int)ftab->feat_idx[tgt_idx]][src_type][MOD3(ftab->real_s[tgt_idx])] > last_idx_for_frame[frame])
+	    last_idx_for_frame[frame] = g_res->fringes[(int)ftab->feat_idx[tgt_idx]][src_type][MOD3(ftab->real_s[tgt_idx])];
 	}
 	
 	/* Before actually scanning through the features themselves, we need to check
 	   if there are potential dna killers. If so, set flags for the source
 	   dna entries that will cause problems */
 	
-	if (reg_info->kill_dna_quals != NULL) {
-	  danger_source_dna = (int *) malloc0_util( gs->motif_dict->len * sizeof(int) );
-	  
-	  for(k=0; k < reg_info->kill_dna_quals->len; k++) {
-	    Killer_DNA_Qualifier *kdq = index_Array( reg_info->kill_dna_quals, 
-						       Killer_DNA_Qualifier *,
-						       k );
-	    
-	    danger_source_dna[(int)kdq->src_dna] = 1; 
-	    
-	    if (tgt->dna >= 0 && tgt->dna == kdq->tgt_dna) {
-	      if (killer_source_dna == NULL) 
-		killer_source_dna = (int *) malloc0_util( gs->motif_dict->len * sizeof(int) );
-	      killer_source_dna[(int)kdq->src_dna] = 1;
-	    }
-	  }
+	if (c_rel->flags & REL_HAS_DNA_KILLERS) {
+	  danger_source_dna = c_rel->danger_src_dna;
+	  if (ftab->dna[tgt_idx] >= 0)
+	    killer_source_dna = c_rel->killer_src_dna + ftab->dna[tgt_idx] * c_rel->dna_set_words;
 	}
 	
 	/* at this point, we have the list of features that need to be processed (feats),
@@ -1498,7 +2301,7 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
 	for(k=0; k < 3; k++) 
 	  index_count[k] = feats[k]->len - 1; 
 	
-	frame = reg_info->phase != NULL ? MOD3(right_pos - *(reg_info->phase) + 1) : 0;
+	frame = c_rel->phase != NO_PHASE ? MOD3(right_pos - c_rel->phase + 1) : 0;
 
 	max_vit_plus_len = NEG_INFINITY;
 	touched_score_local = FALSE;
@@ -1508,10 +2311,21 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
 	   furture instances of the target */
 	local_fringe = tgt_idx;
 	gone_far_enough = FALSE;
+	beam_cut = FALSE;
+
+	/* the segment scores are only calculated if this pair uses 
+	   segments, so the exact segment information must be cleared
+	   for the pruning tests below */
+	if (! (c_rel->flags & REL_HAS_SEGS))
+	  g_res->seg_res->has_exact_at_src = g_res->seg_res->has_exact_at_tgt = FALSE;
+	else
+	  /* the sources come right to left, so the segments can be
+	     carried from one to the next */
+	  start_scan_Seg_Results( g_res->seg_res, c_rel, right_pos );
 
 	while( ! gone_far_enough ) {
 
-	  if (reg_info->phase == NULL) {
+	  if (c_rel->phase == NO_PHASE) {
 	    /* For frameless feature pairs, we need to examine all frames, but 
 	       for the pruning to work effectively, the featured need to be examined 
 	       in order. Therefore, we have to re-create the original list
@@ -1553,18 +2367,17 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
 	    continue;
 	  }
 	  
-	  src = index_Array( g_seq->features, Feature *, src_idx );
 	  
 #ifdef TRACE
 	  if (TRACE > 1)
 	    fprintf( stderr, "     Source %d %s %d %d ", src_idx,
 		     index_Array(gs->feat_dict, char *, src_type ),
-		     src->real_pos.s, src->real_pos.e );
+		     ftab->real_s[src_idx], ftab->real_e[src_idx] );
 #endif
 	  
-	  if (! src->invalid) {
+	  if (! ftab->invalid[src_idx]) {
 	    
-	    left_pos = src->adj_pos.s;
+	    left_pos = ftab->adj_s[src_idx];
 	    distance = right_pos - left_pos + 1;
 	    
 #ifdef TRACE
@@ -1572,38 +2385,50 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
 	      fprintf( stderr, "dist=%d  ", distance );
 #endif	    
 
-	    if ((reg_info->max_dist == NULL) || (*(reg_info->max_dist)) >= distance) {
+	    if (c_rel->max_dist >= distance) {
 	      
-	      if ((reg_info->min_dist == NULL) || (*(reg_info->min_dist)) <= distance) {
+	      if (c_rel->min_dist <= distance) {
 		/* Finally, if this source does not result in a DNA kill, we can calc the score */
-		if (killer_source_dna == NULL || src->dna < 0 || ! killer_source_dna[(int)src->dna]) {
+		if (killer_source_dna == NULL || ftab->dna[src_idx] < 0 || ! in_DNA_Set( killer_source_dna, ftab->dna[src_idx] )) {
 		  double trans_score, len_pen, seg_score, viterbi_temp;
-		  Length_Function *lf = NULL;
+		  Length_Function *lf;
 		  trans_score = len_pen = viterbi_temp = 0.0;
 
-		  seg_score = calculate_segment_score( g_seq, src, tgt, gs, g_res->seg_res );
+		  if (c_rel->flags & REL_HAS_SEGS)
+		    seg_score = calculate_segment_score_for_relation( g_seq, c_rel, left_pos, right_pos, g_res->seg_res );
+		  else
+		    seg_score = 0.0;
 		  trans_score += seg_score;
 		  
-		  if (reg_info->len_fun != NULL) {
-		    lf = index_Array(gs->length_funcs, Length_Function *, *(reg_info->len_fun));
+		  if ((lf = c_rel->len_fun) != NULL)
 		    len_pen = apply_Length_Function( lf, distance );
-		  }
 		  trans_score -= len_pen;
 		  
-		  viterbi_temp = src->path_score +
-		    + trans_score
-		    + tgt->score;
+		  if (g_res->mea)
+		    /* the posteriors of the region and of the target */
+		    viterbi_temp = ftab->path_score[src_idx]
+		      + exp( ftab->forward_score[src_idx] + trans_score + ftab->score[tgt_idx] +
+			     ftab->backward_score[tgt_idx] - g_res->mea_total )
+		      + exp( ftab->forward_score[tgt_idx] + ftab->backward_score[tgt_idx] - 
+			     g_res->mea_total );
+		  else
+		    viterbi_temp = ftab->path_score[src_idx] +
+		      + trans_score
+		      + ftab->score[tgt_idx];
 		  
 		  if (! touched_score || (viterbi_temp > max_score) ) {
 		    max_score = viterbi_temp;
 		    max_index = src_idx;
 		  }
+
+		  if (ftab->nbest > 0)
+		    add_nbest_candidates( ftab, src_idx, tgt_idx, trans_score );
 		  		  
 		  if (! touched_score_local ) {
 			
 		    if (danger_source_dna == NULL 
-			|| src->dna < 0  
-			|| ! danger_source_dna[(int)src->dna]) {
+			|| ftab->dna[src_idx] < 0  
+			|| ! in_DNA_Set( danger_source_dna, ftab->dna[src_idx] )) {
 
 		      if (lf == NULL || (lf->becomes_monotonic && lf->monotonic_point <= distance)) { 
 
@@ -1622,8 +2447,8 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
 		    if (viterbi_temp + len_pen > max_vit_plus_len) {
  
 		      if ( (danger_source_dna == NULL 
-			    || src->dna < 0  
-			    || ! danger_source_dna[(int)src->dna])
+			    || ftab->dna[src_idx] < 0  
+			    || ! in_DNA_Set( danger_source_dna, ftab->dna[src_idx] ))
 			   && ! g_res->seg_res->has_exact_at_src )
 			max_vit_plus_len = viterbi_temp + len_pen;		      		      
 		      
@@ -1634,6 +2459,14 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
 		      local_fringe = src_idx;
 		  }		  
   
+		  /* with a beam, the frame is left once the sources fall
+		     well short of the best few */
+		  if (g_res->beam_width > 0 && 
+		      add_dp_beam( g_res, frame, viterbi_temp, src_idx )) {
+		    index_count[frame] = -1;
+		    beam_cut = TRUE;
+		  }
+
 		  touched_score = TRUE;
 		  
 #ifdef TRACE
@@ -1678,34 +2511,32 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
 #endif
 	} /* while !gone_far_enough */
       
+	/* the beams only bound the scan here, as the max needs no sum */
+	g_res->beam_len[0] = g_res->beam_len[1] = g_res->beam_len[2] = 0;
+
 	/* We conservatively only prune in the frame of the target if this
 	   feature pair has a phase constraint, or if there are potential
 	   killers (which also might have a phase constraint). Otherwise, 
-	   prune in all frames */
-	if (use_pruning) {
-	  if (reg_info->phase != NULL || reg_info->kill_feat_quals != NULL) {
-	    g_res->fringes[(int)tgt->feat_idx][src_type][MOD3(tgt->real_pos.s)] = local_fringe;
+	   prune in all frames. A frame left early by the beam says nothing
+	   about the sources beyond it, so then the fringe must not move */
+	if (use_pruning && ! beam_cut) {
+	  if (c_rel->phase != NO_PHASE || (c_rel->flags & REL_HAS_KILLERS)) {
+	    g_res->fringes[(int)ftab->feat_idx[tgt_idx]][src_type][MOD3(ftab->real_s[tgt_idx])] = local_fringe;
 	  }
 	  else {
 	    for(k=0; k < 3; k++)
-	      g_res->fringes[(int)tgt->feat_idx][src_type][k] = local_fringe;
+	      g_res->fringes[(int)ftab->feat_idx[tgt_idx]][src_type][k] = local_fringe;
 	  }
 	}
       
-	if (danger_source_dna != NULL) {
-	  free_util( danger_source_dna );
-	  danger_source_dna = NULL;
-	}
-	if (killer_source_dna != NULL) {
-	  free_util( killer_source_dna );
-	  killer_source_dna = NULL;
-	}
+	danger_source_dna = NULL;
+	killer_source_dna = NULL;
       }  
     }
 
     /* update the position of the last forced feature. */
     
-    if (tgt->is_selected)
+    if (ftab->is_selected[tgt_idx])
       g_res->last_selected = tgt_idx;
     
     if (touched_score) {
@@ -1721,7 +2552,7 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
 #endif
     }
     else {
-      tgt->invalid = TRUE;
+      ftab->invalid[tgt_idx] = TRUE;
 
 #ifdef TRACE
       fprintf( stderr, "  *** Invalidating\n");
@@ -1738,7 +2569,7 @@ void scan_through_sources_for_max_only( Gaze_Sequence *g_seq,
      calculation of Fend - however we need to do it for the sake
      of individual feature posterior probabilities */
   
-  if (tgt->invalid)
+  if (ftab->invalid[tgt_idx])
     g_res->score = NEG_INFINITY;
 
 }
@@ -1789,3 +2620,214 @@ void trace_back_general ( Gaze_Sequence *g_seq ) {
 
   g_seq->path = feat_path;
 }
+
+
+
+/*********************************************************************
+ FUNCTION: trace_back_nbest
+ DESCRIPTION:
+   This function traces back the path of the given rank (0 being 
+   the best) from the n-best lists filled in by the forward pass
+ RETURNS:
+ ARGS: 
+ NOTES:
+   g_seq->path is left NULL if there are not that many paths
+ *********************************************************************/
+void trace_back_nbest ( Gaze_Sequence *g_seq, int path_rank ) {
+  
+  int i, next_pos, pos = g_seq->features->len - 1;
+  Feature_Table *ftab = g_seq->feat_table;
+  Array *stack, *feat_path;
+  Feature *temp;
+
+  g_seq->path = NULL;
+  if (ftab->nbest == 0 || path_rank >= ftab->nbest_count[pos])
+    return;
+
+  stack = new_Array( sizeof(Feature *), TRUE);
+  feat_path = new_Array( sizeof(Feature *), TRUE);
+
+  temp = index_Array( g_seq->features, Feature *, pos );
+  append_val_Array( stack, temp );
+
+  while (pos > 0) {
+    next_pos = ftab->nbest_trace[pos * ftab->nbest + path_rank];
+    path_rank = ftab->nbest_rank[pos * ftab->nbest + path_rank];
+    pos = next_pos;
+
+    temp = index_Array( g_seq->features, Feature *, pos );
+    append_val_Array( stack, temp );
+  }
+
+  for (i=stack->len-1; i>=0; i--) {
+    temp =  index_Array( stack, Feature *, i );
+    append_val_Array( feat_path, temp);
+  }
+
+  free_Array( stack, TRUE );
+
+  g_seq->path = feat_path;
+}
+
+
+
+/* The sampled paths are drawn by a pool of threads, each taking
+   the next sample to be drawn in turn */
+
+typedef struct {
+  Gaze_Sequence *g_seq;
+  Array **paths;
+  int num_samples;
+  int next_sample;
+  unsigned int seed;
+  pthread_mutex_t lock;
+} Gaze_Sample_pool;
+
+
+/*********************************************************************
+ FUNCTION: trace_back_sample
+ DESCRIPTION:
+   Draws a path from the posterior distribution, by choosing each
+   feature's predecessor (from END back to BEGIN) in proportion to 
+   its share of the feature's forward score
+ RETURNS: the path, as an Array of Feature *, or NULL if the path 
+   reaches a feature with no candidates of non-zero weight (which
+   a feature invalidated by pruning or killed by the structure can
+   be)
+ ARGS: 
+ NOTES:
+   Needs the candidates kept by a forward pass with num_samples set
+ *********************************************************************/
+static Array *trace_back_sample( Gaze_Sequence *g_seq,
+				 unsigned int *rand_state ) {
+  
+  int i, c, chosen, pos = g_seq->features->len - 1;
+  Feature_Table *ftab = g_seq->feat_table;
+  Array *stack = new_Array( sizeof(Feature *), TRUE);
+  Array *feat_path = new_Array( sizeof(Feature *), TRUE);
+  Feature *temp;
+
+  temp = index_Array( g_seq->features, Feature *, pos );
+  append_val_Array( stack, temp );
+
+  while (pos > 0) {
+    double random_number = (double) rand_r( rand_state ) / (double) RAND_MAX;
+    double sum = 0.0, weight;
+    int first = ftab->samp_start[pos], last = ftab->samp_start[pos + 1] - 1;
+
+    /* the last candidate of non-zero weight is taken if rounding 
+       leaves the sum short */
+    for (chosen = -1, c = first; c <= last; c++) {
+      if ((weight = exp( ftab->samp_score[c] - ftab->forward_score[pos] )) > 0.0) {
+	chosen = c;
+	sum += weight;
+	if (sum >= random_number)
+	  break;
+      }
+    }
+
+    /* sources always precede their targets, so the walk ends at BEGIN */
+    if (chosen < 0 || ftab->samp_src[chosen] >= pos) {
+      free_Array( stack, TRUE );
+      free_Array( feat_path, TRUE );
+      return NULL;
+    }
+    pos = ftab->samp_src[chosen];
+
+    temp = index_Array( g_seq->features, Feature *, pos );
+    append_val_Array( stack, temp );
+  }
+
+  for (i=stack->len-1; i>=0; i--) {
+    temp =  index_Array( stack, Feature *, i );
+    append_val_Array( feat_path, temp);
+  }
+
+  free_Array( stack, TRUE );
+
+  return feat_path;
+}
+
+
+/*********************************************************************
+ FUNCTION: sample_worker
+ DESCRIPTION:
+   Thread main-loop for drawing sampled paths
+ RETURNS:
+ ARGS: 
+ NOTES:
+   Each sample has its own RNG stream, seeded from the pool seed 
+   and the number of the sample, so that the samples drawn do not 
+   depend on the number of threads
+ *********************************************************************/
+static void *sample_worker( void *arg ) {
+  Gaze_Sample_pool *pool = (Gaze_Sample_pool *) arg;
+  unsigned int rand_state;
+  int samp_idx;
+
+  for(;;) {
+    pthread_mutex_lock( &(pool->lock) );
+    samp_idx = pool->next_sample++;
+    pthread_mutex_unlock( &(pool->lock) );
+
+    if (samp_idx >= pool->num_samples)
+      break;
+
+    rand_state = pool->seed ^ ((unsigned int) (samp_idx + 1) * 2654435761U);
+    pool->paths[samp_idx] = trace_back_sample( pool->g_seq, &rand_state );
+  }
+
+  return NULL;
+}
+
+
+/*********************************************************************
+ FUNCTION: sample_trace_backs
+ DESCRIPTION:
+   Draws the given number of paths from the posterior distribution
+   held by the sequence after its forward pass, on the given number 
+   of threads. The calling thread acts as one of the workers
+ RETURNS: an array of the paths (Arrays of Feature *, or NULL for 
+   those that could not be drawn), or NULL if the forward pass did 
+   not keep what is needed
+ ARGS: 
+ NOTES:
+   The caller is responsible for freeing the paths and the array
+ *********************************************************************/
+Array **sample_trace_backs( Gaze_Sequence *g_seq,
+			    int num_samples,
+			    unsigned int seed,
+			    int num_threads ) {
+  Gaze_Sample_pool pool;
+  pthread_t *threads;
+  int i;
+
+  if (g_seq->feat_table->samp_start == NULL ||
+      g_seq->feat_table->invalid[g_seq->features->len - 1])
+    return NULL;
+
+  pool.g_seq = g_seq;
+  pool.num_samples = num_samples;
+  pool.next_sample = 0;
+  pool.seed = seed;
+  pool.paths = (Array **) malloc_util( num_samples * sizeof(Array *) );
+  pthread_mutex_init( &(pool.lock), NULL );
+
+  if (num_threads > num_samples)
+    num_threads = num_samples;
+
+  threads = (pthread_t *) malloc_util( num_threads * sizeof( pthread_t ) );
+  for (i=1; i < num_threads; i++)
+    if (pthread_create( &(threads[i]), NULL, &sample_worker, &pool ))
+      fatal_util( "Could not create thread for sampling" );
+
+  sample_worker( &pool );
+
+  for (i=1; i < num_threads; i++)
+    pthread_join( threads[i], NULL );
+
+  free_util( threads );
+  pthread_mutex_destroy( &(pool.lock) );
+
+  return pool.paths;
+}
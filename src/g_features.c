@@ -165,6 +165,292 @@ void write_Feature( FILE *fh, Feature *ft, Array *ft_dict, Array *motif_dict) {
 
 
 
+/*********** Feature_Table **********************/
+
+/*********************************************************************
+ FUNCTION: alloc_nbest_Feature_Table
+ DESCRIPTION:
+   Makes room in the given table for the n best partial paths to 
+   each feature
+ RETURNS:
+ ARGS: 
+ NOTES:
+   Nothing is done if the room is there already
+ *********************************************************************/
+void alloc_nbest_Feature_Table(Feature_Table *tab, int nbest) {
+
+  if (tab->nbest != nbest) {
+    if (tab->nbest > 0) {
+      free_util( tab->nbest_count );
+      free_util( tab->nbest_score );
+      free_util( tab->nbest_trace );
+      free_util( tab->nbest_rank );
+    }
+    tab->nbest = nbest;
+    tab->nbest_count = (int *) malloc0_util( tab->len * sizeof(int) );
+    tab->nbest_score = (double *) malloc_util( tab->len * nbest * sizeof(double) );
+    tab->nbest_trace = (int *) malloc_util( tab->len * nbest * sizeof(int) );
+    tab->nbest_rank = (int *) malloc_util( tab->len * nbest * sizeof(int) );
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: alloc_samples_Feature_Table
+ DESCRIPTION:
+   Makes room in the given table for the candidate predecessors
+   of the features, as needed for sampling paths, and clears it
+ RETURNS:
+ ARGS: 
+ NOTES:
+   The first feature has no predecessors
+ *********************************************************************/
+void alloc_samples_Feature_Table(Feature_Table *tab) {
+
+  if (tab->samp_start == NULL) {
+    tab->samp_start = (int *) malloc_util( (tab->len + 1) * sizeof(int) );
+    tab->samp_alloc = tab->len;
+    tab->samp_src = (int *) malloc_util( tab->samp_alloc * sizeof(int) );
+    tab->samp_score = (double *) malloc_util( tab->samp_alloc * sizeof(double) );
+  }
+  tab->samp_start[0] = tab->samp_start[1] = 0;
+}
+
+
+/*********************************************************************
+ FUNCTION: append_samples_Feature_Table
+ DESCRIPTION:
+   Records the given candidate predecessors (indices and forward 
+   scores) of the given feature
+ RETURNS:
+ ARGS: 
+ NOTES:
+   The features must be given in order, since the candidates of 
+   each are stored straight after those of the one before
+ *********************************************************************/
+void append_samples_Feature_Table(Feature_Table *tab,
+				  int ft_idx,
+				  double *scores,
+				  int *indices,
+				  int num ) {
+  int start = tab->samp_start[ft_idx];
+
+  if (start + num > tab->samp_alloc) {
+    while (start + num > tab->samp_alloc)
+      tab->samp_alloc *= 2;
+    tab->samp_src = (int *) realloc_util( tab->samp_src, tab->samp_alloc * sizeof(int) );
+    tab->samp_score = (double *) realloc_util( tab->samp_score, tab->samp_alloc * sizeof(double) );
+  }
+
+  memcpy( tab->samp_src + start, indices, num * sizeof(int) );
+  memcpy( tab->samp_score + start, scores, num * sizeof(double) );
+  tab->samp_start[ft_idx + 1] = start + num;
+}
+
+
+/*********************************************************************
+ FUNCTION: clone_Feature_Table
+ DESCRIPTION:
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+Feature_Table *clone_Feature_Table(Feature_Table *source) {
+  Feature_Table *temp = (Feature_Table *) malloc_util( sizeof(Feature_Table) );
+  int len = source->len;
+
+  temp->len = len;
+
+  temp->real_s = (int *) malloc_util( len * sizeof(int) );
+  temp->real_e = (int *) malloc_util( len * sizeof(int) );
+  temp->adj_s = (int *) malloc_util( len * sizeof(int) );
+  temp->adj_e = (int *) malloc_util( len * sizeof(int) );
+  temp->feat_idx = (int *) malloc_util( len * sizeof(int) );
+  temp->dna = (int *) malloc_util( len * sizeof(int) );
+  temp->is_selected = (boolean *) malloc_util( len * sizeof(boolean) );
+  temp->invalid = (boolean *) malloc_util( len * sizeof(boolean) );
+  temp->trace_pointer = (int *) malloc_util( len * sizeof(int) );
+  temp->score = (double *) malloc_util( len * sizeof(double) );
+  temp->path_score = (double *) malloc_util( len * sizeof(double) );
+  temp->forward_score = (double *) malloc_util( len * sizeof(double) );
+  temp->backward_score = (double *) malloc_util( len * sizeof(double) );
+
+  memcpy( temp->real_s, source->real_s, len * sizeof(int) );
+  memcpy( temp->real_e, source->real_e, len * sizeof(int) );
+  memcpy( temp->adj_s, source->adj_s, len * sizeof(int) );
+  memcpy( temp->adj_e, source->adj_e, len * sizeof(int) );
+  memcpy( temp->feat_idx, source->feat_idx, len * sizeof(int) );
+  memcpy( temp->dna, source->dna, len * sizeof(int) );
+  memcpy( temp->is_selected, source->is_selected, len * sizeof(boolean) );
+  memcpy( temp->invalid, source->invalid, len * sizeof(boolean) );
+  memcpy( temp->trace_pointer, source->trace_pointer, len * sizeof(int) );
+  memcpy( temp->score, source->score, len * sizeof(double) );
+  memcpy( temp->path_score, source->path_score, len * sizeof(double) );
+  memcpy( temp->forward_score, source->forward_score, len * sizeof(double) );
+  memcpy( temp->backward_score, source->backward_score, len * sizeof(double) );
+
+  temp->nbest = 0;
+  if (source->nbest > 0) {
+    alloc_nbest_Feature_Table( temp, source->nbest );
+    memcpy( temp->nbest_count, source->nbest_count, len * sizeof(int) );
+    memcpy( temp->nbest_score, source->nbest_score, len * source->nbest * sizeof(double) );
+    memcpy( temp->nbest_trace, source->nbest_trace, len * source->nbest * sizeof(int) );
+    memcpy( temp->nbest_rank, source->nbest_rank, len * source->nbest * sizeof(int) );
+  }
+
+  /* the sampling candidates are only needed by the table of the 
+     sequence itself */
+  temp->samp_start = temp->samp_src = NULL;
+  temp->samp_score = NULL;
+  temp->samp_alloc = 0;
+
+  return temp;
+}
+
+
+/*********************************************************************
+ FUNCTION: free_Feature_Table
+ DESCRIPTION:
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+void free_Feature_Table(Feature_Table *tab) {
+  if (tab != NULL) {
+    free_util( tab->real_s );
+    free_util( tab->real_e );
+    free_util( tab->adj_s );
+    free_util( tab->adj_e );
+    free_util( tab->feat_idx );
+    free_util( tab->dna );
+    free_util( tab->is_selected );
+    free_util( tab->invalid );
+    free_util( tab->trace_pointer );
+    free_util( tab->score );
+    free_util( tab->path_score );
+    free_util( tab->forward_score );
+    free_util( tab->backward_score );
+    if (tab->nbest > 0) {
+      free_util( tab->nbest_count );
+      free_util( tab->nbest_score );
+      free_util( tab->nbest_trace );
+      free_util( tab->nbest_rank );
+    }
+    if (tab->samp_start != NULL) {
+      free_util( tab->samp_start );
+      free_util( tab->samp_src );
+      free_util( tab->samp_score );
+    }
+    free_util( tab );
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: new_Feature_Table
+ DESCRIPTION:
+   Builds the column-wise copy of the given list of features
+ RETURNS:
+ ARGS: 
+ NOTES:
+   The features must be in their final order; the table is
+   indexed by position in the list
+ *********************************************************************/
+Feature_Table *new_Feature_Table(Array *features) {
+  Feature_Table *temp = (Feature_Table *) malloc_util( sizeof(Feature_Table) );
+  int i, len = features->len;
+
+  temp->len = len;
+
+  temp->real_s = (int *) malloc_util( len * sizeof(int) );
+  temp->real_e = (int *) malloc_util( len * sizeof(int) );
+  temp->adj_s = (int *) malloc_util( len * sizeof(int) );
+  temp->adj_e = (int *) malloc_util( len * sizeof(int) );
+  temp->feat_idx = (int *) malloc_util( len * sizeof(int) );
+  temp->dna = (int *) malloc_util( len * sizeof(int) );
+  temp->is_selected = (boolean *) malloc_util( len * sizeof(boolean) );
+  temp->invalid = (boolean *) malloc_util( len * sizeof(boolean) );
+  temp->trace_pointer = (int *) malloc_util( len * sizeof(int) );
+  temp->score = (double *) malloc_util( len * sizeof(double) );
+  temp->path_score = (double *) malloc_util( len * sizeof(double) );
+  temp->forward_score = (double *) malloc_util( len * sizeof(double) );
+  temp->backward_score = (double *) malloc_util( len * sizeof(double) );
+
+  for (i=0; i < len; i++) {
+    Feature *ft = index_Array( features, Feature *, i );
+
+    temp->real_s[i] = ft->real_pos.s;
+    temp->real_e[i] = ft->real_pos.e;
+    temp->adj_s[i] = ft->adj_pos.s;
+    temp->adj_e[i] = ft->adj_pos.e;
+    temp->feat_idx[i] = ft->feat_idx;
+    temp->dna[i] = ft->dna;
+    temp->is_selected[i] = ft->is_selected;
+    temp->score[i] = ft->score;
+  }
+
+  temp->nbest = 0;
+  temp->nbest_count = temp->nbest_trace = temp->nbest_rank = NULL;
+  temp->nbest_score = NULL;
+  temp->samp_start = temp->samp_src = NULL;
+  temp->samp_score = NULL;
+  temp->samp_alloc = 0;
+
+  load_Feature_Table( temp, features );
+
+  return temp;
+}
+
+
+/*********************************************************************
+ FUNCTION: load_Feature_Table
+ DESCRIPTION:
+   Refreshes the columns that the dp changes (validity, scores
+   and trace-back) from the given list of features
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+void load_Feature_Table(Feature_Table *tab, Array *features) {
+  int i;
+
+  for (i=0; i < tab->len; i++) {
+    Feature *ft = index_Array( features, Feature *, i );
+
+    tab->invalid[i] = ft->invalid;
+    tab->trace_pointer[i] = ft->trace_pointer;
+    tab->path_score[i] = ft->path_score;
+    tab->forward_score[i] = ft->forward_score;
+    tab->backward_score[i] = ft->backward_score;
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: store_Feature_Table
+ DESCRIPTION:
+   Copies the columns that the dp changes back to the given list 
+   of features
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+void store_Feature_Table(Feature_Table *tab, Array *features) {
+  int i;
+
+  for (i=0; i < tab->len; i++) {
+    Feature *ft = index_Array( features, Feature *, i );
+
+    ft->invalid = tab->invalid[i];
+    ft->trace_pointer = tab->trace_pointer[i];
+    ft->path_score = tab->path_score[i];
+    ft->forward_score = tab->forward_score[i];
+    ft->backward_score = tab->backward_score[i];
+  }
+}
+
+
+
 /*********** Segments ***************************/
 
 /*********************************************************************
@@ -572,6 +858,169 @@ GFF_to_Gaze_entities *new_GFF_to_Gaze_entities(void) {
 
 
 
+
+/*********************************************************************
+ FUNCTION: same_field_GFF_Dispatch
+ DESCRIPTION:
+ RETURNS:
+   TRUE if the given fields are both the wildcard, or are equal strings
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static boolean same_field_GFF_Dispatch( char *a, char *b ) {
+  if (a == NULL || b == NULL)
+    return a == b;
+  return strcmp( a, b ) == 0;
+}
+
+
+/*********************************************************************
+ FUNCTION: find_GFF_Dispatch_Bucket
+ DESCRIPTION:
+   Finds the slot for the given (source, feature) pair in the table,
+   by linear probing
+ RETURNS:
+   The index of the bucket for the pair, or of the empty bucket 
+   where it would go
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static int find_GFF_Dispatch_Bucket( GFF_Dispatch *disp,
+				     char *source,
+				     char *feature ) {
+  unsigned int h = (source == NULL) ? 0x9e3779b9U : hash_string_util( source, '\0' );
+  int slot;
+
+  h = h * 31U + ((feature == NULL) ? 0x85ebca6bU : hash_string_util( feature, '\0' ));
+
+  for (slot = h & (disp->size - 1); 
+       disp->table[slot].rules != NULL; 
+       slot = (slot + 1) & (disp->size - 1)) {
+    if (same_field_GFF_Dispatch( disp->table[slot].gff_source, source ) &&
+	same_field_GFF_Dispatch( disp->table[slot].gff_feature, feature ))
+      break;
+  }
+
+  return slot;
+}
+
+
+/*********************************************************************
+ FUNCTION: free_GFF_Dispatch
+ DESCRIPTION:
+ RETURNS:
+ ARGS: 
+ NOTES:
+   The rules themselves belong to the caller
+ *********************************************************************/
+void free_GFF_Dispatch( GFF_Dispatch *disp ) {
+  int i;
+
+  if (disp != NULL) {
+    for (i=0; i < disp->size; i++) {
+      if (disp->table[i].rules != NULL)
+	free_Array( disp->table[i].rules, TRUE );
+    }
+    free_util( disp->table );
+    free_util( disp );
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: new_GFF_Dispatch
+ DESCRIPTION:
+   Compiles the given GFF_to_Gaze_entities rules into a table 
+   keyed on (source, feature)
+ RETURNS:
+ ARGS: 
+ NOTES:
+   The bucket keys point into the rules, so the rules must outlive
+   the table
+ *********************************************************************/
+GFF_Dispatch *new_GFF_Dispatch( Array *gff2fts ) {
+  GFF_Dispatch *disp;
+  int i, slot;
+
+  disp = (GFF_Dispatch *) malloc_util( sizeof(GFF_Dispatch) );
+  disp->gff2fts = gff2fts;
+
+  /* at most half full, so that the probes stay short */
+  for (disp->size = 8; disp->size < 2 * gff2fts->len; disp->size *= 2);
+  disp->table = (GFF_Dispatch_Bucket *) 
+    malloc0_util( disp->size * sizeof(GFF_Dispatch_Bucket) );
+
+  for (i=0; i < gff2fts->len; i++) {
+    GFF_to_Gaze_entities *con = index_Array( gff2fts, GFF_to_Gaze_entities *, i );
+
+    slot = find_GFF_Dispatch_Bucket( disp, con->gff_source, con->gff_feature );
+    if (disp->table[slot].rules == NULL) {
+      disp->table[slot].gff_source = con->gff_source;
+      disp->table[slot].gff_feature = con->gff_feature;
+      disp->table[slot].rules = new_Array( sizeof(int), TRUE );
+    }
+    append_val_Array( disp->table[slot].rules, i );
+  }
+
+  return disp;
+}
+
+
+/*********************************************************************
+ FUNCTION: match_GFF_Dispatch
+ DESCRIPTION:
+   Finds the rules that apply to the given GFF line, with the 
+   same meaning as testing each rule in turn: a NULL field in a 
+   rule matches anything
+ RETURNS:
+   The number of matching rules, whose indices are placed in 
+   ascending order in the given array (which must have room for 
+   all of the rules)
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+int match_GFF_Dispatch( GFF_Dispatch *disp, GFF_line *gff_line, int *matches ) {
+  Array *lists[4];
+  int pos[4];
+  int num_lists = 0, num_matches = 0;
+  int i, slot;
+
+  for (i=0; i < 4; i++) {
+    slot = find_GFF_Dispatch_Bucket( disp, 
+				     (i & 1) ? NULL : gff_line->source,
+				     (i & 2) ? NULL : gff_line->type );
+    if (disp->table[slot].rules != NULL) {
+      pos[num_lists] = 0;
+      lists[num_lists++] = disp->table[slot].rules;
+    }
+  }
+
+  /* the buckets are disjoint, so merging them restores the rule order */
+  for (;;) {
+    int best = -1;
+    GFF_to_Gaze_entities *con;
+
+    for (i=0; i < num_lists; i++) {
+      if (pos[i] < lists[i]->len &&
+	  (best < 0 || 
+	   index_Array( lists[i], int, pos[i] ) < index_Array( lists[best], int, pos[best] )))
+	best = i;
+    }
+    if (best < 0)
+      break;
+
+    slot = index_Array( lists[best], int, pos[best]++ );
+    con = index_Array( disp->gff2fts, GFF_to_Gaze_entities *, slot );
+
+    if (((con->gff_strand == NULL) || strcmp(con->gff_strand, gff_line->strand) == 0) &&
+	((con->gff_frame == NULL) || strcmp(con->gff_frame, gff_line->frame) == 0))
+      matches[num_matches++] = slot;
+  }
+
+  return num_matches;
+}
+
+
 /**************** Sorting features and segments **********************/
 
 /*********************************************************************
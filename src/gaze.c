@@ -16,6 +16,8 @@
  **********************************************************************/
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "options.h"
 #include "info.h"
@@ -28,6 +30,7 @@
 static Gaze_Structure *gazeStructure;
 static Gaze_Output *gazeOutput;
 static Gaze_Sequence_list *allGazeSequences;
+static GFF_Router *gffRouter = NULL;   /* when the GFF has been read up-front */
 
 
 /*********************************************************************/
@@ -58,9 +61,40 @@ Control options:\n\
                           (ignored if neither -regions nor -feature is specified)\n\
  -sample_gene           use posterior sampling to obtain gene structure (default: max)\n\
  -probability           show output scores as posterior probabilities\n\
+ -mea                   show the gene structure of maximum expected accuracy (the one with the\n\
+                          greatest summed posterior probability of features and regions)\n\
+                          instead of the most probable one; implies -probability\n\
+ -nbest <n>             show the n highest-scoring gene structures, best first (def: 1)\n\
+ -samples <n>           show n gene structures sampled from the posterior distribution; the\n\
+                          forward pass keeps every scored source of every feature for the\n\
+                          draws (12 bytes each, so memory grows with the density of features)\n\
+ -seed <n>              seed for -samples and -sample_gene (def: taken from the time)\n\
 \n\
 Other options:\n\
  -full_calc             perform full dynamic programming (as opposed to faster heurstic method)\n\
+ -fast_exp              use a fast (vectorised where possible) exp when summing over paths\n\
+                          (each sum over paths is within 1e-12 of the default in log space)\n\
+ -threads <n>           number of threads for the dp (def: 1); sequences are run in parallel,\n\
+                          and spare threads are used on the blocks between Selected features.\n\
+                          The backward and forward passes of -probability -features run\n\
+                          concurrently only with -full_calc, so the default (pruned) run\n\
+                          gets no speed-up from that\n\
+ -check_partition       check the dp on blocks between Selected features against the full dp\n\
+ -beam <n>              sum over only the n best-scoring sources in each frame, for each target\n\
+                          and source type, and stop scanning a frame once a source scores the\n\
+                          beam margin below all n (def: all); faster on dense regions, but the\n\
+                          results are approximate\n\
+ -beam_margin <f>       log-score margin below the best at which sources are pruned, or the\n\
+                          beam stops (def: 25)\n\
+ -check_beam            compare the dp with pruning and any beam against the full dp, reporting\n\
+                          the probability mass lost and whether the best gene structure differs\n\
+ -no_gff_index          do not use (or make) an index file (<gff_file>.gidx) for each GFF file;\n\
+                          the files are then read in full, once for all sequences\n\
+ -gff_memory <n>        megabytes of GFF lines to hold in memory when reading for several\n\
+                          sequences without an index, beyond which they are kept in a temporary\n\
+                          file (def: 256)\n\
+ -no_dna_index          do not use (or make) an index file (<dna_file>.fai) for each DNA file;\n\
+                          the files are then read from the start up to the region of interest\n\
  -verbose               write basic progess information to stderr\n\
  -help                  show this message\n";
 
@@ -79,9 +113,22 @@ static Option options[] = {
   { "-help", NO_ARGS },
   { "-verbose", NO_ARGS },
   { "-probability", NO_ARGS },
+  { "-mea", NO_ARGS },
+  { "-nbest", INT_ARG },
+  { "-samples", INT_ARG },
+  { "-seed", INT_ARG },
   { "-full_calc", NO_ARGS },
   { "-cutoff", FLOAT_ARG },
-  { "-sigma", FLOAT_ARG }
+  { "-sigma", FLOAT_ARG },
+  { "-threads", INT_ARG },
+  { "-check_partition", NO_ARGS },
+  { "-fast_exp", NO_ARGS },
+  { "-beam_margin", FLOAT_ARG },
+  { "-beam", INT_ARG },             /* after -beam_margin, which it prefixes */
+  { "-check_beam", NO_ARGS },
+  { "-gff_memory", INT_ARG },
+  { "-no_gff_index", NO_ARGS },
+  { "-no_dna_index", NO_ARGS }
 };
 
 
@@ -105,6 +152,7 @@ static struct {
   boolean output_features;
 
   boolean full_calc;
+  boolean fast_exp;
   boolean use_selected;
   boolean verbose;
   boolean probability;
@@ -113,6 +161,23 @@ static struct {
   double threshold;
   double sigma;
 
+  int num_threads;
+  int block_threads;      /* threads for the blocks of each sequence */
+  boolean check_partition;
+
+  int beam_width;         /* 0 for no beam */
+  double beam_margin;     /* 0 for the default */
+  boolean check_beam;
+
+  boolean mea;
+  int nbest;              /* number of gene structures to report */
+  boolean gff_index;      /* use the sidecar indices of the GFF files */
+  boolean dna_index;      /* use the .fai indices of the DNA files */
+  long gff_memory;        /* budget for the GFF lines read up-front */
+  int num_samples;        /* 0 for no sampling after the forward pass */
+  unsigned int seed;
+  boolean seed_given;
+
 } gaze_options;
 
 
@@ -124,10 +189,51 @@ static boolean process_Gaze_Options(char *optname,
   boolean options_error = FALSE;
 
   if (strcmp(optname, "-sigma") == 0) gaze_options.sigma = atof( optarg );
+  else if (strcmp(optname, "-threads") == 0) gaze_options.num_threads = atoi( optarg );
+  else if (strcmp(optname, "-check_partition") == 0) gaze_options.check_partition = TRUE;
+  else if (strcmp(optname, "-check_beam") == 0) gaze_options.check_beam = TRUE;
+  else if (strcmp(optname, "-beam") == 0) {
+    if ((gaze_options.beam_width = atoi( optarg )) < 1) {
+      fprintf( stderr, "The beam width must be at least 1\n" );
+      options_error = TRUE;
+    }
+  }
+  else if (strcmp(optname, "-mea") == 0) gaze_options.mea = TRUE;
+  else if (strcmp(optname, "-no_gff_index") == 0) gaze_options.gff_index = FALSE;
+  else if (strcmp(optname, "-no_dna_index") == 0) gaze_options.dna_index = FALSE;
+  else if (strcmp(optname, "-gff_memory") == 0) {
+    if ((gaze_options.gff_memory = atol( optarg ) * 1024L * 1024L) < 1) {
+      fprintf( stderr, "The GFF memory must be at least 1 megabyte\n" );
+      options_error = TRUE;
+    }
+  }
+  else if (strcmp(optname, "-nbest") == 0) {
+    if ((gaze_options.nbest = atoi( optarg )) < 1) {
+      fprintf( stderr, "The number of gene structures must be at least 1\n" );
+      options_error = TRUE;
+    }
+  }
+  else if (strcmp(optname, "-samples") == 0) {
+    if ((gaze_options.num_samples = atoi( optarg )) < 1) {
+      fprintf( stderr, "The number of samples must be at least 1\n" );
+      options_error = TRUE;
+    }
+  }
+  else if (strcmp(optname, "-seed") == 0) {
+    gaze_options.seed = (unsigned int) strtoul( optarg, NULL, 10 );
+    gaze_options.seed_given = TRUE;
+  }
+  else if (strcmp(optname, "-beam_margin") == 0) {
+    if ((gaze_options.beam_margin = atof( optarg )) <= 0.0) {
+      fprintf( stderr, "The beam margin must be positive\n" );
+      options_error = TRUE;
+    }
+  }
   else if (strcmp(optname, "-selected") == 0) gaze_options.use_selected = TRUE;	     
   else if (strcmp(optname, "-verbose") == 0) gaze_options.verbose = TRUE;
   else if (strcmp(optname, "-probability") == 0) gaze_options.probability = TRUE;  
   else if (strcmp(optname, "-full_calc") == 0) gaze_options.full_calc = TRUE;
+  else if (strcmp(optname, "-fast_exp") == 0) gaze_options.fast_exp = TRUE;
   else if (strcmp(optname, "-sample_gene") == 0) gaze_options.sample_gene = TRUE;
   else if (strcmp(optname, "-regions") == 0) gaze_options.output_regions = TRUE;
   else if (strcmp(optname, "-features") == 0) gaze_options.output_features = TRUE;
@@ -269,6 +375,20 @@ static int parse_command_line( int argc, char *argv[] ) {
   } 
 
   gaze_options.sigma = 1.0;
+  gaze_options.num_threads = 1;
+  gaze_options.block_threads = 1;
+  gaze_options.check_partition = FALSE;
+  gaze_options.beam_width = 0;
+  gaze_options.beam_margin = 0.0;
+  gaze_options.check_beam = FALSE;
+  gaze_options.mea = FALSE;
+  gaze_options.nbest = 1;
+  gaze_options.gff_index = TRUE;
+  gaze_options.dna_index = TRUE;
+  gaze_options.gff_memory = GFF_ROUTER_DEFAULT_BUDGET;
+  gaze_options.num_samples = 0;
+  gaze_options.seed = 0;
+  gaze_options.seed_given = FALSE;
 
   gaze_options.sequence_names = new_Array (sizeof( char * ), TRUE);
   gaze_options.sequence_starts = new_Array (sizeof( int ), TRUE);
@@ -286,6 +406,7 @@ static int parse_command_line( int argc, char *argv[] ) {
   gaze_options.use_selected = FALSE;
   gaze_options.verbose = FALSE;
   gaze_options.full_calc = FALSE;
+  gaze_options.fast_exp = FALSE;
   gaze_options.probability = FALSE;
   gaze_options.use_threshold = FALSE;
   gaze_options.threshold = 0.0;
@@ -321,6 +442,11 @@ static int parse_command_line( int argc, char *argv[] ) {
     }
   }
 
+  if (gaze_options.num_threads < 1) {
+    fprintf( stderr, "Error: the number of threads must be at least 1\n");
+    options_error = TRUE;
+  }
+
   /* check for legal combinations of options */
 
   if (gaze_options.sample_gene || gaze_options.output_regions || gaze_options.output_features) {
@@ -333,6 +459,35 @@ static int parse_command_line( int argc, char *argv[] ) {
     }
   }
 
+  if (gaze_options.nbest > 1 && 
+      (gaze_options.sample_gene || gaze_options.output_regions || 
+       gaze_options.output_features || gaze_options.probability)) {
+    fprintf( stderr, "Error: -nbest cannot be used with -sample_gene, -regions, -features or -probability\n");
+    options_error = TRUE;
+  }
+
+  if (gaze_options.num_samples > 0 && 
+      (gaze_options.sample_gene || gaze_options.output_regions || 
+       gaze_options.output_features || gaze_options.probability ||
+       gaze_options.nbest > 1)) {
+    fprintf( stderr, "Error: -samples cannot be used with -sample_gene, -regions, -features, -probability or -nbest\n");
+    options_error = TRUE;
+  }
+
+  if (gaze_options.mea) {
+    if (gaze_options.sample_gene || gaze_options.output_regions || 
+	gaze_options.output_features || gaze_options.nbest > 1 || 
+	gaze_options.num_samples > 0) {
+      fprintf( stderr, "Error: -mea cannot be used with -sample_gene, -regions, -features, -nbest or -samples\n");
+      options_error = TRUE;
+    }
+    /* the posteriors are needed for the expected accuracy */
+    gaze_options.probability = TRUE;
+  }
+
+  if (! gaze_options.seed_given)
+    gaze_options.seed = (unsigned int) time(NULL);
+
   /* the list of file names to process is the combination of thise names
      in the -id_file file, and those left on the command-line */
 
@@ -433,13 +588,15 @@ static int parse_command_line( int argc, char *argv[] ) {
 
 
 /*********************************************************************
- FUNCTION: prepare_Gaze_Sequence_for_work
-    This function basically fills in the Sequence by reading the
-    GFF and dna files, and then sorting and scaling the features etc.
+ FUNCTION: read_Gaze_Sequence_for_work
+    This function does the file reading for the Sequence, i.e. 
+    obtaining the DNA and converting the GFF lines into features
+    and segments. It is kept separate from the processing below so 
+    that reading can be overlapped with the dp for other sequences
 
  *********************************************************************/
-static void prepare_Gaze_Sequence_for_work( Gaze_Sequence *g_seq ) {
-  int i;
+static void read_Gaze_Sequence_for_work( Gaze_Sequence *g_seq,
+					 Gaze_Structure *gs ) {
 
   /*******************************************************************/
   /* get the dna sequences *******************************************/
@@ -454,26 +611,44 @@ static void prepare_Gaze_Sequence_for_work( Gaze_Sequence *g_seq ) {
   /* sequences are intialised after reading the DNA, just in case
      the user did not supply start-end information in which case
      we have to serive it from the DNA */
-  initialise_Gaze_Sequence( g_seq, gazeStructure );
+  initialise_Gaze_Sequence( g_seq, gs );
   
   /******************************************************************/
   /* First, obtain and set up all the Features and Segments *********/
   /******************************************************************/
   
-  if (gaze_options.verbose)
-    fprintf(stderr, "Reading the gff files...\n");
-  convert_gff_Gaze_Sequence( g_seq,
+  if (gffRouter != NULL)
+    convert_routed_gff_Gaze_Sequence( g_seq, gffRouter, gs->gff_dispatch );
+  else {
+    if (gaze_options.verbose)
+      fprintf(stderr, "Reading the gff files...\n");
+    convert_gff_Gaze_Sequence( g_seq,
 			       gaze_options.gff_file_names,
-			     gazeStructure->gff_to_feats ); 
-  
+			       gs->gff_dispatch ); 
+  }
+}
+
+
+
+/*********************************************************************
+ FUNCTION: prepare_Gaze_Sequence_for_work
+    This function basically fills in the Sequence from the data
+    read above, and then sorting and scaling the features etc.
+
+ *********************************************************************/
+static void prepare_Gaze_Sequence_for_work( Gaze_Sequence *g_seq,
+					    Gaze_Structure *gs ) {
+  long prefix_bytes = 0;
+  int i;
+
   if (gaze_options.verbose)
     fprintf(stderr, "Getting features from dna...\n");
   
   if (g_seq->dna_seq != NULL) {
     convert_dna_Gaze_Sequence( g_seq,
-			       gazeStructure->dna_to_feats,
-			       gazeStructure->take_dna, 
-			       gazeStructure->motif_dict );
+			       gs->dna_to_feats,
+			       gs->take_dna, 
+			       gs->motif_dict );
     
     /* we never need the sequence itself again */
     free_util( g_seq->dna_seq );
@@ -493,26 +668,35 @@ static void prepare_Gaze_Sequence_for_work( Gaze_Sequence *g_seq ) {
   
   for( i=0; i < g_seq->features->len; i++ ) {
     Feature *ft = index_Array( g_seq->features, Feature *, i );
-    ft->score *= index_Array( gazeStructure->feat_info, Feature_Info *, ft->feat_idx )->multiplier;
+    ft->score *= index_Array( gs->feat_info, Feature_Info *, ft->feat_idx )->multiplier;
       ft->score *= gaze_options.sigma;
       
       ft->adj_pos.s = ft->real_pos.s 
-	+ index_Array( gazeStructure->feat_info, Feature_Info *, ft->feat_idx )->start_offset;
+	+ index_Array( gs->feat_info, Feature_Info *, ft->feat_idx )->start_offset;
       
       ft->adj_pos.e = ft->real_pos.e 
-	- index_Array( gazeStructure->feat_info, Feature_Info *, ft->feat_idx )->end_offset;
+	- index_Array( gs->feat_info, Feature_Info *, ft->feat_idx )->end_offset;
   }
     
   /* now the segments..*/
   for( i=0; i < g_seq->segment_lists->len; i++ ) {
     Segment_list *seg_list = index_Array( g_seq->segment_lists, Segment_list *, i);
-    double multiplier = index_Array( gazeStructure->seg_info, Segment_Info *, i )->multiplier;
+    Segment_Info *seg_info = index_Array( gs->seg_info, Segment_Info *, i );
     
-    scale_Segment_list( seg_list, multiplier * gaze_options.sigma );
+    scale_Segment_list( seg_list, seg_info->multiplier * gaze_options.sigma );
     sort_Segment_list ( seg_list );
     project_Segment_list( seg_list );
     index_Segment_list( seg_list );
+    prefix_bytes += cumulate_Segment_list( seg_list, 
+					   g_seq->seq_region.s,
+					   g_seq->seq_region.e,
+					   seg_info->prefix_framed,
+					   seg_info->prefix_unframed );
   }
+
+  if (gaze_options.verbose && prefix_bytes > 0)
+    fprintf(stderr, "Cumulative segment scores for %s: %ld bytes\n", 
+	    g_seq->seq_name, prefix_bytes);
   
   /******************************************************************/
   /** Obtain the given paths, if there are any **********************/
@@ -524,13 +708,13 @@ static void prepare_Gaze_Sequence_for_work( Gaze_Sequence *g_seq ) {
     
     if (! get_correct_feats_Gaze_Sequence( g_seq,
 					     gaze_options.gene_file_names, 
-					   gazeStructure->feat_dict, 
+					   gs->feat_dict, 
 					   TRUE))
       fatal_util( "There was a problem reading in the correct paths\n" );
     
     /* check that any paths that were given are actually legal paths */
     
-    if (g_seq->path != NULL && ! is_legal_path( g_seq->path, gazeStructure ))
+    if (g_seq->path != NULL && ! is_legal_path( g_seq->path, gs ))
       fatal_util( "For sequence %s, the given \"correct\" path was illegal according to the model",
 		  g_seq->seq_name);
   }
@@ -542,10 +726,14 @@ static void prepare_Gaze_Sequence_for_work( Gaze_Sequence *g_seq ) {
     
     if (! get_correct_feats_Gaze_Sequence( g_seq,
 					   gaze_options.selected_file_names, 
-					   gazeStructure->feat_dict, 
+					   gs->feat_dict, 
 					   FALSE))
       fatal_util( "There was a problem reading in the selected features\n" );
   }
+
+  /* the features are now in their final order, and will not change
+     other than in the dp, which works on a column-wise copy */
+  g_seq->feat_table = new_Feature_Table( g_seq->features );
 }
 
 
@@ -562,6 +750,572 @@ static void cleanup_Gaze_Sequence_after_work ( Gaze_Sequence *g_seq ) {
 
 
 
+/*********************************************************************
+ FUNCTION: backwards_calc_thread
+    Thread entry point for running the backward pass alongside
+    the forward pass
+
+ *********************************************************************/
+typedef struct {
+  Gaze_Sequence *g_seq;
+  Gaze_Structure *gs;
+} Gaze_Backward_Job;
+
+static void *backwards_calc_thread( void *arg ) {
+  Gaze_Backward_Job *job = (Gaze_Backward_Job *) arg;
+
+  backwards_calc_partitioned( job->g_seq,
+			      job->gs, 
+			      ! gaze_options.full_calc,
+			      gaze_options.block_threads,
+			      gaze_options.check_partition );
+
+  return NULL;
+}
+
+
+
+/*********************************************************************
+ FUNCTION: forwards_backwards_calc_concurrent
+    Runs the backward and forward passes at the same time, on two 
+    threads. This is only valid when the forward pass does not 
+    need the backward scores (i.e. for -features, but not -regions),
+    and when there is no pruning (-full_calc).
+    
+    The passes also communicate via the "invalid" flag of each 
+    feature, so the backward pass is run over a private copy of the 
+    features; the backward scores and invalidations are copied back
+    once both passes have finished. Without pruning, the only 
+    features that the backward pass invalidates are those with no 
+    legal path to the end, which have a backward score of 
+    NEG_INFINITY, so their posterior is zero whatever the forward 
+    pass made of them. The pruning also invalidates features that 
+    are merely dominated; the serial forward pass leaves those out 
+    of its sums, which a concurrent one cannot know to do.
+
+    Even without pruning, when a Selected feature is invalidated 
+    (i.e. there is no legal path) the forward scores depend on what
+    the backward pass invalidated, so the forward pass is run again
+    once the backward invalidations are known
+
+ *********************************************************************/
+static void forwards_backwards_calc_concurrent( Gaze_Sequence *g_seq,
+						Gaze_Structure *gs,
+						Gaze_Output *g_out ) {
+  Gaze_Sequence bwd_seq;
+  Gaze_Backward_Job bwd_job;
+  pthread_t bwd_thread;
+  boolean lost_selected = FALSE;
+  int i;
+
+  bwd_seq = *g_seq;
+  bwd_seq.dp_allocs = bwd_seq.dp_scans = 0;
+  bwd_seq.features = new_Array( sizeof(Feature *), TRUE );
+  for (i=0; i < g_seq->features->len; i++) {
+    Feature *ft = clone_Feature( index_Array( g_seq->features, Feature *, i ) );
+    append_val_Array( bwd_seq.features, ft );
+  }
+  bwd_seq.feat_table = clone_Feature_Table( g_seq->feat_table );
+
+  bwd_job.g_seq = &bwd_seq;
+  bwd_job.gs = gs;
+
+  if (gaze_options.verbose)
+    fprintf(stderr, "Doing backward and forward calculations...\n"); 
+
+  if (pthread_create( &bwd_thread, NULL, &backwards_calc_thread, &bwd_job ))
+    fatal_util( "Could not create thread for the backward calculation" );
+
+  forwards_calc_partitioned( g_seq,
+			     gs, 
+			     ! gaze_options.full_calc,
+			     g_out,
+			     gaze_options.block_threads,
+			     gaze_options.check_partition );
+
+  pthread_join( bwd_thread, NULL );
+
+  for (i=0; i < g_seq->features->len; i++) {
+    Feature *ft = index_Array( g_seq->features, Feature *, i );
+    Feature *bwd_ft = index_Array( bwd_seq.features, Feature *, i );
+
+    ft->backward_score = bwd_ft->backward_score;
+    if (ft->is_selected && (ft->invalid || bwd_ft->invalid))
+      lost_selected = TRUE;
+  }
+
+  g_seq->dp_allocs += bwd_seq.dp_allocs;
+  g_seq->dp_scans += bwd_seq.dp_scans;
+
+  if (lost_selected) {
+    for (i=0; i < g_seq->features->len; i++) 
+      index_Array( g_seq->features, Feature *, i )->invalid = 
+	index_Array( bwd_seq.features, Feature *, i )->invalid;
+
+    forwards_calc_partitioned( g_seq,
+			       gs, 
+			       ! gaze_options.full_calc,
+			       g_out,
+			       gaze_options.block_threads,
+			       gaze_options.check_partition );
+  }
+  else {
+    for (i=0; i < g_seq->features->len; i++) 
+      if (index_Array( bwd_seq.features, Feature *, i )->invalid)
+	index_Array( g_seq->features, Feature *, i )->invalid = TRUE;
+  }
+
+  for (i=0; i < bwd_seq.features->len; i++)
+    free_Feature( index_Array( bwd_seq.features, Feature *, i ) );
+  free_Array( bwd_seq.features, TRUE );
+  free_Feature_Table( bwd_seq.feat_table );
+}
+
+
+
+/* Totals for the -check_beam report, over all sequences */
+
+static struct {
+  pthread_mutex_t lock;
+  int num_seqs;
+  int num_differ;
+  double total_lost;
+} beamCheck = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0.0 };
+
+
+/*********************************************************************
+ FUNCTION: check_beam_Gaze_Sequence
+    Runs the forward pass over the given sequence twice, once in full
+    and once with the limits that the user has placed on it (the
+    pruning, and any beam), and reports the probability mass lost to
+    the limits, and whether the best gene structure is the same. 
+    Sequences whose END cannot be reached have no mass to lose, and
+    are reported but not counted.
+
+    The invalidations made by the passes are undone afterwards, so
+    that the real calculation is unaffected
+
+ *********************************************************************/
+
+static void check_beam_Gaze_Sequence( Gaze_Sequence *g_seq,
+				      Gaze_Structure *gs,
+				      Gaze_Output *g_out ) {
+  Gaze_Output *sum_out;
+  boolean *was_invalid;
+  Array *full_path;
+  boolean differs = FALSE;
+  int i, pos, beam_width, last = g_seq->features->len - 1;
+  double full_total, limited_total, beam_margin, lost;
+
+  /* only the sums are needed, and nothing is to be printed */
+  sum_out = new_Gaze_Output( g_out->fh, TRUE, FALSE, FALSE, FALSE, FALSE, 0.0 );
+
+  was_invalid = (boolean *) malloc_util( g_seq->features->len * sizeof(boolean) );
+  for (i=0; i < g_seq->features->len; i++)
+    was_invalid[i] = index_Array( g_seq->features, Feature *, i )->invalid;
+
+  beam_width = g_seq->beam_width;
+  beam_margin = g_seq->beam_margin;
+  g_seq->beam_width = 0;
+  g_seq->beam_margin = 0.0;
+
+  forwards_calc( g_seq, gs, FALSE, sum_out );
+
+  full_total = index_Array( g_seq->features, Feature *, last )->forward_score;
+  full_path = new_Array( sizeof(int), TRUE );
+  for (pos = last; pos > 0; pos = index_Array( g_seq->features, Feature *, pos )->trace_pointer)
+    append_val_Array( full_path, pos );
+
+  for (i=0; i < g_seq->features->len; i++)
+    index_Array( g_seq->features, Feature *, i )->invalid = was_invalid[i];
+  g_seq->beam_width = beam_width;
+  g_seq->beam_margin = beam_margin;
+
+  forwards_calc( g_seq, gs, ! gaze_options.full_calc, sum_out );
+
+  limited_total = index_Array( g_seq->features, Feature *, last )->forward_score;
+  if (index_Array( g_seq->features, Feature *, last )->invalid)
+    limited_total = NEG_INFINITY;
+  for (i=0, pos = last; pos > 0 && ! differs; i++) {
+    if (i >= full_path->len || index_Array( full_path, int, i ) != pos)
+      differs = TRUE;
+    pos = index_Array( g_seq->features, Feature *, pos )->trace_pointer;
+  }
+  if (i != full_path->len)
+    differs = TRUE;
+
+  if (full_total == NEG_INFINITY)
+    fprintf( stderr, "Beam check for %s: END cannot be reached, skipped\n", g_seq->seq_name );
+  else {
+    lost = 1.0 - exp( limited_total - full_total );
+
+    fprintf( stderr, "Beam check for %s: with the pruning and beam, probability mass lost %.4g, "
+	     "best gene structure %s\n",
+	     g_seq->seq_name, lost, differs ? "differs" : "same" );
+
+    pthread_mutex_lock( &beamCheck.lock );
+    beamCheck.num_seqs++;
+    if (differs)
+      beamCheck.num_differ++;
+    beamCheck.total_lost += lost;
+    pthread_mutex_unlock( &beamCheck.lock );
+  }
+
+  for (i=0; i < g_seq->features->len; i++)
+    index_Array( g_seq->features, Feature *, i )->invalid = was_invalid[i];
+
+  free_Array( full_path, TRUE );
+  free_util( was_invalid );
+  free_Gaze_Output( sum_out );
+}
+
+
+
+/*********************************************************************
+ FUNCTION: process_Gaze_Sequence
+    This function does all of the work for a single sequence once its
+    data has been read: running the dp and writing the results to the
+    given output. Everything it touches is either private to the 
+    sequence or output, or (in the case of the structure) read-only, 
+    so it is safe to call concurrently for different sequences
+
+ *********************************************************************/
+static void process_Gaze_Sequence( Gaze_Sequence *g_seq,
+				   Gaze_Structure *gs,
+				   Gaze_Output *g_out ) {
+
+  prepare_Gaze_Sequence_for_work ( g_seq, gs );
+      
+  if(gaze_options.verbose)
+    fprintf(stderr, "Running GAZE for sequence %s (%d-%d), %d feats\n", 
+	    g_seq->seq_name, 
+	    g_seq->seq_region.s, 
+	    g_seq->seq_region.e,
+	    g_seq->features->len);
+
+  if (gaze_options.check_beam)
+    check_beam_Gaze_Sequence( g_seq, gs, g_out );
+
+  if (g_out->probability && g_out->features && 
+      gaze_options.full_calc && gaze_options.num_threads > 1) {
+    /* the forward pass does not need the backward scores for this
+       output, so the two passes can run concurrently. With pruning
+       they cannot, because the forward pass skips the features that
+       the backward pass has invalidated */
+    write_Gaze_header( g_out, g_seq );
+
+    forwards_backwards_calc_concurrent( g_seq, gs, g_out );
+  }
+  else {
+    if (g_out->probability) {
+      if (gaze_options.verbose)
+	fprintf(stderr, "Doing backward calculation...\n"); 
+      backwards_calc_partitioned( g_seq,
+				  gs, 
+				  ! gaze_options.full_calc,
+				  gaze_options.block_threads,
+				  gaze_options.check_partition );
+    }
+    
+    if (gaze_options.verbose)
+      fprintf(stderr, "Doing forward calculation...\n");
+
+    /* need to write the head first because forwards_calc produces 
+       the output of all candidate regions, for space-saving reasons */
+    write_Gaze_header( g_out, g_seq );
+    
+    forwards_calc_partitioned( g_seq,
+			       gs, 
+			       ! gaze_options.full_calc,
+			       g_out,
+			       gaze_options.block_threads,
+			       gaze_options.check_partition );
+  }
+  
+  if (gaze_options.output_features)
+    write_Gaze_Features( g_out, g_seq, gs );
+  else if (g_seq->path == NULL && g_seq->num_samples > 0) {
+    Array **paths;
+    int samp;
+
+    if (gaze_options.verbose)
+      fprintf( stderr, "Sampling %d paths...\n", g_seq->num_samples);
+
+    if ((paths = sample_trace_backs( g_seq, 
+				     g_seq->num_samples, 
+				     g_seq->sample_seed,
+				     gaze_options.block_threads )) != NULL) {
+      write_GFF_comment( g_out->fh, "  %d paths sampled with seed %u", 
+			 g_seq->num_samples, g_seq->sample_seed );
+
+      for (samp = 0; samp < g_seq->num_samples; samp++) {
+	if ((g_seq->path = paths[samp]) == NULL) {
+	  write_GFF_comment( g_out->fh, "  Sample %d of %d could not be drawn", 
+			     samp + 1, g_seq->num_samples );
+	  continue;
+	}
+
+	calculate_path_score( g_seq, gs );
+	write_GFF_comment( g_out->fh, "  Sample %d of %d", samp + 1, g_seq->num_samples );
+	write_Gaze_path( g_out, g_seq, gs );
+
+	free_Array( g_seq->path, TRUE );
+	g_seq->path = NULL;
+      }
+      free_util( paths );
+    }
+    else
+      write_GFF_comment( g_out->fh, "  No paths could be sampled: END cannot be reached" );
+  }
+  else if (g_seq->path == NULL && g_seq->feat_table->nbest > 1) {
+    int rank, num_paths = g_seq->feat_table->nbest_count[g_seq->features->len - 1];
+
+    if (gaze_options.verbose)
+      fprintf( stderr, "Tracing back %d paths...\n", num_paths);
+
+    for (rank = 0; rank < num_paths; rank++) {
+      trace_back_nbest( g_seq, rank );
+
+      calculate_path_score( g_seq, gs );
+      write_GFF_comment( g_out->fh, "  Path %d of %d", rank + 1, num_paths );
+      write_Gaze_path( g_out, g_seq, gs );
+
+      free_Array( g_seq->path, TRUE );
+      g_seq->path = NULL;
+    }
+  }
+  else if (!gaze_options.output_regions) {
+    if (g_seq->path == NULL) {
+      if (gaze_options.mea) {
+	if (gaze_options.verbose)
+	  fprintf( stderr, "Doing expected accuracy calculation...\n");
+	mea_calc( g_seq, gs );
+	write_GFF_comment( g_out->fh, "  Expected accuracy of path : %.6f",
+			   g_seq->end_ft->path_score );
+      }
+
+      if (gaze_options.verbose)
+	fprintf( stderr, "Tracing back...\n");
+      trace_back_general(g_seq );
+    }
+      
+    calculate_path_score( g_seq, gs );
+    write_Gaze_path( g_out, g_seq, gs );
+  }
+
+  if (gaze_options.verbose)
+    fprintf(stderr, "DP for %s: %ld allocations over %ld scans (%.4f per scan)\n",
+	    g_seq->seq_name,
+	    g_seq->dp_allocs,
+	    g_seq->dp_scans,
+	    g_seq->dp_scans > 0 ? (double) g_seq->dp_allocs / (double) g_seq->dp_scans : 0.0);
+
+  cleanup_Gaze_Sequence_after_work( g_seq );
+}
+
+
+
+/*********************************************************************/
+/***** Pipelined processing of the sequence list *********************/
+/*********************************************************************/
+
+/* The sequence list is processed by a three-stage pipeline: 
+
+   1. a reader thread reads the DNA and GFF data for each sequence
+      in input order;
+   2. a pool of dp workers takes the sequences that have been read,
+      runs the dp, and writes the output for each into a private 
+      memory buffer; 
+   3. the main thread flushes the buffers strictly in input order,
+      so that the output is identical to that of the serial run.
+
+   The queues between the stages are bounded: the reader may not get 
+   more than read_ahead sequences ahead of the workers, and the workers
+   may not get more than window sequences ahead of the writer. With a 
+   single worker, sequence i+1 is thus being read while sequence i is
+   in the dp and sequence i-1 is being written */
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t progress;  /* broadcast whenever any stage moves on */
+
+  int next_to_read;    /* index of the next sequence to be read */
+  int next_job;        /* index of the next sequence to be handed to a worker */
+  int next_to_write;   /* index of the next sequence to be flushed */
+  int read_ahead;
+  int window;
+
+  char **out_bufs;     /* reorder buffer, indexed by sequence */
+  size_t *out_lens;
+  boolean *finished;
+} gazePool;
+
+
+
+/*********************************************************************
+ FUNCTION: gaze_reader
+    Thread main-loop for the input stage; reads the data for each
+    sequence in turn, blocking when the dp workers fall behind
+
+ *********************************************************************/
+static void *gaze_reader( void *arg ) {
+  int seq_idx;
+
+  for(;;) {
+    pthread_mutex_lock( &gazePool.lock );
+    while (gazePool.next_to_read < allGazeSequences->num_seqs &&
+	   gazePool.next_to_read >= gazePool.next_job + gazePool.read_ahead)
+      pthread_cond_wait( &gazePool.progress, &gazePool.lock );
+    seq_idx = gazePool.next_to_read;
+    pthread_mutex_unlock( &gazePool.lock );
+
+    if (seq_idx >= allGazeSequences->num_seqs)
+      break;
+
+    read_Gaze_Sequence_for_work( allGazeSequences->seq_list[seq_idx], gazeStructure );
+
+    pthread_mutex_lock( &gazePool.lock );
+    gazePool.next_to_read++;
+    pthread_cond_broadcast( &gazePool.progress );
+    pthread_mutex_unlock( &gazePool.lock );
+  }
+
+  return NULL;
+}
+
+
+
+/*********************************************************************
+ FUNCTION: gaze_worker
+    Thread main-loop for the dp stage; repeatedly takes the next 
+    sequence that has been read and processes it until there are 
+    none left 
+
+ *********************************************************************/
+static void *gaze_worker( void *arg ) {
+  int seq_idx;
+  char *buf;
+  size_t len;
+  FILE *fh;
+  Gaze_Output *g_out;
+
+  for(;;) {
+    pthread_mutex_lock( &gazePool.lock );
+    while (gazePool.next_job < allGazeSequences->num_seqs &&
+	   (gazePool.next_job >= gazePool.next_to_read ||
+	    gazePool.next_job >= gazePool.next_to_write + gazePool.window))
+      pthread_cond_wait( &gazePool.progress, &gazePool.lock );
+
+    if (gazePool.next_job >= allGazeSequences->num_seqs) {
+      pthread_mutex_unlock( &gazePool.lock );
+      break;
+    }
+    seq_idx = gazePool.next_job++;
+    pthread_cond_broadcast( &gazePool.progress );
+    pthread_mutex_unlock( &gazePool.lock );
+
+    buf = NULL;
+    len = 0;
+    if ((fh = open_memstream( &buf, &len )) == NULL)
+      fatal_util( "Could not create output buffer for sequence %s", 
+		  allGazeSequences->seq_list[seq_idx]->seq_name );
+
+    g_out = new_Gaze_Output(fh,
+			    gaze_options.probability,
+			    gaze_options.sample_gene,
+			    gaze_options.output_features,
+			    gaze_options.output_regions,
+			    gaze_options.use_threshold,
+			    gaze_options.threshold);
+
+    process_Gaze_Sequence( allGazeSequences->seq_list[seq_idx], 
+			   gazeStructure,
+			   g_out );
+
+    free_Gaze_Output( g_out );
+    fclose( fh );
+
+    pthread_mutex_lock( &gazePool.lock );
+    gazePool.out_bufs[seq_idx] = buf;
+    gazePool.out_lens[seq_idx] = len;
+    gazePool.finished[seq_idx] = TRUE;
+    pthread_cond_broadcast( &gazePool.progress );
+    pthread_mutex_unlock( &gazePool.lock );
+  }
+
+  return NULL;
+}
+
+
+
+/*********************************************************************
+ FUNCTION: process_Gaze_Sequences_pipelined
+    Runs the sequences through the reader, a pool of num_threads dp 
+    workers, and the writer (this thread), writing the results to the 
+    given file in input order
+
+ *********************************************************************/
+static void process_Gaze_Sequences_pipelined( int num_threads, FILE *out ) {
+  int i, num_seqs = allGazeSequences->num_seqs;
+  pthread_t reader;
+  pthread_t *workers;
+  char *buf;
+  size_t len;
+
+  pthread_mutex_init( &gazePool.lock, NULL );
+  pthread_cond_init( &gazePool.progress, NULL );
+
+  gazePool.next_to_read = 0;
+  gazePool.next_job = 0;
+  gazePool.next_to_write = 0;
+  gazePool.read_ahead = num_threads;
+  gazePool.window = 2 * num_threads;
+  gazePool.out_bufs = (char **) malloc0_util( num_seqs * sizeof( char * ) );
+  gazePool.out_lens = (size_t *) malloc0_util( num_seqs * sizeof( size_t ) );
+  gazePool.finished = (boolean *) malloc0_util( num_seqs * sizeof( boolean ) );
+
+  if (pthread_create( &reader, NULL, &gaze_reader, NULL ))
+    fatal_util( "Could not create reader thread" );
+
+  workers = (pthread_t *) malloc_util( num_threads * sizeof( pthread_t ) );
+  for (i=0; i < num_threads; i++)
+    if (pthread_create( &workers[i], NULL, &gaze_worker, NULL ))
+      fatal_util( "Could not create worker thread %d", i );
+
+  /* this thread acts as the writer, emptying the reorder buffer
+     in input order as the results become available */
+  for (i=0; i < num_seqs; i++) {
+    pthread_mutex_lock( &gazePool.lock );
+    while (! gazePool.finished[i])
+      pthread_cond_wait( &gazePool.progress, &gazePool.lock );
+    buf = gazePool.out_bufs[i];
+    len = gazePool.out_lens[i];
+    gazePool.out_bufs[i] = NULL;
+    gazePool.next_to_write = i + 1;
+    pthread_cond_broadcast( &gazePool.progress );
+    pthread_mutex_unlock( &gazePool.lock );
+
+    if (len > 0)
+      fwrite( buf, 1, len, out );
+    /* allocated by open_memstream, so not ours to free_util */
+    free( buf );
+  }
+
+  pthread_join( reader, NULL );
+  for (i=0; i < num_threads; i++)
+    pthread_join( workers[i], NULL );
+
+  free_util( workers );
+  free_util( gazePool.out_bufs );
+  free_util( gazePool.out_lens );
+  free_util( gazePool.finished );
+
+  pthread_cond_destroy( &gazePool.progress );
+  pthread_mutex_destroy( &gazePool.lock );
+}
+
+
+
 /*********************************************************************
  *********************************************************************
                         MAIN
@@ -570,7 +1324,6 @@ static void cleanup_Gaze_Sequence_after_work ( Gaze_Sequence *g_seq ) {
 int main (int argc, char *argv[]) {
 
   int i = 0;
-  Gaze_Sequence *g_seq;
 
   if (! parse_command_line(argc, argv) )
     fatal_util( "use \"gaze -h\" to find out about usage");
@@ -580,6 +1333,20 @@ int main (int argc, char *argv[]) {
   
   if ((gazeStructure = parse_Gaze_Structure( gaze_options.structure_file_name )) == NULL)
     exit(1);
+
+  init_log_sum_exp( gaze_options.fast_exp );
+
+  if (gaze_options.verbose) {
+    fprintf(stderr, "Using %s for summing over paths\n", log_sum_exp_kernel_name() );
+    if (gaze_options.fast_exp) {
+      double err = check_log_sum_exp();
+
+      fprintf(stderr, "Fast exp check: max log-sum-exp difference from libm %g (bound %g)\n",
+	      err, FAST_EXP_LOG_SUM_ERROR );
+      if (err > FAST_EXP_LOG_SUM_ERROR)
+	fprintf(stderr, "Warning: fast exp exceeds its error bound on this machine\n");
+    }
+  }
 	    
   /******************************/
   /* Scale the length penalties */
@@ -589,72 +1356,72 @@ int main (int argc, char *argv[]) {
     scale_Length_Function( lf, lf->multiplier * gaze_options.sigma );
   }
 
-  gazeOutput = new_Gaze_Output(gaze_options.out_file,
-			       gaze_options.probability,
-			       gaze_options.sample_gene,
-			       gaze_options.output_features,
-			       gaze_options.output_regions,
-			       gaze_options.use_threshold,
-			       gaze_options.threshold);
-
   allGazeSequences = new_Gaze_Sequence_list( gaze_options.sequence_names );
   for (i=0; i < allGazeSequences->num_seqs; i++) 
     allGazeSequences->seq_list[i] = new_Gaze_Sequence( index_Array( gaze_options.sequence_names, char *, i),
 						       index_Array( gaze_options.sequence_starts, int, i),
 						       index_Array( gaze_options.sequence_ends, int, i) );
-
   for (i=0; i < allGazeSequences->num_seqs; i++) {
-    g_seq = allGazeSequences->seq_list[i];
+    allGazeSequences->seq_list[i]->beam_width = gaze_options.beam_width;
+    allGazeSequences->seq_list[i]->beam_margin = gaze_options.beam_margin;
+    allGazeSequences->seq_list[i]->nbest = gaze_options.nbest;
+    allGazeSequences->seq_list[i]->num_samples = gaze_options.num_samples;
+    allGazeSequences->seq_list[i]->sample_seed = gaze_options.seed;
+  }
 
-    prepare_Gaze_Sequence_for_work ( g_seq );
-      
-    if(gaze_options.verbose)
-      fprintf(stderr, "Running GAZE for sequence %s (%d-%d), %d feats\n", 
-	      g_seq->seq_name, 
-	      g_seq->seq_region.s, 
-	      g_seq->seq_region.e,
-	      g_seq->features->len);
-
-    if (gazeOutput->probability) {
+  use_GFF_Index( gaze_options.gff_index );
+  use_FASTA_Index( gaze_options.dna_index );
+
+  if (allGazeSequences->num_seqs > 1) {
+    int num_workers;
+
+    /* with more than one sequence and no indices, the GFF files are 
+       read just once, up-front, rather than once for each sequence */
+    if (! gaze_options.gff_index) {
       if (gaze_options.verbose)
-	fprintf(stderr, "Doing backward calculation...\n"); 
-      backwards_calc( g_seq,
-		      gazeStructure, 
-		      ! gaze_options.full_calc );
+	fprintf(stderr, "Reading the gff files for all sequences...\n");
+      gffRouter = new_GFF_Router( allGazeSequences, gaze_options.gff_memory );
+      read_GFF_Router( gffRouter, gaze_options.gff_file_names );
+      if (gaze_options.verbose && gffRouter->spill_len > 0)
+	fprintf(stderr, "  (%ld bytes of GFF lines kept in a temporary file)\n", gffRouter->spill_len );
     }
-    
-    if (gaze_options.verbose)
-      fprintf(stderr, "Doing forward calculation...\n");
 
-    /* need to write the head first because forwards_calc produces 
-       the output of all candidate regions, for space-saving reasons */
-    write_Gaze_header( gazeOutput, g_seq );
-    
-    forwards_calc( g_seq,
-		   gazeStructure, 
-		   ! gaze_options.full_calc,
-		   gazeOutput );
-  
-    if (gaze_options.output_features)
-       write_Gaze_Features( gazeOutput, g_seq, gazeStructure );
-    else if (!gaze_options.output_regions) {
-      if (g_seq->path == NULL) {
-	if (gaze_options.verbose)
-	  fprintf( stderr, "Tracing back...\n");
-	trace_back_general(g_seq );
-      }
-      
-      calculate_path_score( g_seq, gazeStructure );
-      write_Gaze_path( gazeOutput, g_seq, gazeStructure );
+    /* reading, dp and writing can then overlap */
+    num_workers = MIN( gaze_options.num_threads, allGazeSequences->num_seqs );
+
+    gaze_options.block_threads = gaze_options.num_threads / num_workers;
+    process_Gaze_Sequences_pipelined( num_workers, gaze_options.out_file );
+  }
+  else {
+    gaze_options.block_threads = gaze_options.num_threads;
+
+    gazeOutput = new_Gaze_Output(gaze_options.out_file,
+				 gaze_options.probability,
+				 gaze_options.sample_gene,
+				 gaze_options.output_features,
+				 gaze_options.output_regions,
+				 gaze_options.use_threshold,
+				 gaze_options.threshold);
+
+    for (i=0; i < allGazeSequences->num_seqs; i++) {
+      read_Gaze_Sequence_for_work( allGazeSequences->seq_list[i], gazeStructure );
+      process_Gaze_Sequence( allGazeSequences->seq_list[i], gazeStructure, gazeOutput );
     }
 
-    cleanup_Gaze_Sequence_after_work( g_seq );
+    free_Gaze_Output( gazeOutput );
   }
 
-  free_Gaze_Output( gazeOutput );
+  if (gaze_options.check_beam)
+    fprintf( stderr, "Beam check: best gene structure differs for %d of %d sequences, mean probability mass lost %.4g\n",
+	     beamCheck.num_differ, 
+	     beamCheck.num_seqs,
+	     beamCheck.num_seqs > 0 ? beamCheck.total_lost / beamCheck.num_seqs : 0.0 );
+
+  free_GFF_Router( gffRouter );
+  free_GFF_Index_cache();
+  free_FASTA_Index_cache();
   free_Gaze_Structure( gazeStructure );
   free_Gaze_Sequence_list( allGazeSequences );
   
   return 0;
 }
-
@@ -17,8 +17,33 @@
  * E-mail : klh@sanger.ac.uk
  * Description : 
  **********************************************************************/
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "gff.h"
 
+/* The number of decimal places of the scores in the GFF output. The
+   regression tests build a copy of gaze with this raised to 17, to
+   compare posteriors beyond the printed precision */
+
+#ifndef GFF_SCORE_DIGITS
+#define GFF_SCORE_DIGITS 4
+#endif
+
+/* The indices of the GFF files opened so far, shared by all threads */
+
+static struct {
+  pthread_mutex_t lock;
+  boolean enabled;
+  Array *indices;       /* of GFF_Index * */
+} gffIndexCache = { PTHREAD_MUTEX_INITIALIZER, FALSE, NULL };
+
+static char GFF_INDEX_MAGIC[8] = { 'G', 'A', 'Z', 'E', 'G', 'I', 'D', 'X' };
+#define GFF_INDEX_VERSION 1
+
 
 /*********************************************************************
  FUNCTION: free_gff_line
@@ -62,49 +87,140 @@ GFF_line *new_GFF_line( void ) {
 
 
 /*********************************************************************
- FUNCTION: read_GFF_line
+ FUNCTION: field_int_GFF
  DESCRIPTION:
+   Reads the integer at the start of the given text, which ends
+   at the given limit (or a nul)
  RETURNS:
  ARGS: 
  NOTES:
+   Mirrors atoi, but will not read past the limit
  *********************************************************************/
-int read_GFF_line(FILE *file,
-		  GFF_line *line) {
+static int field_int_GFF( const char *p, const char *limit ) {
+  int val = 0;
+  boolean neg = FALSE;
 
-  char *fields[10];
-  int i, j;
-  int line_len = 0;
-  boolean got_line = FALSE;
+  while (p < limit && (*p == ' ' || (*p >= '\t' && *p <= '\r')))
+    p++;
+  if (p < limit && (*p == '-' || *p == '+'))
+    neg = (*p++ == '-');
+  while (p < limit && *p >= '0' && *p <= '9')
+    val = val * 10 + (*p++ - '0');
 
-  while( ! got_line && (line_len = read_Line( file, line->ln )) != 0)  {
+  return neg ? -val : val;
+}
 
-    if (line->ln->buf[0] != '#') {
-      fields[0] = line->ln->buf;
-      /* nullify 9th field, because it might not be present - first 8 will be */
-      fields[8] = NULL;
 
-      for (i=0, j=1; i < line_len && j < 9; i++) {
-	if (line->ln->buf[i] == '\t') {
-	  line->ln->buf[i] = '\0';
-	  fields[j++] = &(line->ln->buf[i+1]);
-	}
-      }
+/*********************************************************************
+ FUNCTION: field_double_GFF
+ DESCRIPTION:
+   Reads the (nul-terminated) number in the given text
+ RETURNS:
+ ARGS: 
+ NOTES:
+   Plain decimals of up to 15 significant digits (which covers the
+   scores of almost all GFF lines) are read directly: the digits and 
+   the power of ten are then exact doubles, so the one division is
+   rounded exactly as atof would round. Anything else goes to atof
+ *********************************************************************/
+static double field_double_GFF( const char *s ) {
+  static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 
+				  1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15 };
+  const char *p = s;
+  long long mant = 0;
+  int digits = 0, frac = 0;
+  boolean neg = FALSE;
+  double val;
+
+  if (*p == '-' || *p == '+')
+    neg = (*p++ == '-');
+  for (; *p >= '0' && *p <= '9' && digits <= 15; p++, digits++)
+    mant = mant * 10 + (*p - '0');
+  if (*p == '.')
+    for (p++; *p >= '0' && *p <= '9' && digits <= 15; p++, digits++, frac++)
+      mant = mant * 10 + (*p - '0');
+
+  if (digits == 0 || digits > 15 || *p != '\0')
+    return atof( s );
+
+  val = (double) mant / pow10[frac];
+
+  return neg ? -val : val;
+}
+
+
+/*********************************************************************
+ FUNCTION: read_GFF_line_for_seq
+ DESCRIPTION:
+   Reads the next GFF line of the given file for the given seqname 
+   (or any seqname if it is NULL), splitting it into its fields
+ RETURNS: the length of the line; 0 at the end of the file
+ ARGS: 
+ NOTES:
+   Lines for other seqnames are passed over before being split
+ *********************************************************************/
+int read_GFF_line_for_seq(FILE *file,
+			  GFF_line *line,
+			  const char *seqname) {
+
+  char *fields[9];
+  char *buf, *end, *tab;
+  int j, line_len;
+  size_t name_len = seqname != NULL ? strlen( seqname ) : 0;
 
-      line->seqname = fields[0];
-      line->source = fields[1];
-      line->type = fields[2];
-      line->start = atoi(fields[3]);
-      line->end = atoi(fields[4]);
-      line->score = atof(fields[5]);
-      line->strand = fields[6];
-      line->frame = fields[7];
-      line->group = fields[8];
-
-      got_line = TRUE;
+  while( (line_len = read_Line( file, line->ln )) != 0)  {
+    buf = line->ln->buf;
+    end = buf + line_len;
+
+    if (buf[0] == '#')
+      continue;
+
+    tab = memchr( buf, '\t', line_len );
+    if (seqname != NULL && 
+	(tab == NULL || tab - buf != name_len || memcmp( buf, seqname, name_len ) != 0))
+      continue;
+
+    fields[0] = buf;
+    /* missing fields are left empty, apart from the 9th, which is NULL */
+    for (j=1; j < 8; j++)
+      fields[j] = end;
+    fields[8] = NULL;
+
+    for (j=1; j < 9 && tab != NULL; j++) {
+      *tab = '\0';
+      fields[j] = tab + 1;
+      if (j < 8)
+	tab = memchr( tab + 1, '\t', end - tab - 1 );
     }
+
+    line->seqname = fields[0];
+    line->source = fields[1];
+    line->type = fields[2];
+    line->start = field_int_GFF( fields[3], end );
+    line->end = field_int_GFF( fields[4], end );
+    line->score = field_double_GFF( fields[5] );
+    line->strand = fields[6];
+    line->frame = fields[7];
+    line->group = fields[8];
+
+    return line_len;
   }
 
-  return line_len;
+  return 0;
+}
+
+
+/*********************************************************************
+ FUNCTION: read_GFF_line
+ DESCRIPTION:
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+int read_GFF_line(FILE *file,
+		  GFF_line *line) {
+
+  return read_GFF_line_for_seq( file, line, NULL );
 }
 
 
@@ -148,12 +264,13 @@ void write_GFF_line( FILE *fh,
 		     char *frame,
 		     char *group) {
 
-  fprintf( fh, "%s\t%s\t%s\t%d\t%d\t%.4f\t%s\t%s", 
+  fprintf( fh, "%s\t%s\t%s\t%d\t%d\t%.*f\t%s\t%s", 
 	   seq != NULL ? seq : "Not_given",
 	   source != NULL ? source : "Not_given",
 	   feature != NULL ? feature : "Not_given",
 	   start,
 	   end,
+	   GFF_SCORE_DIGITS,
 	   score,
 	   strand != NULL ? strand : ".",
 	   frame != NULL ? frame : "." );
@@ -179,3 +296,482 @@ void write_GFF_header( FILE *fh,
   fprintf( fh, "##gff-version 2\n");
   fprintf( fh, "##sequence-region %s %d %d\n", name, start, end );
 }
+
+
+
+/********************* GFF_Index *************************************/
+
+/*********************************************************************
+ FUNCTION: find_GFF_Index_Seq
+ DESCRIPTION:
+   Looks up the entry for the given seqname (which runs up to the
+   given terminator, or the end of the string)
+ RETURNS: the index of its slot in the table, which is empty if 
+   there is no such entry
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static int find_GFF_Index_Seq( GFF_Index *idx, const char *name, char term ) {
+  int len, slot = hash_string_util( name, term ) & (idx->table_size - 1);
+  GFF_Index_Seq *is;
+
+  for (len = 0; name[len] != term && name[len] != '\0'; len++);
+
+  while ((is = idx->table[slot]) != NULL) {
+    if (strncmp( is->seqname, name, len ) == 0 && is->seqname[len] == '\0')
+      break;
+    slot = (slot + 1) & (idx->table_size - 1);
+  }
+
+  return slot;
+}
+
+
+/*********************************************************************
+ FUNCTION: add_GFF_Index_Seq
+ DESCRIPTION:
+   Adds an entry for the given seqname, growing the table if need be
+ RETURNS: the new entry
+ ARGS: 
+ NOTES:
+   The name runs up to the given terminator
+ *********************************************************************/
+static GFF_Index_Seq *add_GFF_Index_Seq( GFF_Index *idx, const char *name, char term ) {
+  GFF_Index_Seq *is = (GFF_Index_Seq *) malloc_util( sizeof(GFF_Index_Seq) );
+  int i, len;
+
+  if (2 * (idx->num_seqs + 1) > idx->table_size) {
+    GFF_Index_Seq **old_table = idx->table;
+    int old_size = idx->table_size;
+
+    idx->table_size *= 2;
+    idx->table = (GFF_Index_Seq **) malloc0_util( idx->table_size * sizeof(GFF_Index_Seq *) );
+    for (i=0; i < old_size; i++)
+      if (old_table[i] != NULL)
+	idx->table[find_GFF_Index_Seq( idx, old_table[i]->seqname, '\0' )] = old_table[i];
+    free_util( old_table );
+  }
+
+  for (len = 0; name[len] != term && name[len] != '\0'; len++);
+  is->seqname = (char *) malloc_util( len + 1 );
+  memcpy( is->seqname, name, len );
+  is->seqname[len] = '\0';
+  is->blocks = new_Array( sizeof(GFF_Index_Block), TRUE );
+
+  idx->table[find_GFF_Index_Seq( idx, is->seqname, '\0' )] = is;
+  idx->num_seqs++;
+
+  return is;
+}
+
+
+/*********************************************************************
+ FUNCTION: free_GFF_Index
+ DESCRIPTION:
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static void free_GFF_Index( GFF_Index *idx ) {
+  int i;
+
+  if (idx != NULL) {
+    for (i=0; i < idx->table_size; i++) {
+      if (idx->table[i] != NULL) {
+	free_util( idx->table[i]->seqname );
+	free_Array( idx->table[i]->blocks, TRUE );
+	free_util( idx->table[i] );
+      }
+    }
+    free_util( idx->table );
+    if (idx->map != NULL)
+      munmap( idx->map, idx->size );
+    free_util( idx->file_name );
+    free_util( idx );
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: new_GFF_Index
+ DESCRIPTION:
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static GFF_Index *new_GFF_Index( char *file_name, long size, long mtime ) {
+  GFF_Index *idx = (GFF_Index *) malloc_util( sizeof(GFF_Index) );
+
+  idx->file_name = strdup_util( file_name );
+  idx->size = size;
+  idx->mtime = mtime;
+  idx->table_size = 64;
+  idx->table = (GFF_Index_Seq **) malloc0_util( idx->table_size * sizeof(GFF_Index_Seq *) );
+  idx->num_seqs = 0;
+  idx->map = NULL;
+
+  return idx;
+}
+
+
+/*********************************************************************
+ FUNCTION: build_GFF_Index
+ DESCRIPTION:
+   Fills in the given (empty) index from the mapped file
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static void build_GFF_Index( GFF_Index *idx ) {
+  const char *p = idx->map, *end = idx->map + idx->size;
+  GFF_Index_Seq *cur = NULL;
+  GFF_Index_Block *blk = NULL;
+  int lines_in_blk = 0;
+
+  while (p < end) {
+    const char *eol = memchr( p, '\n', end - p );
+    const char *tab, *field;
+    int f, start, stop;
+
+    if (eol == NULL)
+      eol = end;
+
+    /* lines with no fields (or comments) are not indexed */
+    if (eol > p && *p != '#' && (tab = memchr( p, '\t', eol - p )) != NULL) {
+      /* the start and end are in the 4th and 5th fields */
+      start = stop = 0;
+      for (field = tab, f = 1; field != NULL && f < 3; f++) 
+	field = memchr( field + 1, '\t', eol - field - 1 );
+      if (field != NULL) {
+	start = field_int_GFF( field + 1, eol );
+	if ((field = memchr( field + 1, '\t', eol - field - 1 )) != NULL)
+	  stop = field_int_GFF( field + 1, eol );
+      }
+
+      if (cur == NULL || lines_in_blk == GFF_INDEX_BLOCK_LINES ||
+	  strncmp( cur->seqname, p, tab - p ) != 0 || cur->seqname[tab - p] != '\0') {
+	GFF_Index_Block nb;
+
+	if ((cur = idx->table[find_GFF_Index_Seq( idx, p, '\t' )]) == NULL)
+	  cur = add_GFF_Index_Seq( idx, p, '\t' );
+
+	nb.offset = p - idx->map;
+	nb.len = 0;
+	nb.min_start = MIN( start, stop );
+	nb.max_end = MAX( start, stop );
+	append_val_Array( cur->blocks, nb );
+	blk = &(index_Array( cur->blocks, GFF_Index_Block, cur->blocks->len - 1 ));
+	lines_in_blk = 0;
+      }
+
+      /* the block runs on over any comments and blank lines */
+      blk->len = (eol - idx->map) - blk->offset;
+      blk->min_start = MIN( blk->min_start, MIN( start, stop ) );
+      blk->max_end = MAX( blk->max_end, MAX( start, stop ) );
+      lines_in_blk++;
+    }
+
+    p = eol + 1;
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: read_GFF_Index
+ DESCRIPTION:
+   Reads the sidecar index for the given index's file
+ RETURNS: TRUE if it was present and up to date
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static boolean read_GFF_Index( GFF_Index *idx, char *idx_name ) {
+  FILE *fh = fopen( idx_name, "rb" );
+  char magic[8];
+  int version, num_seqs, i, len, num_blocks;
+  long size, mtime;
+  boolean ok = FALSE;
+
+  if (fh == NULL)
+    return FALSE;
+
+  if (fread( magic, 1, 8, fh ) == 8 && memcmp( magic, GFF_INDEX_MAGIC, 8 ) == 0 &&
+      fread( &version, sizeof(int), 1, fh ) == 1 && version == GFF_INDEX_VERSION &&
+      fread( &size, sizeof(long), 1, fh ) == 1 && size == idx->size &&
+      fread( &mtime, sizeof(long), 1, fh ) == 1 && mtime == idx->mtime &&
+      fread( &num_seqs, sizeof(int), 1, fh ) == 1) {
+
+    ok = TRUE;
+    for (i=0; ok && i < num_seqs; i++) {
+      char *name;
+      GFF_Index_Seq *is;
+
+      if (fread( &len, sizeof(int), 1, fh ) != 1 || len < 0) {
+	ok = FALSE;
+	break;
+      }
+      name = (char *) malloc_util( len + 1 );
+      if (fread( name, 1, len, fh ) != (size_t) len)
+	ok = FALSE;
+      name[len] = '\0';
+
+      if (ok && fread( &num_blocks, sizeof(int), 1, fh ) == 1 && num_blocks >= 0) {
+	is = add_GFF_Index_Seq( idx, name, '\0' );
+	set_size_Array( is->blocks, num_blocks );
+	if (fread( is->blocks->data, sizeof(GFF_Index_Block), num_blocks, fh ) != (size_t) num_blocks)
+	  ok = FALSE;
+      }
+      else
+	ok = FALSE;
+
+      free_util( name );
+    }
+  }
+
+  fclose( fh );
+
+  return ok;
+}
+
+
+/*********************************************************************
+ FUNCTION: write_GFF_Index
+ DESCRIPTION:
+   Writes the sidecar index for the given index's file
+ RETURNS:
+ ARGS: 
+ NOTES:
+   The index is written to a temporary name and then moved into
+   place, so that a concurrent run never sees half of it. Failure
+   (e.g. for want of permission) is silent, since the index can
+   always be rebuilt
+ *********************************************************************/
+static void write_GFF_Index( GFF_Index *idx, char *idx_name ) {
+  char *tmp_name = (char *) malloc_util( strlen( idx_name ) + 32 );
+  int version = GFF_INDEX_VERSION, i, len;
+  boolean ok;
+  FILE *fh;
+
+  sprintf( tmp_name, "%s.%ld", idx_name, (long) getpid() );
+
+  if ((fh = fopen( tmp_name, "wb" )) != NULL) {
+    ok = fwrite( GFF_INDEX_MAGIC, 1, 8, fh ) == 8 &&
+      fwrite( &version, sizeof(int), 1, fh ) == 1 &&
+      fwrite( &(idx->size), sizeof(long), 1, fh ) == 1 &&
+      fwrite( &(idx->mtime), sizeof(long), 1, fh ) == 1 &&
+      fwrite( &(idx->num_seqs), sizeof(int), 1, fh ) == 1;
+
+    for (i=0; ok && i < idx->table_size; i++) {
+      GFF_Index_Seq *is = idx->table[i];
+      
+      if (is != NULL) {
+	len = strlen( is->seqname );
+	ok = fwrite( &len, sizeof(int), 1, fh ) == 1 &&
+	  fwrite( is->seqname, 1, len, fh ) == (size_t) len &&
+	  fwrite( &(is->blocks->len), sizeof(int), 1, fh ) == 1 &&
+	  fwrite( is->blocks->data, sizeof(GFF_Index_Block), is->blocks->len, fh ) == (size_t) is->blocks->len;
+      }
+    }
+
+    if (fclose( fh ) != 0)
+      ok = FALSE;
+    if (! ok || rename( tmp_name, idx_name ) != 0)
+      remove( tmp_name );
+  }
+
+  free_util( tmp_name );
+}
+
+
+/*********************************************************************
+ FUNCTION: get_GFF_Index
+ DESCRIPTION:
+   Finds the index for the given file, reading it from its sidecar 
+   file, or building (and saving) it if that is missing or stale
+ RETURNS: the index, or NULL if the file cannot be mapped (e.g. it
+   is not a regular file)
+ ARGS: 
+ NOTES:
+   Must be called with the cache locked
+ *********************************************************************/
+static GFF_Index *get_GFF_Index( char *file_name ) {
+  GFF_Index *idx;
+  struct stat st;
+  char *idx_name;
+  long mtime;
+  int i, fd;
+
+  if (gffIndexCache.indices == NULL)
+    gffIndexCache.indices = new_Array( sizeof(GFF_Index *), TRUE );
+
+  for (i=0; i < gffIndexCache.indices->len; i++) {
+    idx = index_Array( gffIndexCache.indices, GFF_Index *, i );
+    if (strcmp( idx->file_name, file_name ) == 0)
+      return idx;
+  }
+
+  if ((fd = open( file_name, O_RDONLY )) < 0)
+    return NULL;
+  if (fstat( fd, &st ) != 0 || ! S_ISREG( st.st_mode )) {
+    close( fd );
+    return NULL;
+  }
+
+  /* to the nanosecond, so that quick successive edits are noticed */
+  mtime = (long) st.st_mtim.tv_sec * 1000000000L + (long) st.st_mtim.tv_nsec;
+
+  idx = new_GFF_Index( file_name, (long) st.st_size, mtime );
+  if (idx->size > 0) {
+    if ((idx->map = mmap( NULL, idx->size, PROT_READ, MAP_PRIVATE, fd, 0 )) == MAP_FAILED) {
+      idx->map = NULL;
+      free_GFF_Index( idx );
+      close( fd );
+      return NULL;
+    }
+  }
+  close( fd );
+
+  idx_name = (char *) malloc_util( strlen( file_name ) + strlen( GFF_INDEX_SUFFIX ) + 1 );
+  sprintf( idx_name, "%s%s", file_name, GFF_INDEX_SUFFIX );
+
+  if (! read_GFF_Index( idx, idx_name )) {
+    /* start again from an empty table */
+    char *map = idx->map;
+
+    idx->map = NULL;
+    free_GFF_Index( idx );
+    idx = new_GFF_Index( file_name, (long) st.st_size, mtime );
+    idx->map = map;
+
+    build_GFF_Index( idx );
+    write_GFF_Index( idx, idx_name );
+  }
+  free_util( idx_name );
+
+  append_val_Array( gffIndexCache.indices, idx );
+
+  return idx;
+}
+
+
+/*********************************************************************
+ FUNCTION: use_GFF_Index
+ DESCRIPTION:
+   Turns the use of the sidecar indices by open_GFF_lines on or off
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+void use_GFF_Index( boolean enabled ) {
+  gffIndexCache.enabled = enabled;
+}
+
+
+/*********************************************************************
+ FUNCTION: free_GFF_Index_cache
+ DESCRIPTION:
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+void free_GFF_Index_cache( void ) {
+  int i;
+
+  pthread_mutex_lock( &gffIndexCache.lock );
+  if (gffIndexCache.indices != NULL) {
+    for (i=0; i < gffIndexCache.indices->len; i++)
+      free_GFF_Index( index_Array( gffIndexCache.indices, GFF_Index *, i ) );
+    free_Array( gffIndexCache.indices, TRUE );
+    gffIndexCache.indices = NULL;
+  }
+  pthread_mutex_unlock( &gffIndexCache.lock );
+}
+
+
+/*********************************************************************
+ FUNCTION: open_GFF_lines
+ DESCRIPTION:
+   Opens the given GFF file for reading with read_GFF_line. When the
+   sidecar indices are in use, only the lines for the given seqname 
+   are read, or rather those of them in the blocks that overlap the 
+   given region (others may still be read, so the caller must check)
+ RETURNS: the file handle, or NULL if the file has no lines for the
+   given region (or cannot be opened)
+ ARGS: 
+   buf: set to the buffer behind the handle, if any, to be passed
+     to close_GFF_lines
+   has_seq: set to TRUE if the index shows that the file has lines
+     for the sequence (in the region or not)
+ NOTES:
+ *********************************************************************/
+FILE *open_GFF_lines( char *file_name, 
+		      char *seqname, 
+		      int start, 
+		      int end, 
+		      char **buf,
+		      boolean *has_seq ) {
+  GFF_Index *idx = NULL;
+  GFF_Index_Seq *is;
+  FILE *fh = NULL;
+  long total;
+  int b;
+
+  *buf = NULL;
+  *has_seq = FALSE;
+
+  if (gffIndexCache.enabled) {
+    pthread_mutex_lock( &gffIndexCache.lock );
+    idx = get_GFF_Index( file_name );
+    pthread_mutex_unlock( &gffIndexCache.lock );
+  }
+
+  if (idx == NULL)
+    return fopen( file_name, "r" );
+
+  if ((is = idx->table[find_GFF_Index_Seq( idx, seqname, '\0' )]) == NULL)
+    return NULL;
+  *has_seq = TRUE;
+
+  /* the lines are gathered (each block ends with a newline) */
+  for (total = 0, b=0; b < is->blocks->len; b++) {
+    GFF_Index_Block *blk = &(index_Array( is->blocks, GFF_Index_Block, b ));
+
+    if (blk->min_start <= end && blk->max_end >= start)
+      total += blk->len + 1;
+  }
+
+  if (total > 0) {
+    *buf = (char *) malloc_util( total );
+
+    for (total = 0, b=0; b < is->blocks->len; b++) {
+      GFF_Index_Block *blk = &(index_Array( is->blocks, GFF_Index_Block, b ));
+
+      if (blk->min_start <= end && blk->max_end >= start) {
+	memcpy( *buf + total, idx->map + blk->offset, blk->len );
+	(*buf)[total + blk->len] = '\n';
+	total += blk->len + 1;
+      }
+    }
+
+    if ((fh = fmemopen( *buf, total, "r" )) == NULL) {
+      free_util( *buf );
+      *buf = NULL;
+    }
+  }
+
+  return fh;
+}
+
+
+/*********************************************************************
+ FUNCTION: close_GFF_lines
+ DESCRIPTION:
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+void close_GFF_lines( FILE *fh, char *buf ) {
+
+  fclose( fh );
+  if (buf != NULL)
+    free_util( buf );
+}
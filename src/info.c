@@ -270,53 +270,209 @@ Feature_Relation *new_Feature_Relation(void) {
 }
 
 
+/*********************************************************************
+ FUNCTION: free_Compiled_Relation_contents
+ DESCRIPTION:
+   Frees the storage held by the given Compiled_Relation (which
+   itself lives in a table, so is not freed)
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+void free_Compiled_Relation_contents(Compiled_Relation *c_rel) {
+  if (c_rel->seg_types != NULL) {
+    free_util( c_rel->seg_types );
+    c_rel->seg_types = NULL;
+  }
+  if (c_rel->danger_src_dna != NULL) {
+    /* the four sets share one block */
+    free_util( c_rel->danger_src_dna );
+    c_rel->danger_src_dna = c_rel->danger_tgt_dna = NULL;
+    c_rel->killer_src_dna = c_rel->killer_tgt_dna = NULL;
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: compile_Feature_Relation
+ DESCRIPTION:
+   Fills in the given Compiled_Relation from the given relation
+   (which may be NULL, for an illegal source-target pair)
+ RETURNS:
+ ARGS: 
+   The list of length functions, for resolving the reference
+   The number of DNA motifs, for sizing the DNA killer sets
+ NOTES:
+   The relation must be complete, i.e. this must be done after
+   the global qualifiers of the target have been propagated
+ *********************************************************************/
+void compile_Feature_Relation(Compiled_Relation *c_rel,
+			      Feature_Relation *rel,
+			      Array *length_funcs,
+			      int num_motifs) {
+  int i;
+
+  c_rel->rel = rel;
+  c_rel->min_dist = NO_MIN_DIST;
+  c_rel->max_dist = NO_MAX_DIST;
+  c_rel->phase = NO_PHASE;
+  c_rel->len_fun = NULL;
+  c_rel->flags = 0;
+  c_rel->num_seg_types = 0;
+  c_rel->seg_types = NULL;
+  c_rel->dna_set_words = DNA_SET_WORDS( num_motifs );
+  c_rel->danger_src_dna = c_rel->danger_tgt_dna = NULL;
+  c_rel->killer_src_dna = c_rel->killer_tgt_dna = NULL;
+
+  if (rel == NULL)
+    return;
+
+  if (rel->min_dist != NULL)
+    c_rel->min_dist = *(rel->min_dist);
+  if (rel->max_dist != NULL)
+    c_rel->max_dist = *(rel->max_dist);
+  if (rel->phase != NULL)
+    c_rel->phase = *(rel->phase);
+  if (rel->len_fun != NULL)
+    c_rel->len_fun = index_Array( length_funcs, Length_Function *, *(rel->len_fun) );
+
+  if (rel->seg_quals != NULL) {
+    for (i=0; i < rel->seg_quals->len; i++) {
+      Segment_Qualifier *qual = index_Array( rel->seg_quals, Segment_Qualifier *, i );
+
+      if (qual != NULL) {
+	int j, k;
+
+	c_rel->flags |= REL_HAS_SEGS;
+	if (qual->is_exact_src || qual->is_exact_tgt)
+	  c_rel->flags |= REL_HAS_EXACT_SEGS;
+
+	/* insert into the ordered set of segment types */
+	for (j=0; j < c_rel->num_seg_types && c_rel->seg_types[j] < qual->seg_idx; j++);
+	if (j == c_rel->num_seg_types || c_rel->seg_types[j] != qual->seg_idx) {
+	  if (c_rel->seg_types == NULL)
+	    c_rel->seg_types = (int *) malloc_util( rel->seg_quals->len * sizeof(int) );
+	  for (k=c_rel->num_seg_types; k > j; k--)
+	    c_rel->seg_types[k] = c_rel->seg_types[k-1];
+	  c_rel->seg_types[j] = qual->seg_idx;
+	  c_rel->num_seg_types++;
+	}
+      }
+    }
+  }
+  if (rel->kill_feat_quals != NULL)
+    c_rel->flags |= REL_HAS_KILLERS;
+  if (rel->kill_dna_quals != NULL && num_motifs > 0) {
+    int words = c_rel->dna_set_words;
+    unsigned int *sets;
+
+    c_rel->flags |= REL_HAS_DNA_KILLERS;
+
+    sets = (unsigned int *) malloc0_util( (2 + 2 * num_motifs) * words * sizeof(unsigned int) );
+    c_rel->danger_src_dna = sets;
+    c_rel->danger_tgt_dna = sets + words;
+    c_rel->killer_src_dna = sets + 2 * words;
+    c_rel->killer_tgt_dna = sets + (2 + num_motifs) * words;
+
+    for (i=0; i < rel->kill_dna_quals->len; i++) {
+      Killer_DNA_Qualifier *kdq = index_Array( rel->kill_dna_quals, 
+					       Killer_DNA_Qualifier *,
+					       i );
+      int s = kdq->src_dna;
+      int t = kdq->tgt_dna;
+
+      c_rel->danger_src_dna[s >> 5] |= 1u << (s & 31);
+      c_rel->danger_tgt_dna[t >> 5] |= 1u << (t & 31);
+      c_rel->killer_src_dna[t * words + (s >> 5)] |= 1u << (s & 31);
+      c_rel->killer_tgt_dna[s * words + (t >> 5)] |= 1u << (t & 31);
+    }
+  }
+}
+
+
 
 
 /************** Length_Function **********************/
 
+/*********************************************************************
+ FUNCTION: interpolate_Length_Function
+ DESCRIPTION:
+   Works out the (unscaled) value of the function at the given 
+   distance, which must be before its last point, from the line 
+   between the points either side
+ RETURNS: the value
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static double interpolate_Length_Function( Length_Function *len_fun, int x ) {
+  int left, right, x1;
+
+  /* find the last point at or before x; the one after it must then 
+     be beyond x */
+
+  left = 0;
+  right = len_fun->raw_x_vals->len;
+  while (left < right) {
+    int mid = (left + right) / 2;
+    
+    if (index_Array( len_fun->raw_x_vals, int, mid ) <= x)
+      left = mid + 1;
+    else
+      right = mid;
+  }
+  
+  if (left == 0)
+    return 0.0;
+
+  x1 = index_Array( len_fun->raw_x_vals, int, left - 1 );
+
+  return index_Array( len_fun->raw_y_vals, double, left - 1 ) + 
+    ((x - x1) * index_Array( len_fun->slopes, double, left - 1 ));
+}
+
+
 /*********************************************************************
  FUNCTION: calc_Length_Function
  DESCRIPTION:
+   Prepares the given length function for use from its points; the
+   values for short distances are tabulated, and the rest are 
+   worked out when needed
  RETURNS:
  ARGS: 
  NOTES:
  *********************************************************************/
 void calc_Length_Function(Length_Function *len_fun) {
-  int last_x;
-  int point_ctr, fctr;
+  int point_ctr, fctr, dense_len;
   int x1, x2;
-  double y1, y2, dy_by_dx;
+  double y1, y2;
 
   if (len_fun->raw_x_vals->len &&
       (len_fun->raw_x_vals->len == len_fun->raw_y_vals->len)) {
 
-    last_x = index_Array( len_fun->raw_x_vals,
-			    int,
-			    len_fun->raw_x_vals->len - 1);
-    len_fun->value_map = new_Array( sizeof( double ), TRUE );
-    set_size_Array( len_fun->value_map, last_x + 1 );
-    
+    len_fun->last_x = index_Array( len_fun->raw_x_vals,
+				   int,
+				   len_fun->raw_x_vals->len - 1);
 
-    point_ctr = 1;
-    x1 = index_Array( len_fun->raw_x_vals, int, point_ctr - 1);
-    y1 = index_Array( len_fun->raw_y_vals, double, point_ctr - 1);
-	
-    /* first, initialize all points up to x1 */
+    /* the slope from each point to the next, and where the function
+       starts to rise for good */
 
-    for (fctr=0; fctr < x1; fctr++) {
-      index_Array( len_fun->value_map, double, fctr ) = 0.0;
-    }
-	
-    while (fctr < last_x) {
+    len_fun->slopes = new_Array( sizeof( double ), TRUE );
+    set_size_Array( len_fun->slopes, len_fun->raw_x_vals->len );
+    for (point_ctr = 0; point_ctr < len_fun->slopes->len; point_ctr++)
+      index_Array( len_fun->slopes, double, point_ctr ) = 0.0;
+
+    x1 = index_Array( len_fun->raw_x_vals, int, 0);
+    y1 = index_Array( len_fun->raw_y_vals, double, 0);
+
+    /* the function ends at the first point reaching the last x; 
+       any others there are ignored */
+
+    for (point_ctr = 1; x1 < len_fun->last_x && point_ctr < len_fun->raw_x_vals->len; point_ctr++) {
       x2 = index_Array( len_fun->raw_x_vals, int, point_ctr );
       y2 = index_Array( len_fun->raw_y_vals, double, point_ctr );
 
-      dy_by_dx = (y2 - y1) / ((double) x2 - (double) x1);
-      while (fctr < x2) {
-	index_Array( len_fun->value_map, double, fctr ) = 
-	  y1 + ((fctr - x1) * dy_by_dx);
-	fctr++;
-      }
+      index_Array( len_fun->slopes, double, point_ctr - 1 ) = 
+	(y2 - y1) / ((double) x2 - (double) x1);
 	
       if (y2 >= y1) {
 	if (! len_fun->becomes_monotonic ) {
@@ -329,13 +485,21 @@ void calc_Length_Function(Length_Function *len_fun) {
       
       x1 = x2;
       y1 = y2;
-      point_ctr++;
     }
+    len_fun->last_val = y1;
+    len_fun->before_last_val = interpolate_Length_Function( len_fun, len_fun->last_x - 1 );
+    len_fun->scale = 1.0;
 
-    /* finally, initialise the remaining point */
+    /* then the table for short distances */
 
-    index_Array( len_fun->value_map, double, fctr ) = y1; 
-      
+    dense_len = (len_fun->last_x < LEN_FUN_DENSE_LEN) ? 
+      len_fun->last_x + 1 : LEN_FUN_DENSE_LEN;
+
+    len_fun->value_map = new_Array( sizeof( double ), TRUE );
+    set_size_Array( len_fun->value_map, dense_len );
+    for (fctr=0; fctr < dense_len; fctr++)
+      index_Array( len_fun->value_map, double, fctr ) = (fctr < len_fun->last_x) ?
+	interpolate_Length_Function( len_fun, fctr ) : len_fun->last_val;
   }
 }
 
@@ -359,6 +523,9 @@ void free_Length_Function(Length_Function *len_fun) {
     if (len_fun->raw_y_vals != NULL) {
       free_Array( len_fun->raw_y_vals, TRUE );
     }
+    if (len_fun->slopes != NULL) {
+      free_Array( len_fun->slopes, TRUE );
+    }
     
     free_util( len_fun );
   }
@@ -380,6 +547,10 @@ Length_Function *new_Length_Function( double multiplier) {
   temp->value_map = NULL;
   temp->raw_x_vals = new_Array( sizeof(int), TRUE );
   temp->raw_y_vals = new_Array( sizeof(double), TRUE );
+  temp->slopes = NULL;
+  temp->last_x = 0;
+  temp->last_val = temp->before_last_val = 0.0;
+  temp->scale = 1.0;
   temp->multiplier = multiplier;
   temp->becomes_monotonic = TRUE;
   temp->monotonic_point = 0;
@@ -395,6 +566,8 @@ Length_Function *new_Length_Function( double multiplier) {
  RETURNS:
  ARGS: 
  NOTES:
+   Only the table of short distances and the values at the end are
+   scaled here; the rest are scaled as they are worked out
  *********************************************************************/
 void scale_Length_Function(Length_Function *lf, double scaling) {
   int i;
@@ -403,7 +576,31 @@ void scale_Length_Function(Length_Function *lf, double scaling) {
     index_Array( lf->value_map, double, i ) = 
       index_Array( lf->value_map, double, i ) * scaling;
   }
+  lf->last_val *= scaling;
+  lf->before_last_val *= scaling;
+  lf->scale *= scaling;
+}
+
+
+
+/*********************************************************************
+ FUNCTION: value_Length_Function
+ DESCRIPTION:
+   The value of the given length function at a distance beyond 
+   its table (see apply_Length_Function)
+ RETURNS: the value
+ ARGS: 
+ NOTES:
+   Beyond the last point, the function continues in a straight 
+   line, with the slope it had just before it
+ *********************************************************************/
+double value_Length_Function(Length_Function *lf, int n) {
 
+  if (n < lf->last_x)
+    return interpolate_Length_Function( lf, n ) * lf->scale;
+  else 
+    return (lf->last_val * (1 + n - lf->last_x)) - 
+      (lf->before_last_val * (n - lf->last_x));
 }
 
 
@@ -643,6 +840,8 @@ Segment_Info *new_Segment_Info(double mul) {
   temp->use_projected = FALSE;
   temp->score_sum = FALSE;
   temp->partial = FALSE;
+  temp->prefix_framed = FALSE;
+  temp->prefix_unframed = FALSE;
 
   return temp;
 }
@@ -0,0 +1,462 @@
+/**********************************************************************
+ ** File: logsum.c
+ * Author: Kevin Howe
+ * Copyright (C) Genome Research Limited, 2002-
+ *-------------------------------------------------------------------
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *-------------------------------------------------------------------
+ * Author : Kevin Howe
+ * E-mail : klh@sanger.ac.uk
+ * Description : Summation of log-space scores for the dp
+ **********************************************************************/
+#include "logsum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LOGSUM_X86
+#endif
+
+
+/* The fast exp: x = n.ln2 + r, with |r| <= ln2/2, so that
+   exp(x) = 2^n.exp(r). The ln2 split is that of fdlibm, so that
+   n.LN2_HI is exact for all n of interest. exp(r) is computed with
+   the degree 12 Taylor polynomial, whose truncation error is below
+   2e-16 relative on the reduced range. Arguments below EXP_MIN give
+   zero; they are smaller than the largest term by a factor of more
+   than e^700, so cannot contribute to the sum */
+
+#define LOG2E   1.44269504088896338700e+00
+#define LN2_HI  6.93147180369123816490e-01
+#define LN2_LO  1.90821492927058770002e-10
+#define EXP_MIN -708.0
+#define ROUND_MAGIC 6755399441055744.0  /* 1.5 * 2^52 */
+
+#define EXP_C2  (1.0/2.0)
+#define EXP_C3  (1.0/6.0)
+#define EXP_C4  (1.0/24.0)
+#define EXP_C5  (1.0/120.0)
+#define EXP_C6  (1.0/720.0)
+#define EXP_C7  (1.0/5040.0)
+#define EXP_C8  (1.0/40320.0)
+#define EXP_C9  (1.0/362880.0)
+#define EXP_C10 (1.0/3628800.0)
+#define EXP_C11 (1.0/39916800.0)
+#define EXP_C12 (1.0/479001600.0)
+
+
+/* the kernels return sum_i exp( vals[i] - max ) */
+
+typedef double (*Sum_Exp_Kernel)( double *, int, double );
+
+static Sum_Exp_Kernel sum_exp_kernel = NULL;
+static char *sum_exp_kernel_name = "libm";
+static boolean use_fast_exp_one = FALSE;
+
+
+/*********************************************************************
+ FUNCTION: sum_exp_libm
+ DESCRIPTION:
+   The reference kernel; exactly the summation that the dp has
+   always done
+ RETURNS:
+ ARGS:
+ NOTES:
+ *********************************************************************/
+static double sum_exp_libm( double *vals, int n, double max ) {
+  double sum = 0.0;
+  int i;
+
+  for (i=0; i < n; i++)
+    sum += exp( vals[i] - max );
+
+  return sum;
+}
+
+
+/*********************************************************************
+ FUNCTION: fast_exp
+ DESCRIPTION:
+   Scalar version of the fast exp (see above)
+ RETURNS:
+ ARGS:
+ NOTES:
+ *********************************************************************/
+static double fast_exp( double x ) {
+  union { double d; long long i; } scale;
+  double n, r, p;
+
+  if (x < EXP_MIN)
+    return 0.0;
+
+  n = (x * LOG2E + ROUND_MAGIC) - ROUND_MAGIC;
+  r = (x - n * LN2_HI) - n * LN2_LO;
+
+  p = EXP_C12;
+  p = p * r + EXP_C11;
+  p = p * r + EXP_C10;
+  p = p * r + EXP_C9;
+  p = p * r + EXP_C8;
+  p = p * r + EXP_C7;
+  p = p * r + EXP_C6;
+  p = p * r + EXP_C5;
+  p = p * r + EXP_C4;
+  p = p * r + EXP_C3;
+  p = p * r + EXP_C2;
+  p = p * r + 1.0;
+  p = p * r + 1.0;
+
+  scale.i = ((long long) n + 1023) << 52;
+
+  return p * scale.d;
+}
+
+
+/*********************************************************************
+ FUNCTION: sum_exp_fast_scalar
+ DESCRIPTION:
+   Fast exp kernel for machines with no vector unit that we know of
+ RETURNS:
+ ARGS:
+ NOTES:
+ *********************************************************************/
+static double sum_exp_fast_scalar( double *vals, int n, double max ) {
+  double sum = 0.0;
+  int i;
+
+  for (i=0; i < n; i++)
+    sum += fast_exp( vals[i] - max );
+
+  return sum;
+}
+
+
+#ifdef LOGSUM_X86
+
+/*********************************************************************
+ FUNCTION: sum_exp_sse2
+ DESCRIPTION:
+   Fast exp kernel, two terms at a time
+ RETURNS:
+ ARGS:
+ NOTES:
+ *********************************************************************/
+__attribute__((target("sse2")))
+static double sum_exp_sse2( double *vals, int n, double max ) {
+  __m128d acc = _mm_setzero_pd();
+  __m128d vmax = _mm_set1_pd( max );
+  __m128d vmin = _mm_set1_pd( EXP_MIN );
+  __m128d magic = _mm_set1_pd( ROUND_MAGIC );
+  __m128i bias = _mm_set1_epi32( 1023 );
+  double lanes[2];
+  int i;
+
+  for (i=0; i + 2 <= n; i += 2) {
+    __m128d x = _mm_sub_pd( _mm_loadu_pd( &(vals[i]) ), vmax );
+    __m128d keep = _mm_cmpge_pd( x, vmin );
+    __m128d nd, r, p, scale;
+    __m128i ni;
+
+    x = _mm_max_pd( x, vmin );
+    nd = _mm_sub_pd( _mm_add_pd( _mm_mul_pd( x, _mm_set1_pd( LOG2E ) ), magic ), magic );
+    r = _mm_sub_pd( _mm_sub_pd( x, _mm_mul_pd( nd, _mm_set1_pd( LN2_HI ) ) ),
+		    _mm_mul_pd( nd, _mm_set1_pd( LN2_LO ) ) );
+
+    p = _mm_set1_pd( EXP_C12 );
+    p = _mm_add_pd( _mm_mul_pd( p, r ), _mm_set1_pd( EXP_C11 ) );
+    p = _mm_add_pd( _mm_mul_pd( p, r ), _mm_set1_pd( EXP_C10 ) );
+    p = _mm_add_pd( _mm_mul_pd( p, r ), _mm_set1_pd( EXP_C9 ) );
+    p = _mm_add_pd( _mm_mul_pd( p, r ), _mm_set1_pd( EXP_C8 ) );
+    p = _mm_add_pd( _mm_mul_pd( p, r ), _mm_set1_pd( EXP_C7 ) );
+    p = _mm_add_pd( _mm_mul_pd( p, r ), _mm_set1_pd( EXP_C6 ) );
+    p = _mm_add_pd( _mm_mul_pd( p, r ), _mm_set1_pd( EXP_C5 ) );
+    p = _mm_add_pd( _mm_mul_pd( p, r ), _mm_set1_pd( EXP_C4 ) );
+    p = _mm_add_pd( _mm_mul_pd( p, r ), _mm_set1_pd( EXP_C3 ) );
+    p = _mm_add_pd( _mm_mul_pd( p, r ), _mm_set1_pd( EXP_C2 ) );
+    p = _mm_add_pd( _mm_mul_pd( p, r ), _mm_set1_pd( 1.0 ) );
+    p = _mm_add_pd( _mm_mul_pd( p, r ), _mm_set1_pd( 1.0 ) );
+
+    /* 2^n, built directly in the exponent field; n + 1023 is positive */
+    ni = _mm_add_epi32( _mm_cvtpd_epi32( nd ), bias );
+    ni = _mm_unpacklo_epi32( ni, _mm_setzero_si128() );
+    scale = _mm_castsi128_pd( _mm_slli_epi64( ni, 52 ) );
+
+    acc = _mm_add_pd( acc, _mm_and_pd( _mm_mul_pd( p, scale ), keep ) );
+  }
+
+  _mm_storeu_pd( lanes, acc );
+
+  return lanes[0] + lanes[1] + sum_exp_fast_scalar( &(vals[i]), n - i, max );
+}
+
+
+/*********************************************************************
+ FUNCTION: sum_exp_avx2
+ DESCRIPTION:
+   Fast exp kernel, four terms at a time
+ RETURNS:
+ ARGS:
+ NOTES:
+ *********************************************************************/
+__attribute__((target("avx2")))
+static double sum_exp_avx2( double *vals, int n, double max ) {
+  __m256d acc = _mm256_setzero_pd();
+  __m256d vmax = _mm256_set1_pd( max );
+  __m256d vmin = _mm256_set1_pd( EXP_MIN );
+  __m256d magic = _mm256_set1_pd( ROUND_MAGIC );
+  __m128i bias = _mm_set1_epi32( 1023 );
+  double lanes[4];
+  int i;
+
+  for (i=0; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_sub_pd( _mm256_loadu_pd( &(vals[i]) ), vmax );
+    __m256d keep = _mm256_cmp_pd( x, vmin, _CMP_GE_OQ );
+    __m256d nd, r, p, scale;
+    __m256i ni;
+
+    x = _mm256_max_pd( x, vmin );
+    nd = _mm256_sub_pd( _mm256_add_pd( _mm256_mul_pd( x, _mm256_set1_pd( LOG2E ) ), magic ), magic );
+    r = _mm256_sub_pd( _mm256_sub_pd( x, _mm256_mul_pd( nd, _mm256_set1_pd( LN2_HI ) ) ),
+		       _mm256_mul_pd( nd, _mm256_set1_pd( LN2_LO ) ) );
+
+    p = _mm256_set1_pd( EXP_C12 );
+    p = _mm256_add_pd( _mm256_mul_pd( p, r ), _mm256_set1_pd( EXP_C11 ) );
+    p = _mm256_add_pd( _mm256_mul_pd( p, r ), _mm256_set1_pd( EXP_C10 ) );
+    p = _mm256_add_pd( _mm256_mul_pd( p, r ), _mm256_set1_pd( EXP_C9 ) );
+    p = _mm256_add_pd( _mm256_mul_pd( p, r ), _mm256_set1_pd( EXP_C8 ) );
+    p = _mm256_add_pd( _mm256_mul_pd( p, r ), _mm256_set1_pd( EXP_C7 ) );
+    p = _mm256_add_pd( _mm256_mul_pd( p, r ), _mm256_set1_pd( EXP_C6 ) );
+    p = _mm256_add_pd( _mm256_mul_pd( p, r ), _mm256_set1_pd( EXP_C5 ) );
+    p = _mm256_add_pd( _mm256_mul_pd( p, r ), _mm256_set1_pd( EXP_C4 ) );
+    p = _mm256_add_pd( _mm256_mul_pd( p, r ), _mm256_set1_pd( EXP_C3 ) );
+    p = _mm256_add_pd( _mm256_mul_pd( p, r ), _mm256_set1_pd( EXP_C2 ) );
+    p = _mm256_add_pd( _mm256_mul_pd( p, r ), _mm256_set1_pd( 1.0 ) );
+    p = _mm256_add_pd( _mm256_mul_pd( p, r ), _mm256_set1_pd( 1.0 ) );
+
+    ni = _mm256_cvtepi32_epi64( _mm_add_epi32( _mm256_cvtpd_epi32( nd ), bias ) );
+    scale = _mm256_castsi256_pd( _mm256_slli_epi64( ni, 52 ) );
+
+    acc = _mm256_add_pd( acc, _mm256_and_pd( _mm256_mul_pd( p, scale ), keep ) );
+  }
+
+  _mm256_storeu_pd( lanes, acc );
+
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3])
+    + sum_exp_fast_scalar( &(vals[i]), n - i, max );
+}
+
+#endif
+
+
+/*********************************************************************
+ FUNCTION: init_log_sum_exp
+ DESCRIPTION:
+   Chooses the kernel for log_sum_exp. Without the fast exp, the libm
+   kernel is used, and the results are exactly as they always were.
+   With it, the widest vector kernel that the machine supports is
+   chosen at run time.
+ RETURNS:
+ ARGS:
+   Whether to use the fast exp
+ NOTES:
+   Must be called before any threads are started
+ *********************************************************************/
+void init_log_sum_exp( boolean use_fast_exp ) {
+
+  sum_exp_kernel = &sum_exp_libm;
+  sum_exp_kernel_name = "libm";
+  use_fast_exp_one = use_fast_exp;
+
+  if (use_fast_exp) {
+    sum_exp_kernel = &sum_exp_fast_scalar;
+    sum_exp_kernel_name = "fast exp, scalar";
+
+#ifdef LOGSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports( "avx2" )) {
+      sum_exp_kernel = &sum_exp_avx2;
+      sum_exp_kernel_name = "fast exp, AVX2";
+    }
+    else if (__builtin_cpu_supports( "sse2" )) {
+      sum_exp_kernel = &sum_exp_sse2;
+      sum_exp_kernel_name = "fast exp, SSE2";
+    }
+#endif
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: log_sum_exp_kernel_name
+ DESCRIPTION:
+ RETURNS: A description of the kernel in use, for -verbose
+ ARGS:
+ NOTES:
+ *********************************************************************/
+char *log_sum_exp_kernel_name( void ) {
+  return sum_exp_kernel_name;
+}
+
+
+/*********************************************************************
+ FUNCTION: log_sum_exp
+ DESCRIPTION:
+   Returns log( sum_i exp( vals[i] ) ), given the max of the values.
+   Subtracting the max before exponentiating avoids overflow; it is
+   added back after taking the log
+ RETURNS:
+ ARGS:
+   The values, the number of them, and their max
+ NOTES:
+ *********************************************************************/
+double log_sum_exp( double *vals, int n, double max ) {
+
+  if (sum_exp_kernel == NULL)
+    sum_exp_kernel = &sum_exp_libm;
+
+  return log( (*sum_exp_kernel)( vals, n, max ) ) + max;
+}
+
+
+/*********************************************************************
+ FUNCTION: check_log_sum_exp
+ DESCRIPTION:
+   Compares the kernel in use with the libm kernel, for a spread
+   of lengths and of values typical of the dp (including the odd
+   very small one)
+ RETURNS: The largest absolute difference in log_sum_exp
+ ARGS:
+ NOTES:
+   Uses its own generator, so as not to disturb rand()
+ *********************************************************************/
+double check_log_sum_exp( void ) {
+  unsigned int state = 12345;
+  double vals[257];
+  double max = 0.0, diff, max_diff = 0.0;
+  int trial, n, i;
+
+  for (trial=0; trial < 2000; trial++) {
+    n = 1 + trial % 257;
+
+    for (i=0; i < n; i++) {
+      state = state * 1103515245 + 12345;
+      vals[i] = -60.0 * (double) (state >> 8) / (double) (1 << 24) + 20.0;
+      if (i % 37 == 36)
+	vals[i] = -1.0e7;
+      if (i == 0 || vals[i] > max)
+	max = vals[i];
+    }
+
+    diff = fabs( log_sum_exp( vals, n, max ) - ( log( sum_exp_libm( vals, n, max ) ) + max ) );
+    if (diff > max_diff)
+      max_diff = diff;
+  }
+
+  return max_diff;
+}
+
+
+
+/*********************************************************************
+ FUNCTION: clear_Log_Sum_Exp
+ DESCRIPTION:
+   Empties the given accumulator
+ RETURNS:
+ ARGS:
+ NOTES:
+ *********************************************************************/
+void clear_Log_Sum_Exp( Log_Sum_Exp *lse ) {
+  lse->max = 0.0;
+  lse->sum = 0.0;
+  lse->batch_len = 0;
+}
+
+
+/*********************************************************************
+ FUNCTION: flush_Log_Sum_Exp
+ DESCRIPTION:
+   Sums the scores batched up in the given accumulator with the 
+   kernel in use, and folds the result into the running sum
+ RETURNS:
+ ARGS:
+ NOTES:
+   The batch is summed relative to its own max, and the smaller of
+   that and the running max is rescaled to the larger, as in 
+   add_Log_Sum_Exp
+ *********************************************************************/
+static void flush_Log_Sum_Exp( Log_Sum_Exp *lse ) {
+  double max, sum;
+  int i;
+
+  if (lse->batch_len == 0)
+    return;
+
+  for (max = lse->batch[0], i=1; i < lse->batch_len; i++)
+    if (lse->batch[i] > max)
+      max = lse->batch[i];
+  sum = (*sum_exp_kernel)( lse->batch, lse->batch_len, max );
+  lse->batch_len = 0;
+
+  if (lse->sum == 0.0) {
+    lse->max = max;
+    lse->sum = sum;
+  }
+  else if (max <= lse->max)
+    lse->sum += sum * fast_exp( max - lse->max );
+  else {
+    lse->sum = lse->sum * fast_exp( lse->max - max ) + sum;
+    lse->max = max;
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: add_Log_Sum_Exp
+ DESCRIPTION:
+   Adds the given log-space score to the accumulator
+ RETURNS:
+ ARGS:
+ NOTES:
+   When the new score is the largest so far, the running sum is
+   rescaled to it, so that no term is ever exponentiated from above
+   zero (which could overflow). With the fast exp, the scores are 
+   only batched here, and summed a batch at a time
+ *********************************************************************/
+void add_Log_Sum_Exp( Log_Sum_Exp *lse, double val ) {
+
+  if (use_fast_exp_one) {
+    lse->batch[lse->batch_len++] = val;
+    if (lse->batch_len == LOG_SUM_EXP_BATCH)
+      flush_Log_Sum_Exp( lse );
+  }
+  else if (lse->sum == 0.0) {
+    lse->max = val;
+    lse->sum = 1.0;
+  }
+  else if (val <= lse->max) 
+    lse->sum += exp( val - lse->max );
+  else {
+    lse->sum = lse->sum * exp( lse->max - val ) + 1.0;
+    lse->max = val;
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: value_Log_Sum_Exp
+ DESCRIPTION:
+ RETURNS: log of the sum of the exps of the scores added so far
+ ARGS:
+ NOTES:
+ *********************************************************************/
+double value_Log_Sum_Exp( Log_Sum_Exp *lse ) {
+  flush_Log_Sum_Exp( lse );
+  return log( lse->sum ) + lse->max;
+}
@@ -17,6 +17,8 @@
  * E-mail : klh@sanger.ac.uk
  * Description : 
  **********************************************************************/
+#include <float.h>
+#include <limits.h>
 #include "sequence.h"
 
 #define ALLOC_STEP 100
@@ -33,121 +35,119 @@
  ARGS: 
  NOTES: Helper to:
    - convert_gff_Gaze_Sequence
-   - convert_gff_Gaze_Sequence_list
+   - convert_routed_gff_Gaze_Sequence
+   The matches array is scratch space, with room for all of the rules
  *********************************************************************/
 static void convert_gff_line_to_Gaze_entities(Gaze_Sequence *g_seq,
 					      GFF_line *gff_line,
-					      Array *gff2fts) {
-  int i, j;
+					      GFF_Dispatch *disp,
+					      int *matches) {
+  int i, j, num_matches;
 
   if ((gff_line->start >= g_seq->seq_region.s) && (gff_line->end <= g_seq->seq_region.e)) {
     /* we have a partial overlap */
-    for(i=0; i < gff2fts->len; i++) {
-      GFF_to_Gaze_entities *con = index_Array( gff2fts, GFF_to_Gaze_entities *, i);
+    num_matches = match_GFF_Dispatch( disp, gff_line, matches );
 
-      if (((con->gff_source == NULL) || strcmp(con->gff_source, gff_line->source) == 0) &&
-	  ((con->gff_feature == NULL) || strcmp(con->gff_feature, gff_line->type) == 0) &&
-	  ((con->gff_strand == NULL) || strcmp(con->gff_strand, gff_line->strand) == 0) &&
-	  ((con->gff_frame == NULL) || strcmp(con->gff_frame, gff_line->frame) == 0)) {
-	
-	if ((gff_line->start >= g_seq->seq_region.s) && (gff_line->end <= g_seq->seq_region.e)) {
-	  /* only features completly within the given region are considered */
-	  for(j=0; j < con->features->len; j++) {
-	    Gaze_entity *ge = index_Array( con->features, Gaze_entity *, j );
-	    Feature *ft = new_Feature();
-
-	    ft->feat_idx = ge->entity_idx;
-	    ft->real_pos.s = gff_line->start + ge->offsets.s;
-	    ft->real_pos.e = gff_line->end - ge->offsets.e;
-	    ft->score = gff_line->score;
-	    if (ge->has_score)
-	      ft->score = ge->score;
-	    
-	    if (ft->score < index_Array( g_seq->min_scores, double, ft->feat_idx ))
-	      index_Array( g_seq->min_scores, double, ft->feat_idx ) = ft->score;
-	    
-	    append_val_Array( g_seq->features, ft );
-	  }
-	}
-	
-	/* ...whereas all overlapping segments are added */
-	for(j=0; j < con->segments->len; j++) {
-	  Gaze_entity *ge = index_Array( con->segments, Gaze_entity *, j );
-	  Segment *seg = new_Segment();
-
-	  seg->seg_idx = ge->entity_idx;
-	  seg->pos.s = gff_line->start + ge->offsets.s;
-	  seg->pos.e = gff_line->end - ge->offsets.e;
-	  seg->score = gff_line->score;
+    for(i=0; i < num_matches; i++) {
+      GFF_to_Gaze_entities *con = index_Array( disp->gff2fts, GFF_to_Gaze_entities *, matches[i]);
+
+      if ((gff_line->start >= g_seq->seq_region.s) && (gff_line->end <= g_seq->seq_region.e)) {
+	/* only features completly within the given region are considered */
+	for(j=0; j < con->features->len; j++) {
+	  Gaze_entity *ge = index_Array( con->features, Gaze_entity *, j );
+	  Feature *ft = new_Feature();
+
+	  ft->feat_idx = ge->entity_idx;
+	  ft->real_pos.s = gff_line->start + ge->offsets.s;
+	  ft->real_pos.e = gff_line->end - ge->offsets.e;
+	  ft->score = gff_line->score;
 	  if (ge->has_score)
-	    seg->score = ge->score;
+	    ft->score = ge->score;
 
-	  if (seg->pos.s < g_seq->seq_region.s) {
-	    int trimmed = g_seq->seq_region.s - seg->pos.s;
-	    double trimmed_score = trimmed * (seg->score / (seg->pos.e - seg->pos.s + 1));
-	    seg->pos.s = g_seq->seq_region.s;
-	    seg->score -= trimmed_score;
-	  }
-	  if (seg->pos.e > g_seq->seq_region.e) {
-	    int trimmed = seg->pos.e - g_seq->seq_region.s;
-	    double trimmed_score = trimmed * (seg->score / (seg->pos.e - seg->pos.s + 1));
-	    seg->pos.e = g_seq->seq_region.e;
-	    seg->score -= trimmed_score;
-	  }
-	  if (seg->pos.e <= g_seq->seq_region.e &&
-	      seg->pos.s >= g_seq->seq_region.s &&
-	      seg->pos.e >= seg->pos.s)
-	    append_to_Segment_list( index_Array( g_seq->segment_lists, Segment_list *, seg->seg_idx ),
-				    seg );
-	  
-	  /********************************************************************************/
-	  /*  the following was some attempt to get per_base scoring working. It 
-	      worked, bit it was not general enough to fit in with the GAZE way 
-	      of doing things. In particular, it makes heavy use of the real meaning
-	      frame and strand fields of the gff file, which is not how GAZE
-	      has done things in the past. Things to point out:
-	      
-	      1. By convention, I assume that for non unity-width per-base scores, 
-	      the last base of the region is the "base" (first base on rev strand), 
-	      and the previous n bases are dependency bases. This allows hexamers, 
-	      pentamers etc to be given. However, the given "frame" arguement is the 
-	      codon position of the *first* base of the region, so we need to convert 
-	      this into a codon position of the base of interest. 
-	      
-	      2. A trick is employed to convert a reverse strand codon-position, which 
-	      run 2->1->0 along the length of the sequence when viewing from the forward 
-	      strand, to a "virtual forward strand codon-postion", which run 0->1->2 along 
-	      the length of the sequence. This is a semantinc convenience that makes the 
-	      lookup of the correct list consistent with that of normal segments
-	      
-	      3. By using the modulo position of the start (or end for reverse strand) of 
-	      the segments to determine where in the list they go, they can be retrieved 
-	      in a simple fashion in the segment score calculation; this way, the position 
-	      (mod 3) gives the index of the zeroth codon position, and the other two codon 
-	      positions are obtained by subtraction
-	  */
-	  
-	  /*
-	    int cod_pos = atoi( gff_line->frame );
-	    int pos = gff_line->end;
-	    
-	    if ((gff_line->end > g_seq->seq_region.e) || (gff_line->start < g_seq->seq_region.s))
-	    continue;
-	    
-	    correct_list = index_Array( g_seq->segment_lists, 
-					Segment_list *, 
-					index_Array( con->segments, Segment *, j)->seg_idx );
-					  
-	    cod_pos = (cod_pos + gff_line->end - gff_line->start) % 3;
-					  
-	    if (! strcmp(gff_line->strand, "-")) {
-		 cod_pos = 3 - cod_pos - 1;
-		 pos = gff_line->start;
-	    }
-	    correct_list->per_base[(pos - cod_pos + 3)%3][pos - g_seq->seq_region.s] = gff_line->score;
-	  */
-	  /*********************************************************************************/
+	  if (ft->score < index_Array( g_seq->min_scores, double, ft->feat_idx ))
+	    index_Array( g_seq->min_scores, double, ft->feat_idx ) = ft->score;
+
+	  append_val_Array( g_seq->features, ft );
+	}
+      }
+
+      /* ...whereas all overlapping segments are added */
+      for(j=0; j < con->segments->len; j++) {
+	Gaze_entity *ge = index_Array( con->segments, Gaze_entity *, j );
+	Segment *seg = new_Segment();
+
+	seg->seg_idx = ge->entity_idx;
+	seg->pos.s = gff_line->start + ge->offsets.s;
+	seg->pos.e = gff_line->end - ge->offsets.e;
+	seg->score = gff_line->score;
+	if (ge->has_score)
+	  seg->score = ge->score;
+
+	if (seg->pos.s < g_seq->seq_region.s) {
+	  int trimmed = g_seq->seq_region.s - seg->pos.s;
+	  double trimmed_score = trimmed * (seg->score / (seg->pos.e - seg->pos.s + 1));
+	  seg->pos.s = g_seq->seq_region.s;
+	  seg->score -= trimmed_score;
+	}
+	if (seg->pos.e > g_seq->seq_region.e) {
+	  int trimmed = seg->pos.e - g_seq->seq_region.s;
+	  double trimmed_score = trimmed * (seg->score / (seg->pos.e - seg->pos.s + 1));
+	  seg->pos.e = g_seq->seq_region.e;
+	  seg->score -= trimmed_score;
 	}
+	if (seg->pos.e <= g_seq->seq_region.e &&
+	    seg->pos.s >= g_seq->seq_region.s &&
+	    seg->pos.e >= seg->pos.s)
+	  append_to_Segment_list( index_Array( g_seq->segment_lists, Segment_list *, seg->seg_idx ),
+				  seg );
+
+	/********************************************************************************/
+	/*  the following was some attempt to get per_base scoring working. It 
+	    worked, bit it was not general enough to fit in with the GAZE way 
+	    of doing things. In particular, it makes heavy use of the real meaning
+	    frame and strand fields of the gff file, which is not how GAZE
+	    has done things in the past. Things to point out:
+
+	    1. By convention, I assume that for non unity-width per-base scores, 
+	    the last base of the region is the "base" (first base on rev strand), 
+	    and the previous n bases are dependency bases. This allows hexamers, 
+	    pentamers etc to be given. However, the given "frame" arguement is the 
+	    codon position of the *first* base of the region, so we need to convert 
+	    this into a codon position of the base of interest. 
+
+	    2. A trick is employed to convert a reverse strand codon-position, which 
+	    run 2->1->0 along the length of the sequence when viewing from the forward 
+	    strand, to a "virtual forward strand codon-postion", which run 0->1->2 along 
+	    the length of the sequence. This is a semantinc convenience that makes the 
+	    lookup of the correct list consistent with that of normal segments
+
+	    3. By using the modulo position of the start (or end for reverse strand) of 
+	    the segments to determine where in the list they go, they can be retrieved 
+	    in a simple fashion in the segment score calculation; this way, the position 
+	    (mod 3) gives the index of the zeroth codon position, and the other two codon 
+	    positions are obtained by subtraction
+	*/
+
+	/*
+	  int cod_pos = atoi( gff_line->frame );
+	  int pos = gff_line->end;
+
+	  if ((gff_line->end > g_seq->seq_region.e) || (gff_line->start < g_seq->seq_region.s))
+	  continue;
+
+	  correct_list = index_Array( g_seq->segment_lists, 
+				      Segment_list *, 
+				      index_Array( con->segments, Segment *, j)->seg_idx );
+
+	  cod_pos = (cod_pos + gff_line->end - gff_line->start) % 3;
+
+	  if (! strcmp(gff_line->strand, "-")) {
+	       cod_pos = 3 - cod_pos - 1;
+	       pos = gff_line->start;
+	  }
+	  correct_list->per_base[(pos - cod_pos + 3)%3][pos - g_seq->seq_region.s] = gff_line->score;
+	*/
+	/*********************************************************************************/
       }
     }
   }
@@ -375,6 +375,10 @@ void free_Gaze_Sequence( Gaze_Sequence *g_seq, boolean free_all ) {
       free_Array( g_seq->features, TRUE);
       g_seq->features = NULL;
     }
+    if (g_seq->feat_table != NULL) {
+      free_Feature_Table( g_seq->feat_table );
+      g_seq->feat_table = NULL;
+    }
     if (g_seq->segment_lists != NULL) {
       for(i=0; i < g_seq->segment_lists->len; i++)
 	free_Segment_list( index_Array( g_seq->segment_lists, Segment_list *, i ));
@@ -472,6 +476,7 @@ Gaze_Sequence *new_Gaze_Sequence( char *seq_name,
   g_seq->dna_seq = NULL;
   g_seq->path = NULL;
   g_seq->features = NULL;
+  g_seq->feat_table = NULL;
   g_seq->segment_lists = NULL;
   g_seq->min_scores = NULL;
   g_seq->beg_ft = NULL;
@@ -480,6 +485,12 @@ Gaze_Sequence *new_Gaze_Sequence( char *seq_name,
   g_seq->gene_file_name = NULL;
   g_seq->gff_file_names = NULL;
   g_seq->selected_file_names = NULL;
+  g_seq->beam_width = 0;
+  g_seq->beam_margin = 0.0;
+  g_seq->nbest = 0;
+  g_seq->num_samples = 0;
+  g_seq->sample_seed = 0;
+  g_seq->dp_allocs = g_seq->dp_scans = 0;
 
   return g_seq;
 }
@@ -608,34 +619,36 @@ void convert_dna_Gaze_Sequence ( Gaze_Sequence *g_seq,
  *********************************************************************/
 void convert_gff_Gaze_Sequence( Gaze_Sequence *g_seq,
 				Array *full_file_list,
-				Array *gff2fts ) {
+				GFF_Dispatch *disp ) {
   
   int f_idx;
 
   GFF_line *gff_line = new_GFF_line();
   Array *useful_files = NULL;
+  int *matches = (int *) malloc_util( (disp->gff2fts->len + 1) * sizeof(int) );
 
   Array *file_list = g_seq->gff_file_names == NULL ? full_file_list : g_seq->gff_file_names;
 
   for(f_idx=0; f_idx < file_list->len; f_idx++) {
     char *this_file_name = index_Array( file_list, char *, f_idx );
-    FILE *file = fopen (this_file_name, "r" );
     boolean useful_data = FALSE;
-
-    while( read_GFF_line( file, gff_line ) != 0 ) {
-      /* First check that we reading annotation for the same sequence that we've
-	 doing so all along */
-      if (strcmp( g_seq->seq_name, gff_line->seqname))
-	continue;
-      else {
-	useful_data = TRUE;
-	convert_gff_line_to_Gaze_entities( g_seq,
-					   gff_line,
-					   gff2fts );
-	
-      }
+    char *buf;
+    FILE *file = open_GFF_lines( this_file_name, 
+				 g_seq->seq_name, 
+				 g_seq->seq_region.s, 
+				 g_seq->seq_region.e, 
+				 &buf, 
+				 &useful_data );
+
+    while( file != NULL && read_GFF_line_for_seq( file, gff_line, g_seq->seq_name ) != 0 ) {
+      useful_data = TRUE;
+      convert_gff_line_to_Gaze_entities( g_seq,
+					 gff_line,
+					 disp,
+					 matches );
     }
-    fclose( file );
+    if (file != NULL)
+      close_GFF_lines( file, buf );
 
     if (useful_data && g_seq->gff_file_names == NULL) {
       /* register this file as useful */
@@ -648,6 +661,7 @@ void convert_gff_Gaze_Sequence( Gaze_Sequence *g_seq,
   if (g_seq->gff_file_names == NULL)
     g_seq->gff_file_names = useful_files;
 
+  free_util( matches );
   free_GFF_line( gff_line );
 } 
 
@@ -683,7 +697,7 @@ boolean get_correct_feats_Gaze_Sequence( Gaze_Sequence *g_seq,
 
   while (! no_more_files) {
     FILE *gff_file;
-    char *this_file_name;
+    char *this_file_name, *buf;
     boolean useful_data = FALSE;
 
     if ( define_paths) {
@@ -719,23 +733,24 @@ boolean get_correct_feats_Gaze_Sequence( Gaze_Sequence *g_seq,
       }
     }
 
-    gff_file = fopen( this_file_name, "r");
-
-    while( read_GFF_line( gff_file, gff_line ) != 0 ){
-
-      if (strcmp( g_seq->seq_name, gff_line->seqname))
-	continue;
-      else {
-	useful_data = TRUE;
-	no_problem &= get_correct_feature_from_gff_line( g_seq,
-							 gff_line,
-							 feat_list,
-							 feat_dict,
-							 define_paths );
-      }      
+    gff_file = open_GFF_lines( this_file_name, 
+			       g_seq->seq_name, 
+			       g_seq->seq_region.s, 
+			       g_seq->seq_region.e, 
+			       &buf, 
+			       &useful_data );
+
+    while( gff_file != NULL && read_GFF_line_for_seq( gff_file, gff_line, g_seq->seq_name ) != 0 ){
+      useful_data = TRUE;
+      no_problem &= get_correct_feature_from_gff_line( g_seq,
+						       gff_line,
+						       feat_list,
+						       feat_dict,
+						       define_paths );
     }
 
-    fclose( gff_file );
+    if (gff_file != NULL)
+      close_GFF_lines( gff_file, buf );
 
     /* need to register this file as having the path/correct features for this */
     if (useful_data) {
@@ -785,7 +800,8 @@ boolean get_correct_feats_Gaze_Sequence( Gaze_Sequence *g_seq,
  NOTES:
    This routine changes the value of offset_dna for each Gaze_Sequence,
    but since thisis the only routine that makes use of it, this is
-   not harmful
+   not harmful. Files that can be indexed (see fasta.h) are read 
+   through the index, seeking straight to the region
  *********************************************************************/
 void read_dna_Gaze_Sequence( Gaze_Sequence *g_seq,
 			     Array *total_file_list ) {
@@ -793,9 +809,10 @@ void read_dna_Gaze_Sequence( Gaze_Sequence *g_seq,
   char *name, c;
   Line *ln = new_Line(); 
   int num_bases = 0;
-  int line_len, i, f_idx = 0;
+  int line_len, i, f_idx = 0, found, seq_len;
   boolean no_more_files = FALSE;
   int dna_offset = g_seq->offset_dna;
+  int first, last;
 
   if (g_seq->dna_seq != NULL) {
     free_util( g_seq->dna_seq );
@@ -818,65 +835,83 @@ void read_dna_Gaze_Sequence( Gaze_Sequence *g_seq,
     else
       no_more_files = TRUE;
 
-    dna_file = fopen( this_file_name, "r");
+    /* when the file has an index, only the bases of the region are read */
+    first = ((g_seq->seq_region.s == 0) ? g_seq->offset_dna : g_seq->seq_region.s) - g_seq->offset_dna;
+    last = (g_seq->seq_region.e == 0) ? INT_MAX : g_seq->seq_region.e - g_seq->offset_dna;
+
+    found = read_FASTA_region( this_file_name, 
+			       g_seq->seq_name, 
+			       first, 
+			       last, 
+			       &(g_seq->dna_seq), 
+			       &seq_len );
+
+    if (found > 0) {
+      if (g_seq->seq_region.s == 0)
+	g_seq->seq_region.s = g_seq->offset_dna;
+      dna_offset = g_seq->offset_dna + seq_len;
+    }
+    else if (found < 0) {
+      dna_file = fopen( this_file_name, "r");
 
-    while( (line_len = read_Line( dna_file, ln )) != 0) {
-      int idx = 0;
+      while( (line_len = read_Line( dna_file, ln )) != 0) {
+	int idx = 0;
 
-      if (ln->buf[idx] == '>') {
-	/* skip to first non-white-space character */
-	while ( isspace( (int) ln->buf[++idx] ) );
-	name = &(ln->buf[idx++]); 
-	/* skip to end of name */
-	while ( ln->buf[idx] != '\0' && !isspace( (int) ln->buf[++idx] ) );
-	ln->buf[idx] = '\0';
+	if (ln->buf[idx] == '>') {
+	  /* skip to first non-white-space character */
+	  while ( isspace( (int) ln->buf[++idx] ) );
+	  name = &(ln->buf[idx++]); 
+	  /* skip to end of name */
+	  while ( ln->buf[idx] != '\0' && !isspace( (int) ln->buf[++idx] ) );
+	  ln->buf[idx] = '\0';
 
-	if (strcmp( name, g_seq->seq_name ) == 0) {
+	  if (strcmp( name, g_seq->seq_name ) == 0) {
 
-	  g_seq->dna_seq = (char *) malloc_util (ALLOC_STEP * sizeof( char ) );
+	    g_seq->dna_seq = (char *) malloc_util (ALLOC_STEP * sizeof( char ) );
 	    
-	  if (g_seq->seq_region.s == 0)
-	    g_seq->seq_region.s = dna_offset;
+	    if (g_seq->seq_region.s == 0)
+	      g_seq->seq_region.s = dna_offset;
 	  	  
-	  num_bases = 0;
+	    num_bases = 0;
+	  }
+	  else {
+	    /* we've come across another sequence, so if we've already read our sequence, we're done */
+	    if (g_seq->dna_seq != NULL)
+	      break;
+	  }
 	}
 	else {
-	  /* we've come across another sequence, so if we've already read our sequence, we're done */
-	  if (g_seq->dna_seq != NULL)
-	    break;
-	}
-      }
-      else {
-	/* this is a DNA line */
-	if (g_seq->dna_seq != NULL) {
-	  for(i=0; i < line_len; i++) {
-	    if (! isspace( (int) ln->buf[i] )) {
-	      c = tolower( (int) ln->buf[i]);
+	  /* this is a DNA line */
+	  if (g_seq->dna_seq != NULL) {
+	    for(i=0; i < line_len; i++) {
+	      if (! isspace( (int) ln->buf[i] )) {
+		c = tolower( (int) ln->buf[i]);
 	      
-	      if ( dna_offset < g_seq->seq_region.s )
-		; /* do nothing */
-	      else if (g_seq->seq_region.e && (dna_offset > g_seq->seq_region.e)) {
-		/* we've gone past the end of the region of interest for this sequence */
-		dna_offset++;
-		break;
-	      }
-	      else {
-		/* store the base - increase memory if necessary */
-		if ( (num_bases % ALLOC_STEP) == 0 ) 
-		  if (num_bases != 0)
-		    g_seq->dna_seq = (char *) realloc_util( g_seq->dna_seq, 
-							    (num_bases + ALLOC_STEP) * sizeof(char) );
+		if ( dna_offset < g_seq->seq_region.s )
+		  ; /* do nothing */
+		else if (g_seq->seq_region.e && (dna_offset > g_seq->seq_region.e)) {
+		  /* we've gone past the end of the region of interest for this sequence */
+		  dna_offset++;
+		  break;
+		}
+		else {
+		  /* store the base - increase memory if necessary */
+		  if ( (num_bases % ALLOC_STEP) == 0 ) 
+		    if (num_bases != 0)
+		      g_seq->dna_seq = (char *) realloc_util( g_seq->dna_seq, 
+							      (num_bases + ALLOC_STEP) * sizeof(char) );
+
+		  g_seq->dna_seq[num_bases++] = c;
+		}
 
-		g_seq->dna_seq[num_bases++] = c;
+		dna_offset++;
 	      }
-
-	      dna_offset++;
 	    }
 	  }
 	}
       }
+      fclose( dna_file );
     }
-    fclose( dna_file );
 
     if (g_seq->dna_seq != NULL && g_seq->dna_file_name == NULL) {
       /* register this file as having the DNA for this seq */
@@ -1012,6 +1047,7 @@ Gaze_Sequence_list *new_Gaze_Sequence_list ( Array *names ) {
 
   for(i=0; i < names->len; i++)
     index_Array( list->seq_id_dict, char *, i) = index_Array( names, char *, i);
+  index_Dict( list->seq_id_dict );
 
   return list;
 }
@@ -1141,37 +1177,21 @@ void read_dna_Gaze_Sequence_list( Gaze_Sequence_list *glist,
  RETURNS:
  ARGS: 
  NOTES:
+   The files are read once, through a GFF_Router
  *********************************************************************/
 void convert_gff_Gaze_Sequence_list( Gaze_Sequence_list *glist,
 				     Array *file_list,
-				     Array *gff2fts ) {
+				     GFF_Dispatch *disp ) {
   
-  int f, s;
-  Gaze_Sequence *g_seq;
+  int s;
+  GFF_Router *router = new_GFF_Router( glist, GFF_ROUTER_DEFAULT_BUDGET );
 
-  GFF_line *gff_line = new_GFF_line();
-  
-  for(f=0; f < file_list->len; f++) {
-    FILE *file = fopen (index_Array( file_list, char *, f ), "r" );
-
-    while( read_GFF_line( file, gff_line ) != 0 ) {
-      /* First check that we reading annotation for the same sequence that we've
-	 doing so all along */
+  read_GFF_Router( router, file_list );
 
-      for (s=0; s < glist->num_seqs; s++) {
-	g_seq = glist->seq_list[s];
+  for (s=0; s < glist->num_seqs; s++)
+    convert_routed_gff_Gaze_Sequence( glist->seq_list[s], router, disp );
 
-	if ( ! strcmp (g_seq->seq_name,  gff_line->seqname ))
-	  convert_gff_line_to_Gaze_entities( g_seq,
-					     gff_line,
-					     gff2fts );
-	
-      }
-    }
-    fclose( file );
-  }
-
-  free_GFF_line( gff_line );
+  free_GFF_Router( router );
 } 
 
 
@@ -1243,6 +1263,314 @@ boolean get_correct_feats_Gaze_Sequence_list( Gaze_Sequence_list *glist,
 }
 
 
+/********************************************************************/
+/**************** GFF_Router ****************************************/
+/********************************************************************/
+
+/*********************************************************************
+ FUNCTION: find_GFF_Bucket
+ DESCRIPTION:
+   Looks up the bucket for the given seqname (which runs up to the
+   given terminator, or the end of the string)
+ RETURNS: the index of its slot in the table, which is empty
+   if there is no such bucket
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static int find_GFF_Bucket( GFF_Router *router, const char *name, char term ) {
+  int len, slot = hash_string_util( name, term ) & (router->table_size - 1);
+  GFF_Bucket *bk;
+
+  for (len = 0; name[len] != term && name[len] != '\0'; len++);
+
+  while ((bk = router->table[slot]) != NULL) {
+    if (strncmp( bk->seqname, name, len ) == 0 && bk->seqname[len] == '\0')
+      break;
+    slot = (slot + 1) & (router->table_size - 1);
+  }
+
+  return slot;
+}
+
+
+/*********************************************************************
+ FUNCTION: spill_GFF_Router
+ DESCRIPTION:
+   Moves the lines held in memory for all buckets to the spill file
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+static void spill_GFF_Router( GFF_Router *router ) {
+  int i;
+
+  if (router->spill == NULL && (router->spill = tmpfile()) == NULL)
+    fatal_util( "Could not open a temporary file for the GFF lines" );
+
+  fseek( router->spill, 0L, SEEK_END );
+
+  for (i=0; i < router->table_size; i++) {
+    GFF_Bucket *bk = router->table[i];
+
+    if (bk != NULL && bk->len > 0) {
+      GFF_Chunk ch;
+
+      ch.offset = router->spill_len;
+      ch.len = bk->len;
+      if (fwrite( bk->buf, 1, bk->len, router->spill ) != (size_t) bk->len)
+	fatal_util( "Could not write to the temporary file for the GFF lines" );
+      append_val_Array( bk->chunks, ch );
+
+      router->spill_len += bk->len;
+      free_util( bk->buf );
+      bk->buf = NULL;
+      bk->len = bk->alloc = 0;
+    }
+  }
+
+  router->in_memory = 0;
+}
+
+
+/*********************************************************************
+ FUNCTION: free_GFF_Bucket_lines
+ DESCRIPTION:
+ RETURNS:
+ ARGS: 
+ NOTES:
+   The bucket itself remains, so that its lines are still 
+   recognised (and dropped) by a later read
+ *********************************************************************/
+static void free_GFF_Bucket_lines( GFF_Router *router, GFF_Bucket *bk ) {
+
+  if (bk->buf != NULL) {
+    router->in_memory -= bk->len;
+    free_util( bk->buf );
+    bk->buf = NULL;
+  }
+  bk->len = bk->alloc = 0;
+
+  /* set_size_Array will not shrink a populated array */
+  free_Array( bk->chunks, TRUE );
+  bk->chunks = new_Array( sizeof(GFF_Chunk), TRUE );
+}
+
+
+/*********************************************************************
+ FUNCTION: free_GFF_Router
+ DESCRIPTION:
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+void free_GFF_Router( GFF_Router *router ) {
+  int i;
+
+  if (router != NULL) {
+    for (i=0; i < router->table_size; i++) {
+      GFF_Bucket *bk = router->table[i];
+
+      if (bk != NULL) {
+	free_util( bk->seqname );
+	if (bk->buf != NULL)
+	  free_util( bk->buf );
+	free_Array( bk->chunks, TRUE );
+	free_util( bk );
+      }
+    }
+    free_util( router->table );
+    if (router->spill != NULL)
+      fclose( router->spill );
+    free_util( router );
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: new_GFF_Router
+ DESCRIPTION:
+   Makes a router with a bucket for each of the (distinct) sequence 
+   names of the given list
+ RETURNS:
+ ARGS: 
+   budget: the most bytes of lines to hold in memory
+ NOTES:
+ *********************************************************************/
+GFF_Router *new_GFF_Router( Gaze_Sequence_list *glist, long budget ) {
+  GFF_Router *router = (GFF_Router *) malloc_util( sizeof(GFF_Router) );
+  int s, slot;
+
+  for (router->table_size = 16; 
+       router->table_size < 2 * glist->num_seqs; 
+       router->table_size *= 2);
+  router->table = (GFF_Bucket **) malloc0_util( router->table_size * sizeof(GFF_Bucket *) );
+  router->spill = NULL;
+  router->spill_len = 0;
+  router->in_memory = 0;
+  router->budget = budget;
+
+  for (s=0; s < glist->num_seqs; s++) {
+    char *name = glist->seq_list[s]->seq_name;
+
+    slot = find_GFF_Bucket( router, name, '\0' );
+    if (router->table[slot] == NULL) {
+      GFF_Bucket *bk = (GFF_Bucket *) malloc_util( sizeof(GFF_Bucket) );
+
+      bk->seqname = strdup_util( name );
+      bk->buf = NULL;
+      bk->len = bk->alloc = 0;
+      bk->chunks = new_Array( sizeof(GFF_Chunk), TRUE );
+      bk->num_users = 0;
+      router->table[slot] = bk;
+    }
+    router->table[slot]->num_users++;
+  }
+
+  return router;
+}
+
+
+/*********************************************************************
+ FUNCTION: read_GFF_Router
+ DESCRIPTION:
+   Reads the given GFF files, filing the lines for the sequences of 
+   the router in their buckets, and dropping the others
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+void read_GFF_Router( GFF_Router *router, Array *file_list ) {
+  int f, line_len;
+  Line *ln = new_Line();
+
+  for(f=0; f < file_list->len; f++) {
+    FILE *file = fopen (index_Array( file_list, char *, f ), "r" );
+
+    if (file == NULL)
+      fatal_util( "Could not open GFF file %s", index_Array( file_list, char *, f ) );
+
+    while( (line_len = read_Line( file, ln )) != 0 ) {
+      GFF_Bucket *bk;
+
+      if (ln->buf[0] == '#')
+	continue;
+      if ((bk = router->table[find_GFF_Bucket( router, ln->buf, '\t' )]) == NULL ||
+	  bk->num_users == 0)
+	continue;
+
+      /* the line is stored with its newline */
+      if (bk->len + line_len + 1 > bk->alloc) {
+	long new_alloc = bk->alloc == 0 ? 1024 : bk->alloc;
+
+	while (bk->len + line_len + 1 > new_alloc)
+	  new_alloc *= 2;
+	if (bk->buf == NULL)
+	  bk->buf = (char *) malloc_util( new_alloc );
+	else
+	  bk->buf = (char *) realloc_util( bk->buf, new_alloc );
+	bk->alloc = new_alloc;
+      }
+      memcpy( bk->buf + bk->len, ln->buf, line_len );
+      bk->buf[bk->len + line_len] = '\n';
+      bk->len += line_len + 1;
+      router->in_memory += line_len + 1;
+
+      if (router->in_memory > router->budget)
+	spill_GFF_Router( router );
+    }
+    fclose( file );
+  }
+
+  free_Line( ln );
+}
+
+
+/*********************************************************************
+ FUNCTION: convert_gff_buffer_Gaze_Sequence
+ DESCRIPTION:
+   Converts the GFF lines held in the given buffer (which must end
+   with a complete line) for the given sequence
+ RETURNS:
+ ARGS: 
+   The scratch space for the matches of each line is given by the
+   caller, as are the GFF line to read into
+ NOTES:
+ *********************************************************************/
+static void convert_gff_buffer_Gaze_Sequence( Gaze_Sequence *g_seq,
+					      char *buf,
+					      long len,
+					      GFF_Dispatch *disp,
+					      GFF_line *gff_line,
+					      int *matches ) {
+  FILE *lines;
+
+  if ((lines = fmemopen( buf, len, "r" )) == NULL)
+    fatal_util( "Could not read the GFF lines for %s", g_seq->seq_name );
+
+  while( read_GFF_line( lines, gff_line ) != 0 )
+    convert_gff_line_to_Gaze_entities( g_seq,
+				       gff_line,
+				       disp,
+				       matches );
+  fclose( lines );
+}
+
+
+/*********************************************************************
+ FUNCTION: convert_routed_gff_Gaze_Sequence
+ DESCRIPTION:
+   As convert_gff_Gaze_Sequence, but takes the lines for the 
+   sequence from the given router
+ RETURNS:
+ ARGS: 
+ NOTES:
+   The spilled chunks are read back and converted one at a time, in
+   order, and the lines still in memory last. Every chunk was once
+   held in memory under the budget, so no more than that is needed
+   to read it back. The lines are freed when the last sequence that
+   needs them has been converted
+ *********************************************************************/
+void convert_routed_gff_Gaze_Sequence( Gaze_Sequence *g_seq,
+				       GFF_Router *router,
+				       GFF_Dispatch *disp ) {
+  GFF_Bucket *bk = router->table[find_GFF_Bucket( router, g_seq->seq_name, '\0' )];
+  GFF_line *gff_line;
+  int *matches;
+  char *buf;
+  int c;
+
+  if (bk == NULL || bk->num_users == 0)
+    return;
+
+  if (bk->len > 0 || bk->chunks->len > 0) {
+    gff_line = new_GFF_line();
+    matches = (int *) malloc_util( (disp->gff2fts->len + 1) * sizeof(int) );
+
+    for (c=0; c < bk->chunks->len; c++) {
+      GFF_Chunk *ch = &(index_Array( bk->chunks, GFF_Chunk, c ));
+
+      buf = (char *) malloc_util( ch->len );
+      fseek( router->spill, ch->offset, SEEK_SET );
+      if (fread( buf, 1, ch->len, router->spill ) != (size_t) ch->len)
+	fatal_util( "Could not read back the GFF lines for %s", g_seq->seq_name );
+
+      convert_gff_buffer_Gaze_Sequence( g_seq, buf, ch->len, disp, gff_line, matches );
+      free_util( buf );
+    }
+
+    if (bk->len > 0)
+      convert_gff_buffer_Gaze_Sequence( g_seq, bk->buf, bk->len, disp, gff_line, matches );
+
+    free_util( matches );
+    free_GFF_line( gff_line );
+  }
+
+  if (--bk->num_users == 0)
+    free_GFF_Bucket_lines( router, bk );
+}
+
+
+
 /********************************************************************/
 /**************** Segment_list **************************************/
 /********************************************************************/
@@ -1266,6 +1594,65 @@ void append_to_Segment_list( Segment_list *sl, Segment *seg ) {
  
 }
 
+/*********************************************************************
+ FUNCTION: cumulate_Segment_list
+ DESCRIPTION:
+   Builds the cumulative scores of the projected segments, segment 
+   by segment, so that the sum of the projected segment scores over
+   any region can be had by a subtraction, less the parts of the two
+   end segments that stick out of the region (see 
+   calculate_segment_score_for_relation)
+ RETURNS:
+   The number of bytes allocated
+ ARGS: 
+   The region of the sequence (which all segments lie within),
+   whether the three per-frame lists are needed, and whether the
+   all-frame list is needed
+ NOTES:
+   The list must have been scaled and projected. Lists with no 
+   segments are not built, since a search of them is trivial.
+   The space taken is proportional to the number of segments, not
+   to the length of the region
+ *********************************************************************/
+long cumulate_Segment_list( Segment_list *sl, 
+			    int start_reg,
+			    int end_reg,
+			    boolean framed,
+			    boolean unframed ) {
+  long bytes = 0;
+  int i, k;
+
+  if (sl->proj == NULL)
+    return 0;
+
+  sl->reg_start = start_reg;
+  sl->reg_len = end_reg - start_reg + 1;
+
+  for (k=0; k < 4; k++) {
+    Array *segs = index_Array( sl->proj, Array *, k );
+    double *cum;
+
+    if ((k < 3 && ! framed) || (k == 3 && ! unframed) ||
+	segs == NULL || segs->len == 0 || sl->cum_score[k] != NULL)
+      continue;
+
+    /* the segment scores are per-base, so each counts for its length */
+    cum = (double *) malloc_util( (segs->len + 1) * sizeof(double) );
+    cum[0] = 0.0;
+    for (i=0; i < segs->len; i++) {
+      Segment *seg = index_Array( segs, Segment *, i );
+
+      cum[i+1] = cum[i] + seg->score * (seg->pos.e - seg->pos.s + 1);
+    }
+
+    sl->cum_score[k] = cum;
+    bytes += (segs->len + 1) * sizeof(double);
+  }
+
+  return bytes;
+}
+
+
 /*********************************************************************
  FUNCTION: free_Segment_list
  DESCRIPTION:
@@ -1301,9 +1688,13 @@ void free_Segment_list( Segment_list *sl ) {
       free_Array( sl->proj, TRUE );
     }
 
-    for (i=0; i < 3; i++)
-      if (sl->per_base[i] != NULL)
-	free_util( sl->per_base[i] );
+    for (i=0; i < 4; i++)
+      if (sl->cum_score[i] != NULL)
+	free_util( sl->cum_score[i] );
+
+    for (i=0; i < 2; i++)
+      for (j=0; j < 4; j++)
+	free_Segment_Max_Index( sl->max_idx[i][j] );
 
     free_util( sl );
   }
@@ -1327,20 +1718,16 @@ Segment_list *new_Segment_list( int start_reg, int end_reg ) {
   for (i=0; i < 4; i++)
     index_Array( sl->orig, Array *, i) = new_Array( sizeof( Segment * ), TRUE );
 
-  /* in future, the following will only be performed for segments types that
-     require it. For now though, do it by default */
-
+  sl->reg_start = start_reg;
   sl->reg_len = end_reg - start_reg + 1;
 
+  /* the cumulative scores are only built for segment types that
+     require them, once the segments have been projected */
 
   sl->proj = NULL;
-  for(i=0; i < 3; i++) {
-    /*
-    sl->per_base[i] = (double *) malloc_util( sl->reg_len * sizeof( double ) );
-    for (j=0; j < sl->reg_len; j++)
-      sl->per_base[i][j] = 0.0;
-    */
-    sl->per_base[i] = NULL;
+  for(i=0; i < 4; i++) {
+    sl->cum_score[i] = NULL;
+    sl->max_idx[0][i] = sl->max_idx[1][i] = NULL;
   }
 
 
@@ -1352,13 +1739,12 @@ Segment_list *new_Segment_list( int start_reg, int end_reg ) {
  DESCRIPTION:
    This function pre-processes the semgnet_list structure to make it 
    more amenable to segment lookup. 
-   Firstly, it makes the per_base element (if it exists) cumulative,
-   allowing calculation by simple subtraction.
-
-   Secondly, it stores, for each segment, the maximum right-hand position
+   It stores, for each segment, the maximum right-hand position
    of all segments to the left (upstream), along with their indices. 
    It is the basis for many list indexing strategies, allowing fast
    look-up of the segments in a given range.  
+   It also builds the range-max index of each list that is long
+   enough to need one.
  RETURNS:
  ARGS: 
  NOTES:
@@ -1370,21 +1756,6 @@ Segment_list *new_Segment_list( int start_reg, int end_reg ) {
 void index_Segment_list(Segment_list *sl) {
   int tp_idx, i, j;
 
-  /* first, cumulativeise the per_base element */
-  
-  /*
-  for (i=0; i < 3; i++) {
-    double score_so_far = 0.0;
-    
-    for(j=0; j < sl->reg_len; j++) {
-      sl->per_base[i][j] += score_so_far;
-      score_so_far = sl->per_base[i][j];
-    }
-  }
-  */
-
-  /* and now index the normal segments */
-
   for (tp_idx = 0; tp_idx < 2; tp_idx++) {
     Array *tp = (tp_idx % 2 == 0) ? sl->orig : sl->proj;
 
@@ -1407,6 +1778,9 @@ void index_Segment_list(Segment_list *sl) {
 	    this_seg->max_end_up = max_end_upstream;
 	    this_seg->max_end_up_idx = idx_of_max_end_upstream;
 	  }    
+
+	  if (i < 4 && sl->max_idx[tp_idx][i] == NULL)
+	    sl->max_idx[tp_idx][i] = new_Segment_Max_Index( this_list );
 	}
       }
     }
@@ -1414,6 +1788,70 @@ void index_Segment_list(Segment_list *sl) {
 }
 
 
+/*********************************************************************
+ FUNCTION: free_Segment_Max_Index
+ DESCRIPTION:
+ RETURNS:
+ ARGS: 
+ NOTES:
+ *********************************************************************/
+void free_Segment_Max_Index( Segment_Max_Index *mi ) {
+  if (mi != NULL) {
+    free_util( mi->max_end );
+    free_util( mi->max_bound );
+    free_util( mi );
+  }
+}
+
+
+/*********************************************************************
+ FUNCTION: new_Segment_Max_Index
+ DESCRIPTION:
+   Builds the range-max index for the given (sorted) list of segments
+ RETURNS:
+   The index, or NULL if the list is too short to benefit from one
+ ARGS: 
+ NOTES:
+   Segment scores are per-base at this point
+ *********************************************************************/
+Segment_Max_Index *new_Segment_Max_Index( Array *segs ) {
+  Segment_Max_Index *mi;
+  int i;
+
+  if (segs->len < SEG_MAX_INDEX_MIN_LEN)
+    return NULL;
+
+  mi = (Segment_Max_Index *) malloc_util( sizeof(Segment_Max_Index) );
+  for (mi->size = 1; mi->size < segs->len; mi->size *= 2);
+
+  mi->max_end = (int *) malloc_util( 2 * mi->size * sizeof(int) );
+  mi->max_bound = (double *) malloc_util( 2 * mi->size * sizeof(double) );
+
+  for (i=0; i < mi->size; i++) {
+    if (i < segs->len) {
+      Segment *seg = index_Array( segs, Segment *, i );
+
+      mi->max_end[mi->size + i] = seg->pos.e;
+      mi->max_bound[mi->size + i] = (seg->score >= 0.0) 
+	? seg->score * (seg->pos.e - seg->pos.s + 1)
+	: seg->score;
+    }
+    else {
+      /* padding; never overlaps anything */
+      mi->max_end[mi->size + i] = INT_MIN;
+      mi->max_bound[mi->size + i] = -DBL_MAX;
+    }
+  }
+
+  for (i = mi->size - 1; i >= 1; i--) {
+    mi->max_end[i] = MAX( mi->max_end[2*i], mi->max_end[2*i+1] );
+    mi->max_bound[i] = MAX( mi->max_bound[2*i], mi->max_bound[2*i+1] );
+  }
+
+  return mi;
+}
+
+
 /*********************************************************************
  FUNCTION: project_Segment_list
  DESCRIPTION:
@@ -1573,17 +2011,9 @@ void project_Segment_list( Segment_list *sl) {
 void scale_Segment_list( Segment_list *sl, double scale ) {
   int i, j;
 
-  /* first the per-base element, if it exists */
-
-  /*
-  for(i=0; i < 3; i++) 
-    if (sl->per_base[i] != NULL)
-      for (j=0; j < sl->reg_len; j++)
-	sl->per_base[i][j] *= scale;
-  */
-
   /* only need to scale the orig list, and this scaling
-     will be propagated when the segments are projected */
+     will be propagated when the segments are projected (and
+     from there to the cumulative scores) */
 
   if (sl->orig != NULL) {
     for( i=0; i < sl->orig->len; i++) {      
@@ -1612,8 +2042,6 @@ void scale_Segment_list( Segment_list *sl, double scale ) {
 void sort_Segment_list( Segment_list *sl ) {
   int i;
 
-  /* per_base element does not need sorting; sorted by construction */
-
   if (sl->orig != NULL) {
     for (i=0; i < sl->orig->len; i++) {
       Array *segs = index_Array( sl->orig, Array *, i );
@@ -645,12 +645,8 @@ static void parse_Gaze_Structure_killdna( struct Parse_context *state,
 	  new_motif = strdup_util( attr[i+1] );
 	  for(j=0; new_motif[j] != '\0'; j++)
 	    new_motif[j] = tolower( (int) new_motif[j]);
-	  if ((src_dna_idx = dict_lookup(state->gs->motif_dict, attr[i+1])) < 0) {
-	    append_val_Array( state->gs->motif_dict, new_motif );
-	    src_dna_idx = state->gs->motif_dict->len - 1;
-	  }
-	  else 
-	    free_util( new_motif );
+	  src_dna_idx = dict_intern( state->gs->motif_dict, new_motif );
+	  free_util( new_motif );
 	}
       }
       else if (! strcmp( attr[i], "target_dna" )) {
@@ -663,12 +659,8 @@ static void parse_Gaze_Structure_killdna( struct Parse_context *state,
 	  new_motif = strdup_util( attr[i+1] );
 	  for(j=0; new_motif[j] != '\0'; j++)
 	    new_motif[j] = tolower( (int) new_motif[j]);
-	  if ((tgt_dna_idx = dict_lookup(state->gs->motif_dict, attr[i+1])) < 0) {
-	    append_val_Array( state->gs->motif_dict, new_motif );
-	    tgt_dna_idx = state->gs->motif_dict->len - 1;
-	  }
-	  else 
-	    free_util( new_motif );
+	  tgt_dna_idx = dict_intern( state->gs->motif_dict, new_motif );
+	  free_util( new_motif );
 	}
       }
       else {
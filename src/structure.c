@@ -39,6 +39,12 @@ void free_Gaze_Structure( Gaze_Structure *gs ) {
   int i;
 
   if (gs != NULL) {
+    if (gs->relations != NULL) {
+      /* the table is indexed via the feature dictionary, so must go first */
+      for(i=0; i < gs->feat_dict->len * gs->feat_dict->len; i++)
+	free_Compiled_Relation_contents( &(gs->relations[i]) );
+      free_util( gs->relations );
+    }
     if (gs->feat_dict != NULL) {
       for(i=0; i < gs->feat_dict->len; i++) 
 	free_util( index_Array( gs->feat_dict, char *, i));
@@ -84,6 +90,10 @@ void free_Gaze_Structure( Gaze_Structure *gs ) {
 	free_DNA_to_Gaze_entities( index_Array(gs->dna_to_feats, DNA_to_Gaze_entities *, i));
       free_Array( gs->dna_to_feats, TRUE );
     }
+    if (gs->gff_dispatch != NULL) {
+      /* the table points into the rules, so must go first */
+      free_GFF_Dispatch( gs->gff_dispatch );
+    }
     if (gs->gff_to_feats != NULL) {
       for(i=0; i < gs->gff_to_feats->len; i++) 
 	free_GFF_to_Gaze_entities( index_Array(gs->gff_to_feats, GFF_to_Gaze_entities *, i));
@@ -120,6 +130,8 @@ Gaze_Structure *new_Gaze_Structure( void ) {
   g_str->dna_to_feats = new_Array( sizeof( DNA_to_Gaze_entities *), TRUE);
   g_str->gff_to_feats = new_Array( sizeof( GFF_to_Gaze_entities *), TRUE);
   g_str->take_dna = NULL;
+  g_str->relations = NULL;
+  g_str->gff_dispatch = NULL;
 
   /* need to add BEGIN and END features to the feature dictionary, 
      and create dummy Feature_Info objects for them */
@@ -330,13 +342,19 @@ void write_Gaze_Structure( Gaze_Structure *gs, FILE *out ) {
    the structure in a sense symmetrical, by deriving upstream killers
    for sources from downstream ones for targets (not that segments are
    not made symmetrical in this way - their directionality is controlled
-   by the user via src_phase and tgt_phase
+   by the user via src_phase and tgt_phase. Finally, the completed 
+   relations are compiled into the dense table used by the dp, 
+   the segments that can be scored from cumulative sums are noted, 
+   the gff rules are compiled for lookup by source and feature, and
+   the dictionaries are indexed
  RETURNS:
  ARGS: 
  NOTES:
  *********************************************************************/
 void fill_in_Gaze_Structure( Gaze_Structure *gs) {
   int tgt_idx, src_idx, i;
+  int num_feats = gs->feat_dict->len;
+  boolean *prefix_ok;
 
   for (tgt_idx=0; tgt_idx < gs->feat_info->len; tgt_idx++) {
     Feature_Info *tgt_inf = index_Array( gs->feat_info, Feature_Info *, tgt_idx);
@@ -425,4 +443,78 @@ void fill_in_Gaze_Structure( Gaze_Structure *gs) {
       tgt_inf->out_qual = NULL;
     }
   }
+
+  gs->relations = (Compiled_Relation *) 
+    malloc_util( num_feats * num_feats * sizeof(Compiled_Relation) );
+
+  for (tgt_idx=0; tgt_idx < num_feats; tgt_idx++) {
+    Array *sources = index_Array( gs->feat_info, Feature_Info *, tgt_idx)->sources;
+
+    for(src_idx=0; src_idx < num_feats; src_idx++) {
+      Feature_Relation *rel = NULL;
+
+      if (src_idx < sources->len)
+	rel = index_Array( sources, Feature_Relation *, src_idx );
+
+      compile_Feature_Relation( relation_Gaze_Structure( gs, tgt_idx, src_idx ), 
+				rel,
+				gs->length_funcs,
+				gs->motif_dict->len );
+    }
+  }
+
+  /* A segment can only be scored from cumulative sums if every 
+     qualifier that refers to it sums projected segments, and counts
+     the parts of segments that overlap the ends of the region */
+
+  prefix_ok = (boolean *) malloc_util( (gs->seg_dict->len + 1) * sizeof(boolean) );
+  for (i=0; i < gs->seg_dict->len; i++) {
+    Segment_Info *si = index_Array( gs->seg_info, Segment_Info *, i );
+
+    si->prefix_framed = si->prefix_unframed = FALSE;
+    prefix_ok[i] = TRUE;
+  }
+
+  for (tgt_idx=0; tgt_idx < num_feats; tgt_idx++) {
+    for(src_idx=0; src_idx < num_feats; src_idx++) {
+      Feature_Relation *rel = relation_Gaze_Structure( gs, tgt_idx, src_idx )->rel;
+
+      if (rel != NULL && rel->seg_quals != NULL) {
+	for (i=0; i < rel->seg_quals->len; i++) {
+	  Segment_Qualifier *qual = index_Array( rel->seg_quals, Segment_Qualifier *, i );
+	  Segment_Info *si;
+
+	  if (qual == NULL)
+	    continue;
+	  
+	  si = index_Array( gs->seg_info, Segment_Info *, qual->seg_idx );
+
+	  if (! qual->use_projected || ! qual->score_sum || ! qual->partial ||
+	      qual->is_exact_src || qual->is_exact_tgt)
+	    prefix_ok[qual->seg_idx] = FALSE;
+	  else if (qual->has_src_phase || qual->has_tgt_phase)
+	    si->prefix_framed = TRUE;
+	  else
+	    si->prefix_unframed = TRUE;
+	}
+      }
+    }
+  }
+
+  for (i=0; i < gs->seg_dict->len; i++) {
+    if (! prefix_ok[i]) {
+      Segment_Info *si = index_Array( gs->seg_info, Segment_Info *, i );
+      si->prefix_framed = si->prefix_unframed = FALSE;
+    }
+  }
+  free_util( prefix_ok );
+
+  gs->gff_dispatch = new_GFF_Dispatch( gs->gff_to_feats );
+
+  /* the dictionaries are complete, and are looked up in from 
+     several threads from now on, so are indexed here */
+  index_Dict( gs->feat_dict );
+  index_Dict( gs->seg_dict );
+  index_Dict( gs->len_fun_dict );
+  index_Dict( gs->motif_dict );
 }
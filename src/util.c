@@ -128,40 +128,41 @@ void free_Line( Line *l ) {
 /********************************************************************* 
  FUNCTION: read_Line
  DESCRIPTION: 
- RETURNS:
+   Reads the next non-blank line of the given file into the given
+   Line, without its newline
+ RETURNS: the length of the line; 0 at the end of the file
  ARGS:
  NOTES:
  *********************************************************************/
 int read_Line( FILE *file, Line *ln ) {
+  int chunk_len, line_len = 0;
 
-  boolean got_line = FALSE;
-  int c, line_len = 0;
-
-  while(!got_line && (c = fgetc(file)) != EOF) {
+  for(;;) {
+    if (ln->buf_size - line_len < 2) {
+      ln->buf = (char *) realloc_util( ln->buf, 2 * ln->buf_size * sizeof(char) );
+      ln->buf_size *= 2;
+    }
 
-    if (c == '\n')
-      /* blank line, no good */
-      continue;
+    /* fgets takes the line from the stdio buffer a block at a time */
+    if (fgets( ln->buf + line_len, ln->buf_size - line_len, file ) == NULL)
+      break;
 
-    do {
-      if (line_len >= ln->buf_size) {
-	ln->buf = (char *) realloc_util( ln->buf, (line_len + LINE_ALLOC_STEP) * sizeof(char));
-	ln->buf_size += LINE_ALLOC_STEP;
-      }
-      ln->buf[line_len++] = c;
+    chunk_len = strlen( ln->buf + line_len );
+    line_len += chunk_len;
 
-    } while((c = fgetc( file)) != '\n');
+    if (line_len > 0 && ln->buf[line_len - 1] == '\n') {
+      ln->buf[--line_len] = '\0';
 
-    if (line_len >= ln->buf_size) {
-      ln->buf = (char *) realloc_util( ln->buf, (line_len + 1) * sizeof(char) );
-      ln->buf_size++;
+      if (line_len > 0)
+	return line_len;
+      /* blank line, no good */
     }
-    ln->buf[line_len] = '\0';
-    got_line = TRUE;
   }
 
-  return line_len;
+  /* end of file, perhaps with a last line that has no newline */
+  ln->buf[line_len] = '\0';
 
+  return line_len;
 }
 
 
@@ -187,6 +188,27 @@ char *strdup_util(const char *str) {
 }
 
 
+/********************************************************************* 
+ FUNCTION: hash_string_util
+ DESCRIPTION: 
+    FNV-1a hash of the given string, up to the given terminator 
+    (or the end of the string)
+ RETURNS:
+ ARGS:
+ NOTES:
+ *********************************************************************/
+unsigned int hash_string_util( const char *str, char term ) {
+  unsigned int h = 2166136261U;
+
+  for (; *str != term && *str != '\0'; str++) {
+    h ^= (unsigned char) *str;
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+
 
 
 /**********************************************************************/
@@ -257,6 +279,22 @@ void free_util( void *ptr ) {
 
 #define MIN_ARRAY_SIZE  16
 
+/* A hash index over the entries of an Array used as a Dict, made 
+   by index_Dict and extended by later calls over the entries 
+   appended since. Each slot holds the hash of an entry and its id, 
+   or -1 when empty */
+
+typedef struct {
+  unsigned int hash;
+  int id;
+} Dict_Slot;
+
+typedef struct {
+  Dict_Slot *slots;
+  int size;            /* a power of 2 */
+  int count;           /* number of entries indexed */
+} Dict_Index;
+
 struct _RealArray
 {
   char *data;
@@ -264,11 +302,13 @@ struct _RealArray
   int   alloc;
   int   elt_size;
   int   clear;
+  Dict_Index *dict_index;   /* NULL unless used as a Dict */
 };
 
 typedef struct _RealArray  RealArray;
 
 static int _next_power_of_two (int num);
+static void _array_drop_dict_index (RealArray *array);
 static void _array_expand_if_necessary (RealArray *array,
 				  int len);
 
@@ -290,6 +330,7 @@ Array *new_Array ( int elt_size,
   array->alloc           = 0;
   array->clear           = (clear ? 1 : 0);
   array->elt_size        = elt_size;
+  array->dict_index      = NULL;
 
   return (Array*) array;
 }
@@ -306,6 +347,7 @@ Array *new_Array ( int elt_size,
  NOTES:
  *********************************************************************/
 void free_Array (Array  *array, boolean free_segment) {
+  _array_drop_dict_index ((RealArray *) array);
   if (free_segment && array->data != NULL)
     free_util (array->data);
 
@@ -352,6 +394,7 @@ Array* prepend_vals_Array (Array *farray,
 
   RealArray *array = (RealArray*) farray;
 
+  _array_drop_dict_index (array);
   _array_expand_if_necessary (array, len);
   memmove (array->data + array->elt_size * len, array->data, array->elt_size * array->len);
   memcpy (array->data, data, len * array->elt_size);
@@ -377,6 +420,7 @@ Array* insert_vals_Array (Array *farray,
 
   RealArray *array = (RealArray*) farray;
 
+  _array_drop_dict_index (array);
   _array_expand_if_necessary (array, len);
   memmove (array->data + array->elt_size * (len + index), 
 	     array->data + array->elt_size * index, 
@@ -402,6 +446,7 @@ Array *set_size_Array (Array *farray,
 
   RealArray *array = (RealArray*) farray;
 
+  _array_drop_dict_index (array);
   if (array->len != 0)
     warning_util("Attempt to set the size of an array that is already populated\n");
   else {
@@ -434,6 +479,7 @@ Array *remove_index_Array (Array* farray,
 
   RealArray* array = (RealArray*) farray;
 
+  _array_drop_dict_index (array);
   if (index != array->len - 1)
       memmove (array->data + array->elt_size * index, 
 	       array->data + array->elt_size * (index + 1), 
@@ -465,6 +511,25 @@ static int _next_power_of_two (int num)
 }
 
 
+/********************************************************************* 
+ FUNCTION: _array_drop_dict_index
+ DESCRIPTION: 
+   Throws away the dictionary index of the given array (if any), 
+   for when its entries are moved; the next dict_lookup remakes it
+ RETURNS:
+ ARGS:
+ NOTES:
+ *********************************************************************/
+static void _array_drop_dict_index (RealArray *array)
+{
+  if (array->dict_index != NULL) {
+    free_util (array->dict_index->slots);
+    free_util (array->dict_index);
+    array->dict_index = NULL;
+  }
+}
+
+
 /********************************************************************* 
  FUNCTION: _array_expand_if_necessary
  DESCRIPTION: 
@@ -505,24 +570,140 @@ static void _array_expand_if_necessary (RealArray *array,
 
 
 /*********************************************************************
- FUNCTION: dict_lookup
+ FUNCTION: find_Dict_Slot
  DESCRIPTION:
+   Finds the slot of the given name (with the given hash) in the
+   index of the given dictionary, by linear probing
  RETURNS:
+   The index of the slot holding the name, or of the empty slot 
+   where it would go
  ARGS: 
  NOTES:
  *********************************************************************/
-short int dict_lookup( Dict *dict, const char *name ) {
-  boolean match = FALSE;
-  short int j;
-
-  for( j=0; j < ((Array *)dict)->len; j++ ) {
-    if (! strcmp( index_Array( (Array *)dict, char *, j), name )) {
-      match = TRUE;
+static int find_Dict_Slot( Dict *dict, const char *name, unsigned int hash ) {
+  Dict_Index *idx = ((RealArray *) dict)->dict_index;
+  int s;
+
+  for (s = hash & (idx->size - 1); 
+       idx->slots[s].id >= 0; 
+       s = (s + 1) & (idx->size - 1)) {
+    if (idx->slots[s].hash == hash && 
+	! strcmp( index_Array( dict, char *, idx->slots[s].id ), name ))
       break;
+  }
+
+  return s;
+}
+
+
+/*********************************************************************
+ FUNCTION: index_Dict
+ DESCRIPTION:
+   Brings the hash index of the given dictionary up to date with 
+   its entries, making it if necessary
+ RETURNS:
+ ARGS: 
+ NOTES:
+   Only the first of several equal entries is indexed, so that ids
+   are as they would be from a scan of the entries in order. This
+   changes the dictionary, so must not run at the same time as 
+   lookups in it from other threads; dictionaries that are shared
+   by threads are indexed once they are complete
+ *********************************************************************/
+void index_Dict( Dict *dict ) {
+  RealArray *array = (RealArray *) dict;
+  Dict_Index *idx = array->dict_index;
+  int i, s;
+
+  if (idx == NULL || 2 * array->len > idx->size) {
+    int size = _next_power_of_two( 2 * array->len + 1 );
+
+    if (size < MIN_ARRAY_SIZE)
+      size = MIN_ARRAY_SIZE;
+    if (idx == NULL) {
+      idx = array->dict_index = (Dict_Index *) malloc_util( sizeof(Dict_Index) );
+      idx->slots = NULL;
     }
+    if (idx->slots != NULL)
+      free_util( idx->slots );
+    idx->slots = (Dict_Slot *) malloc_util( size * sizeof(Dict_Slot) );
+    for (s=0; s < size; s++)
+      idx->slots[s].id = -1;
+    idx->size = size;
+    idx->count = 0;
+  }
+
+  for (i = idx->count; i < array->len; i++) {
+    char *name = index_Array( dict, char *, i );
+    unsigned int hash = hash_string_util( name, '\0' );
+
+    s = find_Dict_Slot( dict, name, hash );
+    if (idx->slots[s].id < 0) {
+      idx->slots[s].hash = hash;
+      idx->slots[s].id = i;
+    }
+  }
+  idx->count = array->len;
+}
+
+
+/*********************************************************************
+ FUNCTION: dict_lookup
+ DESCRIPTION:
+ RETURNS:
+   The id (position) of the given name in the dictionary, or -1 if 
+   it is not there
+ ARGS: 
+ NOTES:
+   The entries covered by the hash index (see index_Dict) are found
+   through it, and any appended since are scanned. The dictionary is
+   not changed, so lookups may be made from several threads at once.
+   Entries must not be assigned in place once they are indexed (the
+   other Array functions that move entries throw the index away)
+ *********************************************************************/
+int dict_lookup( Dict *dict, const char *name ) {
+  Dict_Index *idx = ((RealArray *) dict)->dict_index;
+  int s, j = 0;
+
+  if (idx != NULL) {
+    s = find_Dict_Slot( dict, name, hash_string_util( name, '\0' ) );
+    if (idx->slots[s].id >= 0)
+      return idx->slots[s].id;
+    j = idx->count;
+  }
+
+  for (; j < dict->len; j++)
+    if (! strcmp( index_Array( dict, char *, j ), name ))
+      return j;
+
+  return -1;
+}
+
+
+/*********************************************************************
+ FUNCTION: dict_intern
+ DESCRIPTION:
+   Looks up the given name in the dictionary, adding a copy of it 
+   if it is not there already
+ RETURNS:
+   The id of the name in the dictionary
+ ARGS: 
+ NOTES:
+   The index is kept up to date, so must not be used on a dictionary
+   shared by threads
+ *********************************************************************/
+int dict_intern( Dict *dict, const char *name ) {
+  int id;
+
+  if ((id = dict_lookup( dict, name )) < 0) {
+    char *copy = strdup_util( name );
+
+    append_val_Array( dict, copy );
+    id = dict->len - 1;
+    index_Dict( dict );
   }
 
-  return (match)?j:-1;
+  return id;
 }
 
 
@@ -0,0 +1,127 @@
+/**********************************************************************
+ * File: dict_bench.c
+ *-------------------------------------------------------------------
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *-------------------------------------------------------------------
+ * NOTES:
+ * Times dict_lookup on dictionaries of 10^2 to 10^6 names, against
+ * the linear strcmp scan that it replaced. Built and run by
+ * "make bench"
+ **********************************************************************/
+#include <time.h>
+#include "util.h"
+
+#define BENCH_MIN_ENTRIES 100
+#define BENCH_MAX_ENTRIES 1000000
+#define BENCH_LOOKUPS 1000000
+
+/* the linear scan is only timed up to this size, with as many lookups
+   as take about as long as the hashed ones do at 10^6 */
+#define BENCH_MAX_LINEAR 100000
+#define BENCH_LINEAR_WORK 2000000000.0
+
+
+/*********************************************************************
+ FUNCTION: linear_lookup
+ DESCRIPTION:
+   The dictionary lookup as it was before the hash index
+ RETURNS: the index of the name, or -1 if it is absent
+ ARGS:
+ NOTES:
+ *********************************************************************/
+static int linear_lookup( Dict *dict, const char *name ) {
+  int i;
+
+  for (i=0; i < dict->len; i++)
+    if (strcmp( index_Array( dict, char *, i ), name ) == 0)
+      return i;
+
+  return -1;
+}
+
+
+/*********************************************************************
+ FUNCTION: now
+ DESCRIPTION:
+ RETURNS: the time in seconds, from a monotonic clock
+ ARGS:
+ NOTES:
+ *********************************************************************/
+static double now( void ) {
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+}
+
+
+
+int main( void ) {
+  int size, i, num_linear;
+  char buf[64];
+  char **keys = (char **) malloc_util( BENCH_LOOKUPS * sizeof(char *) );
+  double start, built, done;
+  long check = 0;
+
+  printf( "%10s %14s %16s %16s\n", "entries", "index build", "hashed lookup", "linear lookup" );
+
+  for (size = BENCH_MIN_ENTRIES; size <= BENCH_MAX_ENTRIES; size *= 10) {
+    Dict *dict = new_Array( sizeof(char *), TRUE );
+
+    for (i=0; i < size; i++) {
+      char *name;
+
+      sprintf( buf, "motif_%08d", i * 7919 );
+      name = strdup_util( buf );
+      append_val_Array( dict, name );
+    }
+
+    /* the queries are all hits, spread over the whole dictionary */
+    for (i=0; i < BENCH_LOOKUPS; i++)
+      keys[i] = index_Array( dict, char *, (int) (((unsigned long) i * 2654435761UL) % size) );
+
+    start = now();
+    index_Dict( dict );
+    built = now();
+
+    for (i=0; i < BENCH_LOOKUPS; i++)
+      check += dict_lookup( dict, keys[i] );
+    done = now();
+
+    printf( "%10d %11.2f ms %13.1f ns", size,
+	    (built - start) * 1.0e3, (done - built) * 1.0e9 / BENCH_LOOKUPS );
+
+    if (size <= BENCH_MAX_LINEAR) {
+      if ((num_linear = (int) (BENCH_LINEAR_WORK / size)) > BENCH_LOOKUPS)
+	num_linear = BENCH_LOOKUPS;
+
+      start = now();
+      for (i=0; i < num_linear; i++)
+	check -= linear_lookup( dict, keys[i] );
+      done = now();
+
+      printf( " %13.1f ns\n", (done - start) * 1.0e9 / num_linear );
+    }
+    else
+      printf( " %16s\n", "-" );
+
+    for (i=0; i < dict->len; i++)
+      free_util( index_Array( dict, char *, i ) );
+    free_Array( dict, TRUE );
+  }
+
+  free_util( keys );
+
+  /* printed so that the lookups cannot be optimised away */
+  printf( "(checksum %ld)\n", check );
+
+  return 0;
+}
@@ -0,0 +1,257 @@
+#!/bin/sh
+#
+# run_tests.sh : regression checks for gaze, run by "make check"
+#
+# Usage: sh test/run_tests.sh <path to gaze binary> [<path to gaze_check binary>]
+#
+# Each test runs gaze over the example in test/data and compares the
+# outputs of runs that must agree. gaze_check (built by "make check",
+# and looked for next to gaze if not given) prints its scores to 17
+# decimal places, for the tests that compare posteriors beyond the
+# usual 4. The data is copied into a scratch
+# directory first, so that the DNA and GFF indices gaze writes next to
+# its input files do not end up in the source tree.
+#
+
+GAZE=${1:-./gaze}
+case $GAZE in
+  /*) ;;
+  *) GAZE=`pwd`/$GAZE ;;
+esac
+GAZE_CHECK=${2:-`dirname $GAZE`/gaze_check}
+case $GAZE_CHECK in
+  /*) ;;
+  *) GAZE_CHECK=`pwd`/$GAZE_CHECK ;;
+esac
+
+DATA=`dirname $0`/data
+FAST_EXP_BOUND=`awk '$2 == "FAST_EXP_LOG_SUM_ERROR" { print $3 }' \
+  \`dirname $0\`/../include/logsum.h`
+
+# The largest difference allowed between a posterior computed with
+# -fast_exp and with libm. FAST_EXP_LOG_SUM_ERROR bounds a single
+# log-sum, but the errors of the forward and backward scores build up
+# along the dp, so it does not bound the posteriors; this tolerance is
+# empirical. The difference on the example is about 6e-14
+FAST_EXP_POSTERIOR_TOLERANCE=1e-10
+
+WORK=`mktemp -d ${TMPDIR:-/tmp}/gaze_check.XXXXXX` || exit 1
+trap 'rm -rf $WORK' 0 1 2 15
+cp $DATA/* $WORK
+cd $WORK
+
+SEQS="chrA chrB chrC chrD"
+EXAMPLE="-structure_file example.xml -gff_file example_a.gff -gff_file example_b.gff -dna_file example.fa"
+
+failed=0
+
+pass () {
+  echo "ok   $1"
+}
+
+fail () {
+  echo "FAIL $1: $2"
+  failed=`expr $failed + 1`
+}
+
+run_gaze () {
+  out=$1
+  shift
+  timeout 120 $GAZE $EXAMPLE "$@" -out_file $out $SEQS 2> $out.err
+}
+
+run_gaze_check () {
+  out=$1
+  shift
+  timeout 120 $GAZE_CHECK $EXAMPLE "$@" -out_file $out $SEQS 2> $out.err
+}
+
+
+#
+# -samples: every requested draw is either written or reported as not
+# drawable (a path reaching a feature whose candidates were all pruned),
+# and the draws do not depend on the number of threads
+#
+test_samples () {
+  name=samples
+  for t in 1 3; do
+    if ! run_gaze samp$t.gff -samples 500 -seed 11 -threads $t; then
+      fail $name "gaze failed (-threads $t)"
+      return
+    fi
+  done
+  drawn=`grep -c "^##  Sample [0-9]* of 500$" samp1.gff`
+  undrawn=`grep -c "^##  Sample [0-9]* of 500 could not be drawn$" samp1.gff`
+  if [ `expr $drawn + $undrawn` -ne 2000 ]; then
+    fail $name "$drawn samples drawn and $undrawn not drawn, expected 2000 in total"
+  elif [ $drawn -eq 0 ]; then
+    fail $name "no sample was drawn"
+  elif ! cmp -s samp1.gff samp3.gff; then
+    fail $name "-threads 1 and -threads 3 sampled different paths"
+  else
+    pass $name
+  fi
+}
+
+
+#
+# -samples where no path survives to END (the only source of END is
+# killed by its minimum distance): gaze must say so and finish
+#
+test_samples_no_path () {
+  name=samples_no_path
+  if ! timeout 120 $GAZE -structure_file example_nopath.xml -gff_file example_a.gff \
+      -gff_file example_b.gff -dna_file example.fa -samples 20 -seed 3 \
+      -out_file nopath.gff chrD 2> nopath.err; then
+    fail $name "gaze failed"
+  elif ! grep -q "^##  No paths could be sampled" nopath.gff; then
+    fail $name "missing report that no paths could be sampled"
+  else
+    pass $name
+  fi
+}
+
+
+#
+# -beam: a beam wider than any scan changes nothing, a beam of 5 loses
+# next to no probability mass on the example, and -check_beam skips a
+# sequence whose END cannot be reached rather than counting a NaN
+#
+test_beam () {
+  name=beam
+  if ! run_gaze full.gff -probability -features || \
+     ! run_gaze wide.gff -probability -features -beam 100000 || \
+     ! run_gaze narrow.gff -beam 5 -check_beam || \
+     ! timeout 120 $GAZE -structure_file example_nopath.xml -gff_file example_a.gff \
+       -gff_file example_b.gff -dna_file example.fa -beam 5 -check_beam -samples 1 \
+       -out_file beam_nopath.gff chrD 2> beam_nopath.err; then
+    fail $name "gaze failed"
+  elif ! cmp -s full.gff wide.gff; then
+    fail $name "a beam wider than any scan changed the posteriors"
+  elif ! awk '/^Beam check:/ { found = 1; if ($NF + 0 > 1.0e-6) exit 1 }
+              END { exit !found }' narrow.gff.err; then
+    fail $name "-beam 5 lost more than 1e-6 of the probability mass"
+  elif ! grep -q "END cannot be reached, skipped" beam_nopath.err || \
+       grep -qi "nan" beam_nopath.err; then
+    fail $name "-check_beam mishandled a sequence with no path"
+  else
+    pass $name
+  fi
+}
+
+
+#
+# -threads: posteriors do not depend on the number of threads, with
+# the default pruning (made to bite harder by a narrow margin, so that
+# the backward pass invalidates features the forward pass would use)
+# and without it
+#
+test_threads () {
+  name=threads
+  for opts in "" "-beam_margin 5" "-full_calc"; do
+    for t in 1 4; do
+      if ! run_gaze post$t.gff -probability -features -threads $t $opts; then
+        fail $name "gaze failed (-threads $t $opts)"
+        return
+      fi
+    done
+    if ! cmp -s post1.gff post4.gff; then
+      fail $name "-threads 1 and -threads 4 differ (with \"$opts\")"
+      return
+    fi
+  done
+  pass $name
+}
+
+
+#
+# -selected_file with -threads on a single sequence: the dp is cut into
+# blocks at the Selected features and the blocks are run in parallel.
+# The output must match -threads 1, and -check_partition must find no
+# trace-back that differs from the full dp
+#
+test_partition () {
+  name=partition
+  for opts in "" "-probability" "-probability -features"; do
+    for t in 1 4; do
+      if [ $t -eq 1 ]; then check=""; else check="-check_partition"; fi
+      if ! timeout 120 $GAZE $EXAMPLE -selected_file example_selected.gff $opts \
+          -threads $t $check -out_file part$t.gff chrA 2> part$t.err; then
+        fail $name "gaze failed (-threads $t $opts)"
+        return
+      fi
+    done
+    if ! cmp -s part1.gff part4.gff; then
+      fail $name "-threads 1 and -threads 4 differ (with \"$opts\")"
+      return
+    elif ! awk '/^Partition check for chrA/ { found = 1; if ($0 !~ / 0 trace mismatches$/) exit 1 }
+                END { exit !found }' part4.err; then
+      fail $name "-check_partition found differences (with \"$opts\")"
+      return
+    fi
+  done
+  pass $name
+}
+
+
+#
+# -fast_exp: the kernel chosen for this machine agrees with libm to
+# within FAST_EXP_LOG_SUM_ERROR (check_log_sum_exp, run by -verbose),
+# and the posterior of every feature is within the empirical tolerance
+# of the one computed with libm
+#
+test_fast_exp () {
+  name=fast_exp
+  if ! run_gaze kernel.gff -fast_exp -verbose; then
+    fail $name "gaze failed"
+    return
+  fi
+  kernel=`sed -n 's/^Using \(.*\) for summing over paths$/\1/p' kernel.gff.err`
+  err=`sed -n 's/^Fast exp check: max log-sum-exp difference from libm \([^ ]*\) .*$/\1/p' kernel.gff.err`
+  if [ -z "$err" ]; then
+    fail $name "-verbose did not report the fast exp check"
+    return
+  elif ! awk "BEGIN { exit !($err <= $FAST_EXP_BOUND) }" || \
+       grep -q "exceeds its error bound" kernel.gff.err; then
+    fail $name "the $kernel kernel differs from libm by $err, more than $FAST_EXP_BOUND"
+    return
+  fi
+
+  if [ ! -x $GAZE_CHECK ]; then
+    fail $name "no gaze_check binary at $GAZE_CHECK"
+    return
+  fi
+  if ! run_gaze_check libm.gff -probability -features || \
+     ! run_gaze_check fast.gff -probability -features -fast_exp; then
+    fail $name "gaze_check failed"
+    return
+  fi
+  diff=`paste libm.gff fast.gff | awk -F'\t' '
+    $1 !~ /^#/ {
+      if ($1 != $9 || $3 != $11 || $4 != $12) mismatch = 1
+      d = $6 - $14; if (d < 0) d = -d; if (d > max) max = d
+    }
+    END { if (mismatch) print "mismatch"; else print max + 0 }'`
+  if [ "$diff" = mismatch ]; then
+    fail $name "the two runs reported different features"
+  elif ! awk "BEGIN { exit !($diff <= $FAST_EXP_POSTERIOR_TOLERANCE) }"; then
+    fail $name "posteriors differ by $diff, more than $FAST_EXP_POSTERIOR_TOLERANCE"
+  else
+    pass $name
+  fi
+}
+
+
+test_samples
+test_samples_no_path
+test_beam
+test_threads
+test_partition
+test_fast_exp
+
+if [ $failed -gt 0 ]; then
+  echo "$failed test(s) failed"
+  exit 1
+fi
+echo "all tests passed"
+exit 0